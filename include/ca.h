@@ -0,0 +1,499 @@
+/****************************************************************************
+ *
+ * ca.h - Bit-sliced kernels for binary cellular automata
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --------------------------------------------------------------------------
+ *
+ * This header implements the update step of two families of binary
+ * cellular automata (CA):
+ *
+ * - 1D elementary CA, where the new state of a cell depends on the
+ *   cell itself and its left and right neighbors. The rule is the
+ *   usual Wolfram code: bit `4*l + 2*c + r` of the 8-bit rule number is
+ *   the new state for the configuration `l c r` (e.g., rule 30).
+ *
+ * - 2D outer-totalistic CA on the Moore neighborhood, where the new
+ *   state depends on the cell itself and on the number of live cells
+ *   among its eight neighbors. The rule is given by two 9-bit masks:
+ *   bit `k` of `born` (resp. `survive`) is set if a dead (resp. live)
+ *   cell with `k` live neighbors becomes (resp. stays) alive. For
+ *   example, the Game of Life is "B3/S23", and the ANNEAL rule is
+ *   "B4678/S35678".
+ *
+ * Rules can also be obtained from a predicate with
+ * `ca1d_rule_from_predicate()` and `ca2d_rule_from_predicate()`, or
+ * parsed from a string with `ca2d_parse_rule()` (and written back with
+ * `ca2d_format_rule()`).
+ *
+ * Cells are bit-packed, CA_WORD_BITS cells per word, and the leftmost
+ * cell is the most significant bit; the whole word is updated with a
+ * few bitwise operations ("bit slicing"): a 1D rule is evaluated as a
+ * tree of multiplexers driven by the left, center and right
+ * neighbors, and a 2D rule by counting the neighbors with a network
+ * of bitwise adders and decoding the count. Storing a row with
+ * `ca_store_row()` yields a row of a P4 PBM image.
+ *
+ * The rule is evaluated by functions that are always inlined, so that
+ * when the rule is a compile-time constant the compiler drops the
+ * parts of the evaluation that are not needed and generates a kernel
+ * specialized for that rule. `ca1d_kernel()` returns such a
+ * kernel for each of the 256 elementary rules, and `ca2d_kernel()` for
+ * the Game of Life and ANNEAL; all other 2D rules use the generic
+ * kernel.
+ *
+ * Memory layout (all kernels):
+ *
+ * - 1D: an array of words; the kernels update the words `lo` to `hi`
+ *   (inclusive), reading words `lo - 1` and `hi + 1` as well.
+ *
+ * - 2D: rows of `stride` words each; the kernels update words `w_lo`
+ *   to `w_hi` of rows `row_lo` to `row_hi` (inclusive), reading one
+ *   word and one row beyond each end. `ca2d_wrap()` fills one ghost
+ *   row/word on each side of a grid with periodic boundaries.
+ *
+ * When compiled with OpenMP, the kernels are parallelized over words
+ * (1D) or rows (2D).
+ *
+ ****************************************************************************/
+
+#ifndef CA_H
+#define CA_H
+
+#include <stdint.h>
+#include <string.h>
+
+typedef uint64_t ca_word_t;
+#define CA_WORD_BITS 64
+
+#if defined(__GNUC__)
+#define CA_INLINE static inline __attribute__((always_inline))
+#else
+#define CA_INLINE static inline
+#endif
+
+#ifdef _OPENMP
+#define CA_OMP_FOR _Pragma("omp parallel for schedule(static)")
+#else
+#define CA_OMP_FOR
+#endif
+
+/* All ones if bit `b` of `x` is set, all zeros otherwise */
+#define CA_MASK(x, b) (-(ca_word_t)(((x) >> (b)) & 1))
+
+/* Words containing the left and right neighbors of the cells of `w[i]` */
+#define CA_LEFT(w, i) (((w)[i] >> 1) | ((w)[(i) - 1] << (CA_WORD_BITS - 1)))
+#define CA_RIGHT(w, i) (((w)[i] << 1) | ((w)[(i) + 1] >> (CA_WORD_BITS - 1)))
+
+/* Invoke X(r) for r = 0, ..., 255 */
+#define CA_FOR_EACH_RULE(X)                                                    \
+  X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13)    \
+  X(14) X(15) X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24) X(25)      \
+  X(26) X(27) X(28) X(29) X(30) X(31) X(32) X(33) X(34) X(35) X(36) X(37)      \
+  X(38) X(39) X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) X(48) X(49)      \
+  X(50) X(51) X(52) X(53) X(54) X(55) X(56) X(57) X(58) X(59) X(60) X(61)      \
+  X(62) X(63) X(64) X(65) X(66) X(67) X(68) X(69) X(70) X(71) X(72) X(73)      \
+  X(74) X(75) X(76) X(77) X(78) X(79) X(80) X(81) X(82) X(83) X(84) X(85)      \
+  X(86) X(87) X(88) X(89) X(90) X(91) X(92) X(93) X(94) X(95) X(96) X(97)      \
+  X(98) X(99) X(100) X(101) X(102) X(103) X(104) X(105) X(106) X(107) X(108)   \
+  X(109) X(110) X(111) X(112) X(113) X(114) X(115) X(116) X(117) X(118)        \
+  X(119) X(120) X(121) X(122) X(123) X(124) X(125) X(126) X(127) X(128)        \
+  X(129) X(130) X(131) X(132) X(133) X(134) X(135) X(136) X(137) X(138)        \
+  X(139) X(140) X(141) X(142) X(143) X(144) X(145) X(146) X(147) X(148)        \
+  X(149) X(150) X(151) X(152) X(153) X(154) X(155) X(156) X(157) X(158)        \
+  X(159) X(160) X(161) X(162) X(163) X(164) X(165) X(166) X(167) X(168)        \
+  X(169) X(170) X(171) X(172) X(173) X(174) X(175) X(176) X(177) X(178)        \
+  X(179) X(180) X(181) X(182) X(183) X(184) X(185) X(186) X(187) X(188)        \
+  X(189) X(190) X(191) X(192) X(193) X(194) X(195) X(196) X(197) X(198)        \
+  X(199) X(200) X(201) X(202) X(203) X(204) X(205) X(206) X(207) X(208)        \
+  X(209) X(210) X(211) X(212) X(213) X(214) X(215) X(216) X(217) X(218)        \
+  X(219) X(220) X(221) X(222) X(223) X(224) X(225) X(226) X(227) X(228)        \
+  X(229) X(230) X(231) X(232) X(233) X(234) X(235) X(236) X(237) X(238)        \
+  X(239) X(240) X(241) X(242) X(243) X(244) X(245) X(246) X(247) X(248)        \
+  X(249) X(250) X(251) X(252) X(253) X(254) X(255)
+
+/* Rule masks of some well-known 2D rules */
+#define CA_LIFE_BORN 0x008u      /* B3 */
+#define CA_LIFE_SURVIVE 0x00cu   /* S23 */
+#define CA_ANNEAL_BORN 0x1d0u    /* B4678 */
+#define CA_ANNEAL_SURVIVE 0x1e8u /* S35678 */
+
+/**
+ * Elementary rule whose new state for the configuration `l c r` is
+ * `f(l, c, r)` (nonzero means 1).
+ */
+static inline unsigned ca1d_rule_from_predicate(int (*f)(int, int, int)) {
+  unsigned rule = 0;
+  for (int p = 0; p < 8; p++) {
+    if (f((p >> 2) & 1, (p >> 1) & 1, p & 1)) {
+      rule |= 1u << p;
+    }
+  }
+  return rule;
+}
+
+/**
+ * Outer-totalistic rule whose new state for a cell in state `state`
+ * with `count` live neighbors is `f(state, count)`.
+ */
+static inline void ca2d_rule_from_predicate(
+    int (*f)(int, int),
+    unsigned* born,
+    unsigned* survive
+) {
+  *born = *survive = 0;
+  for (int k = 0; k <= 8; k++) {
+    if (f(0, k)) {
+      *born |= 1u << k;
+    }
+    if (f(1, k)) {
+      *survive |= 1u << k;
+    }
+  }
+}
+
+/**
+ * Parse a 2D rule in the "B.../S..." notation (e.g., "B3/S23"); the
+ * names "life" and "anneal" are also accepted. Return 0 on success, -1
+ * if `s` is not a valid rule.
+ */
+static inline int ca2d_parse_rule(
+    const char* s,
+    unsigned* born,
+    unsigned* survive
+) {
+  if (strcmp(s, "life") == 0) {
+    *born = CA_LIFE_BORN;
+    *survive = CA_LIFE_SURVIVE;
+    return 0;
+  }
+  if (strcmp(s, "anneal") == 0) {
+    *born = CA_ANNEAL_BORN;
+    *survive = CA_ANNEAL_SURVIVE;
+    return 0;
+  }
+  if (*s != 'B' && *s != 'b') {
+    return -1;
+  }
+  *born = *survive = 0;
+  for (s++; *s >= '0' && *s <= '8'; s++) {
+    *born |= 1u << (*s - '0');
+  }
+  if (*s++ != '/' || (*s != 'S' && *s != 's')) {
+    return -1;
+  }
+  for (s++; *s >= '0' && *s <= '8'; s++) {
+    *survive |= 1u << (*s - '0');
+  }
+  return (*s == '\0' ? 0 : -1);
+}
+
+/**
+ * Write the 2D rule (`born`, `survive`) in the "B.../S..." notation
+ * into `s`, which must have room for at least 22 characters.
+ */
+static inline void ca2d_format_rule(unsigned born, unsigned survive, char* s) {
+  *s++ = 'B';
+  for (int k = 0; k <= 8; k++) {
+    if (born & (1u << k)) {
+      *s++ = '0' + k;
+    }
+  }
+  *s++ = '/';
+  *s++ = 'S';
+  for (int k = 0; k <= 8; k++) {
+    if (survive & (1u << k)) {
+      *s++ = '0' + k;
+    }
+  }
+  *s = '\0';
+}
+
+/**
+ * New state of the cells of `c`, whose left and right neighbors are
+ * in `l` and `r`, according to the elementary rule `rule`. The
+ * configuration `l c r` selects bit `4*l + 2*c + r` of the rule,
+ * which is done with a tree of multiplexers (one level per input).
+ */
+CA_INLINE ca_word_t ca1d_eval(
+    unsigned rule,
+    ca_word_t l,
+    ca_word_t c,
+    ca_word_t r
+) {
+  const ca_word_t f00 = (r & CA_MASK(rule, 1)) | (~r & CA_MASK(rule, 0));
+  const ca_word_t f01 = (r & CA_MASK(rule, 3)) | (~r & CA_MASK(rule, 2));
+  const ca_word_t f10 = (r & CA_MASK(rule, 5)) | (~r & CA_MASK(rule, 4));
+  const ca_word_t f11 = (r & CA_MASK(rule, 7)) | (~r & CA_MASK(rule, 6));
+  const ca_word_t g0 = (c & f01) | (~c & f00);
+  const ca_word_t g1 = (c & f11) | (~c & f10);
+  return (l & g1) | (~l & g0);
+}
+
+/*
+ * Body of a kernel that updates the words `lo` to `hi` of `cur` into
+ * `next` with the elementary rule `rule`. This is a macro, so that
+ * when `rule` is a constant it appears as such within the parallel
+ * loop (OpenMP moves the loop into a separate function, where a
+ * parameter would no longer be a constant).
+ */
+#define CA1D_LOOP(rule, cur, next, lo, hi)                                     \
+  CA_OMP_FOR                                                                   \
+  for (int i = (lo); i <= (hi); i++) {                                         \
+    (next)[i] =                                                                \
+        ca1d_eval((rule), CA_LEFT(cur, i), (cur)[i], CA_RIGHT(cur, i));        \
+  }
+
+/**
+ * New state of the cells of `c` according to the outer-totalistic
+ * rule (`born`, `survive`), where the number of live neighbors of each
+ * cell is `s0 + 2*s1 + 4*s2 + 8*s3`.
+ */
+CA_INLINE ca_word_t ca2d_eval(
+    unsigned born,
+    unsigned survive,
+    ca_word_t c,
+    ca_word_t s0,
+    ca_word_t s1,
+    ca_word_t s2,
+    ca_word_t s3
+) {
+  ca_word_t out = 0;
+  for (int k = 0; k <= 8; k++) {
+    const ca_word_t eq = ((k & 1) ? s0 : ~s0) & ((k & 2) ? s1 : ~s1) &
+                         ((k & 4) ? s2 : ~s2) & ((k & 8) ? s3 : ~s3);
+    out |= eq & ((CA_MASK(born, k) & ~c) | (CA_MASK(survive, k) & c));
+  }
+  return out;
+}
+
+/**
+ * Update words `w_lo` to `w_hi` of the row `mid` into `out` with the
+ * outer-totalistic rule (`born`, `survive`); `up` and `dn` are the
+ * rows above and below.
+ */
+CA_INLINE void ca2d_row(
+    unsigned born,
+    unsigned survive,
+    const ca_word_t* up,
+    const ca_word_t* mid,
+    const ca_word_t* dn,
+    ca_word_t* out,
+    int w_lo,
+    int w_hi
+) {
+  for (int j = w_lo; j <= w_hi; j++) {
+    /* Count the neighbors: full adders on the rows above and
+       below, a half adder on the current row, then add the
+       partial sums by weight. */
+    const ca_word_t ul = CA_LEFT(up, j), uc = up[j], ur = CA_RIGHT(up, j);
+    const ca_word_t dl = CA_LEFT(dn, j), dc = dn[j], dr = CA_RIGHT(dn, j);
+    const ca_word_t ml = CA_LEFT(mid, j), mr = CA_RIGHT(mid, j);
+    const ca_word_t su = ul ^ uc ^ ur;
+    const ca_word_t cu = (ul & uc) | (ur & (ul ^ uc));
+    const ca_word_t sd = dl ^ dc ^ dr;
+    const ca_word_t cd = (dl & dc) | (dr & (dl ^ dc));
+    const ca_word_t sm = ml ^ mr;
+    const ca_word_t cm = ml & mr;
+    /* weight 1 */
+    const ca_word_t s0 = su ^ sd ^ sm;
+    const ca_word_t k1 = (su & sd) | (sm & (su ^ sd));
+    /* weight 2: cu + cd + cm + k1 */
+    const ca_word_t t0 = cu ^ cd ^ cm;
+    const ca_word_t t1 = (cu & cd) | (cm & (cu ^ cd));
+    const ca_word_t s1 = t0 ^ k1;
+    const ca_word_t k2 = t0 & k1;
+    const ca_word_t s2 = t1 ^ k2;
+    const ca_word_t s3 = t1 & k2;
+    out[j] = ca2d_eval(born, survive, mid[j], s0, s1, s2, s3);
+  }
+}
+
+/*
+ * Body of a kernel that updates words `w_lo` to `w_hi` of rows `r_lo`
+ * to `r_hi` of the grid `cur` (whose rows have `stride` words) into
+ * `next` with the outer-totalistic rule (`born`, `survive`). See
+ * `CA1D_LOOP()` for why this is a macro.
+ */
+#define CA2D_LOOP(born, survive, cur, next, stride, r_lo, r_hi, w_lo, w_hi)    \
+  CA_OMP_FOR                                                                   \
+  for (int i = (r_lo); i <= (r_hi); i++) {                                     \
+    ca2d_row(                                                                  \
+        (born),                                                                \
+        (survive),                                                             \
+        (cur) + (size_t)(i - 1) * (stride),                                    \
+        (cur) + (size_t)i * (stride),                                          \
+        (cur) + (size_t)(i + 1) * (stride),                                    \
+        (next) + (size_t)i * (stride),                                         \
+        (w_lo),                                                                \
+        (w_hi)                                                                 \
+    );                                                                         \
+  }
+
+typedef void (*ca1d_kernel_t)(
+    unsigned rule,
+    const ca_word_t* cur,
+    ca_word_t* next,
+    int lo,
+    int hi
+);
+
+typedef void (*ca2d_kernel_t)(
+    unsigned born,
+    unsigned survive,
+    const ca_word_t* cur,
+    ca_word_t* next,
+    int stride,
+    int row_lo,
+    int row_hi,
+    int w_lo,
+    int w_hi
+);
+
+/* Generic kernels, that evaluate the rule passed as parameter */
+static inline void ca1d_step_generic(
+    unsigned rule,
+    const ca_word_t* cur,
+    ca_word_t* next,
+    int lo,
+    int hi
+) {
+  CA1D_LOOP(rule, cur, next, lo, hi)
+}
+
+static inline void ca2d_step_generic(
+    unsigned born,
+    unsigned survive,
+    const ca_word_t* cur,
+    ca_word_t* next,
+    int stride,
+    int row_lo,
+    int row_hi,
+    int w_lo,
+    int w_hi
+) {
+  CA2D_LOOP(born, survive, cur, next, stride, row_lo, row_hi, w_lo, w_hi)
+}
+
+/* Specialized kernels; the rule parameters are ignored */
+#define CA1D_SPECIALIZE(r)                                                     \
+  static inline void ca1d_step_##r(                                            \
+      unsigned rule,                                                           \
+      const ca_word_t* cur,                                                    \
+      ca_word_t* next,                                                         \
+      int lo,                                                                  \
+      int hi                                                                   \
+  ) {                                                                          \
+    (void)rule;                                                                \
+    CA1D_LOOP(r, cur, next, lo, hi)                                            \
+  }
+CA_FOR_EACH_RULE(CA1D_SPECIALIZE)
+
+#define CA2D_SPECIALIZE(name, b, s)                                            \
+  static inline void ca2d_step_##name(                                         \
+      unsigned born,                                                           \
+      unsigned survive,                                                        \
+      const ca_word_t* cur,                                                    \
+      ca_word_t* next,                                                         \
+      int stride,                                                              \
+      int row_lo,                                                              \
+      int row_hi,                                                              \
+      int w_lo,                                                                \
+      int w_hi                                                                 \
+  ) {                                                                          \
+    (void)born;                                                                \
+    (void)survive;                                                             \
+    CA2D_LOOP(b, s, cur, next, stride, row_lo, row_hi, w_lo, w_hi)             \
+  }
+CA2D_SPECIALIZE(life, CA_LIFE_BORN, CA_LIFE_SURVIVE)
+CA2D_SPECIALIZE(anneal, CA_ANNEAL_BORN, CA_ANNEAL_SURVIVE)
+
+/**
+ * Return the kernel specialized for the elementary rule `rule`.
+ */
+static inline ca1d_kernel_t ca1d_kernel(unsigned rule) {
+#define CA1D_ENTRY(r) ca1d_step_##r,
+  static const ca1d_kernel_t kernels[256] = {CA_FOR_EACH_RULE(CA1D_ENTRY)};
+#undef CA1D_ENTRY
+  return kernels[rule & 0xff];
+}
+
+/**
+ * Return the kernel specialized for the 2D rule (`born`, `survive`),
+ * if any, or the generic one.
+ */
+static inline ca2d_kernel_t ca2d_kernel(unsigned born, unsigned survive) {
+  if (born == CA_LIFE_BORN && survive == CA_LIFE_SURVIVE) {
+    return ca2d_step_life;
+  }
+  if (born == CA_ANNEAL_BORN && survive == CA_ANNEAL_SURVIVE) {
+    return ca2d_step_anneal;
+  }
+  return ca2d_step_generic;
+}
+
+/**
+ * Fill the ghost rows and words of a grid of `ny` rows of `nw` words
+ * (plus one ghost word/row on each side, so the row stride is `nw +
+ * 2`) with periodic boundary conditions.
+ */
+static inline void ca2d_wrap(ca_word_t* grid, int nw, int ny) {
+  const int stride = nw + 2;
+  for (int i = 1; i <= ny; i++) {
+    ca_word_t* row = grid + (size_t)i * stride;
+    row[0] = row[nw];
+    row[nw + 1] = row[1];
+  }
+  /* copy whole rows, including the ghost words, so that the corners
+     are filled as well */
+  memcpy(grid, grid + (size_t)ny * stride, stride * sizeof(*grid));
+  memcpy(
+      grid + (size_t)(ny + 1) * stride,
+      grid + stride,
+      stride * sizeof(*grid)
+  );
+}
+
+/**
+ * Store `nw` words as `nw * CA_WORD_BITS / 8` bytes, most significant
+ * byte first; this is the layout of a row of a P4 PBM image.
+ */
+static inline void ca_store_row(
+    const ca_word_t* w,
+    int nw,
+    unsigned char* out
+) {
+  for (int i = 0; i < nw; i++) {
+    for (int b = 0; b < CA_WORD_BITS / 8; b++) {
+      *out++ = (unsigned char)(w[i] >> (CA_WORD_BITS - 8 * (b + 1)));
+    }
+  }
+}
+
+/**
+ * Pseudo-random state of cell (`x`, `y`), alive with probability
+ * about `p`; the result does not depend on how the grid is
+ * partitioned.
+ */
+static inline int ca_random_cell(uint64_t x, uint64_t y, double p) {
+  /* splitmix64 finalizer */
+  uint64_t z = (y << 32) + x + 0x9e3779b97f4a7c15ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  z ^= z >> 31;
+  return (z >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+#endif
@@ -0,0 +1,325 @@
+/****************************************************************************
+ *
+ * halo.h - Non-blocking ghost cell exchange for MPI stencil programs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --------------------------------------------------------------------------
+ *
+ * This header fills the ghost cells of a 1D or 2D domain decomposed
+ * across MPI processes. The local domain of each process is a
+ * contiguous array of elements of any MPI datatype, surrounded by
+ * `ghost` ghost elements on each side:
+ *
+ * - 1D: `n + 2*ghost` elements; the interior is `[ghost, ghost + n)`.
+ *
+ * - 2D: `ny + 2*ghost` rows of `nx + 2*ghost` elements each (row-major
+ *   order); the interior rows and columns are `[ghost, ghost + ny)` and
+ *   `[ghost, ghost + nx)`. The ghosts are received from all the eight
+ *   neighbors, including the diagonal ones, so that 9-point stencils
+ *   can be used.
+ *
+ * The regions to be sent and received are described by derived
+ * datatypes created once by `halo_init_1d()` or `halo_init_2d()`, so
+ * that no packing is required. A typical step is:
+ *
+ *     halo_start(&h, cur);       // post MPI_Irecv()/MPI_Isend()
+ *     ...                        // update the cells that do not
+ *                                // depend on the ghosts
+ *     halo_wait(&h);             // the ghosts are now valid
+ *     ...                        // update the remaining cells
+ *
+ * `halo_exchange()` does both at once. The buffer must not be
+ * modified between `halo_start()` and `halo_wait()`.
+ *
+ * The time spent inside `halo_start()` and `halo_wait()`, i.e., the
+ * communication time that was not overlapped with computation, is
+ * accumulated in `h.t_exposed`. `halo_calibrate()` measures the time
+ * of a blocking exchange, so that the fraction of the communication
+ * that was hidden can be estimated as
+ *
+ *     1 - h.t_exposed / (h.nexchanges * halo_calibrate(&h, buf, nreps))
+ *
+ * The initialization functions print a diagnostic on stderr and
+ * return -1 on failure, 0 on success.
+ *
+ ****************************************************************************/
+
+#ifndef HALO_H
+#define HALO_H
+
+#include <mpi.h>
+#include <stdio.h>
+
+#define HALO_MAX_NEIGHBORS 8
+
+typedef struct {
+  MPI_Comm comm;
+  int nneighbors;                                /* 2 (1D) or 8 (2D) */
+  int neighbor[HALO_MAX_NEIGHBORS];              /* may be MPI_PROC_NULL */
+  MPI_Datatype send_type[HALO_MAX_NEIGHBORS];    /* border sent */
+  MPI_Datatype recv_type[HALO_MAX_NEIGHBORS];    /* ghosts received */
+  MPI_Request req[2 * HALO_MAX_NEIGHBORS];
+  int nexchanges;   /* number of calls to `halo_start()` */
+  double t_exposed; /* time spent in `halo_start()` and `halo_wait()` */
+} halo_t;
+
+/**
+ * Create the datatype of the region of a local domain of `ndims`
+ * dimensions (with `n[d]` interior elements and `ghost` ghosts on
+ * each side along dimension `d`) that lies in direction `dir[]` (each
+ * component is -1, 0 or +1). If `border` is nonzero, the region is
+ * the part of the interior that the neighbor in that direction needs;
+ * otherwise, it is the ghost region filled by that neighbor.
+ */
+static inline void halo_region(
+    int ndims,
+    const int* n,
+    int ghost,
+    const int* dir,
+    int border,
+    MPI_Datatype type,
+    MPI_Datatype* region
+) {
+  int sizes[2], subsizes[2], starts[2];
+
+  for (int d = 0; d < ndims; d++) {
+    sizes[d] = n[d] + 2 * ghost;
+    if (dir[d] == 0) {
+      subsizes[d] = n[d];
+      starts[d] = ghost;
+    } else {
+      subsizes[d] = ghost;
+      if (dir[d] < 0) {
+        starts[d] = (border ? ghost : 0);
+      } else {
+        starts[d] = (border ? n[d] : n[d] + ghost);
+      }
+    }
+  }
+  MPI_Type_create_subarray(
+      ndims,
+      sizes,
+      subsizes,
+      starts,
+      MPI_ORDER_C,
+      type,
+      region
+  );
+  MPI_Type_commit(region);
+}
+
+/**
+ * Common part of `halo_init_1d()` and `halo_init_2d()`. `dirs[]`
+ * contains the `nneighbors` directions (`ndims` components each),
+ * ordered so that the opposite of direction `k` is direction
+ * `nneighbors - 1 - k`.
+ */
+static inline int halo_init(
+    halo_t* h,
+    MPI_Comm comm,
+    int ndims,
+    const int* n,
+    int ghost,
+    MPI_Datatype type,
+    int nneighbors,
+    const int* dirs,
+    const int* neighbor
+) {
+  for (int d = 0; d < ndims; d++) {
+    if (ghost < 1 || ghost > n[d]) {
+      fprintf(
+          stderr,
+          "halo: the ghost width (%d) must be between 1 and %d\n",
+          ghost,
+          n[d]
+      );
+      return -1;
+    }
+  }
+  h->comm = comm;
+  h->nneighbors = nneighbors;
+  h->nexchanges = 0;
+  h->t_exposed = 0.0;
+  for (int k = 0; k < nneighbors; k++) {
+    h->neighbor[k] = neighbor[k];
+    halo_region(ndims, n, ghost, &dirs[k * ndims], 1, type, &h->send_type[k]);
+    halo_region(ndims, n, ghost, &dirs[k * ndims], 0, type, &h->recv_type[k]);
+  }
+  return 0;
+}
+
+/**
+ * Prepare the exchange of the ghosts of a 1D domain with `n` interior
+ * elements of type `type` and `ghost` ghosts on each side, distributed
+ * across the processes of `comm` in rank order. If `periodic` is
+ * nonzero, the first and last process are neighbors; otherwise their
+ * outer ghosts are left untouched.
+ */
+static inline int halo_init_1d(
+    halo_t* h,
+    MPI_Comm comm,
+    int n,
+    int ghost,
+    MPI_Datatype type,
+    int periodic
+) {
+  static const int dirs[2] = {-1, +1};
+  int rank, size, neighbor[2];
+
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+  neighbor[0] = (rank - 1 + size) % size;
+  neighbor[1] = (rank + 1) % size;
+  if (!periodic && rank == 0) {
+    neighbor[0] = MPI_PROC_NULL;
+  }
+  if (!periodic && rank == size - 1) {
+    neighbor[1] = MPI_PROC_NULL;
+  }
+  return halo_init(h, comm, 1, &n, ghost, type, 2, dirs, neighbor);
+}
+
+/**
+ * Prepare the exchange of the ghosts of a 2D domain with `ny` x `nx`
+ * interior elements of type `type` and `ghost` ghost rows/columns on
+ * each side. `cart` must be a 2D Cartesian communicator (see
+ * `MPI_Cart_create()`); dimension 0 is the vertical one (rows) and
+ * dimension 1 the horizontal one (columns). Periodicity is taken from
+ * `cart`.
+ */
+static inline int halo_init_2d(
+    halo_t* h,
+    MPI_Comm cart,
+    int nx,
+    int ny,
+    int ghost,
+    MPI_Datatype type
+) {
+  int dims[2], periods[2], coords[2], c[2];
+  int dirs[2 * HALO_MAX_NEIGHBORS], neighbor[HALO_MAX_NEIGHBORS];
+  const int n[2] = {ny, nx};
+  int k = 0;
+
+  MPI_Cart_get(cart, 2, dims, periods, coords);
+  for (int dy = -1; dy <= 1; dy++) {
+    for (int dx = -1; dx <= 1; dx++) {
+      if (dy == 0 && dx == 0) {
+        continue;
+      }
+      dirs[2 * k] = dy;
+      dirs[2 * k + 1] = dx;
+      c[0] = coords[0] + dy;
+      c[1] = coords[1] + dx;
+      neighbor[k] = MPI_PROC_NULL;
+      if ((periods[0] || (c[0] >= 0 && c[0] < dims[0])) &&
+          (periods[1] || (c[1] >= 0 && c[1] < dims[1]))) {
+        c[0] = (c[0] + dims[0]) % dims[0];
+        c[1] = (c[1] + dims[1]) % dims[1];
+        MPI_Cart_rank(cart, c, &neighbor[k]);
+      }
+      k++;
+    }
+  }
+  return halo_init(h, cart, 2, n, ghost, type, k, dirs, neighbor);
+}
+
+/**
+ * Start filling the ghosts of the local domain `buf`.
+ */
+static inline void halo_start(halo_t* h, void* buf) {
+  const double tstart = MPI_Wtime();
+  const int nn = h->nneighbors;
+
+  /* The data sent in direction `k` (with tag `k`) arrive from the
+     opposite direction `nn - 1 - k` */
+  for (int k = 0; k < nn; k++) {
+    MPI_Irecv(
+        buf,
+        1,
+        h->recv_type[k],
+        h->neighbor[k],
+        nn - 1 - k,
+        h->comm,
+        &h->req[k]
+    );
+  }
+  for (int k = 0; k < nn; k++) {
+    MPI_Isend(
+        buf,
+        1,
+        h->send_type[k],
+        h->neighbor[k],
+        k,
+        h->comm,
+        &h->req[nn + k]
+    );
+  }
+  h->nexchanges++;
+  h->t_exposed += MPI_Wtime() - tstart;
+}
+
+/**
+ * Wait for the completion of the exchange started by `halo_start()`.
+ */
+static inline void halo_wait(halo_t* h) {
+  const double tstart = MPI_Wtime();
+  MPI_Waitall(2 * h->nneighbors, h->req, MPI_STATUSES_IGNORE);
+  h->t_exposed += MPI_Wtime() - tstart;
+}
+
+/**
+ * Fill the ghosts of `buf`, without overlapping.
+ */
+static inline void halo_exchange(halo_t* h, void* buf) {
+  halo_start(h, buf);
+  halo_wait(h);
+}
+
+/**
+ * Return the average time of `nreps` blocking exchanges on `buf`,
+ * maximized across the processes of the communicator. The content of
+ * the ghosts of `buf` is overwritten; the statistics of `h` are not
+ * affected.
+ */
+static inline double halo_calibrate(halo_t* h, void* buf, int nreps) {
+  const int nexchanges = h->nexchanges;
+  const double t_exposed = h->t_exposed;
+  double t;
+
+  MPI_Barrier(h->comm);
+  const double tstart = MPI_Wtime();
+  for (int r = 0; r < nreps; r++) {
+    halo_exchange(h, buf);
+  }
+  t = (MPI_Wtime() - tstart) / nreps;
+  MPI_Allreduce(MPI_IN_PLACE, &t, 1, MPI_DOUBLE, MPI_MAX, h->comm);
+  h->nexchanges = nexchanges;
+  h->t_exposed = t_exposed;
+  return t;
+}
+
+/**
+ * Release the datatypes created by `halo_init_1d()` or
+ * `halo_init_2d()`.
+ */
+static inline void halo_free(halo_t* h) {
+  for (int k = 0; k < h->nneighbors; k++) {
+    MPI_Type_free(&h->send_type[k]);
+    MPI_Type_free(&h->recv_type[k]);
+  }
+  h->nneighbors = 0;
+}
+
+#endif
@@ -0,0 +1,401 @@
+/****************************************************************************
+ *
+ * pnmio.h - Zero-copy PGM/PPM image I/O for the HPC labs
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --------------------------------------------------------------------------
+ *
+ * This header reads and writes binary PGM (P5, one byte per pixel) and
+ * PPM (P6, three bytes per pixel) images with maxval <= 255, without
+ * copying the pixels through stdio buffers:
+ *
+ * - `pnm_open()` / `pnm_open_fd()` memory-map an existing image and
+ *   expose its payload as `img.pixels`. The mapping is private, so the
+ *   pixels can be modified in place without touching the file. Inputs
+ *   that can not be mapped (e.g., pipes) are read into memory.
+ *
+ * - `pnm_create()` creates an image file of the given size and maps it;
+ *   whatever is stored in `img.pixels` ends up in the file. The header
+ *   is padded with a comment so that `img.pixels` is aligned to
+ *   `PNM_ALIGN` bytes.
+ *
+ * - `pnm_write_fd()` writes an image to a file descriptor with a single
+ *   `writev()`; use it for standard output.
+ *
+ * - `pnm_close()` releases an image obtained from the functions above.
+ *
+ * The header parser follows the Netpbm specification: fields can be
+ * separated by any amount of whitespace and `#` comments.
+ *
+ * All functions print a diagnostic on stderr and return -1 on
+ * failure, 0 on success.
+ *
+ * IMPORTANT NOTE: this header uses POSIX functions; therefore, when
+ * compiling with `-std=c99` you MUST add
+ *
+ * #if _XOPEN_SOURCE < 600
+ * #define _XOPEN_SOURCE 600
+ * #endif
+ *
+ * at the beginning of your program, BEFORE any other include, and add
+ * the `include/` directory of this repository to the include path
+ * (e.g., `-I../../include`).
+ *
+ ****************************************************************************/
+
+#ifndef PNMIO_H
+#define PNMIO_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Alignment of the payload of the images created by `pnm_create()` */
+#define PNM_ALIGN 64
+
+/* Maximum length of the comment stored in a header, and of a header */
+#define PNM_COMMENT_MAX 64
+#define PNM_HEADER_MAX (128 + PNM_COMMENT_MAX + PNM_ALIGN)
+
+typedef struct {
+  int type;              /* 5 (PGM) or 6 (PPM) */
+  int width;             /* width of the image (in pixels) */
+  int height;            /* height of the image (in pixels) */
+  int maxval;            /* maximum sample value (at most 255) */
+  unsigned char* pixels; /* width*height*channels bytes, row-major */
+  size_t size;           /* size of the payload (in bytes) */
+  void* base;            /* start of the mapping or buffer */
+  size_t len;            /* length of the mapping or buffer */
+  int mapped;            /* nonzero iff `base` has been mmap()ed */
+} pnm_image_t;
+
+/* Number of bytes per pixel of an image of type `type` */
+static inline int pnm_channels(int type) { return (type == 6 ? 3 : 1); }
+
+static inline int pnm_isspace(int c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+         c == '\r';
+}
+
+/**
+ * Parse the next unsigned decimal field of a header starting at
+ * `buf[*pos]`, skipping whitespace and comments; return -1 if there is
+ * no valid number, or if it is larger than `limit`.
+ */
+static inline int pnm_header_field(
+    const unsigned char* buf, size_t len, size_t* pos, long limit
+) {
+  size_t i = *pos;
+  long val = 0;
+
+  for (;;) {
+    while (i < len && pnm_isspace(buf[i])) i++;
+    if (i < len && buf[i] == '#') {
+      while (i < len && buf[i] != '\n' && buf[i] != '\r') i++;
+    } else {
+      break;
+    }
+  }
+  if (i >= len || buf[i] < '0' || buf[i] > '9') return -1;
+  while (i < len && buf[i] >= '0' && buf[i] <= '9') {
+    val = val * 10 + (buf[i] - '0');
+    if (val > limit) return -1;
+    i++;
+  }
+  *pos = i;
+  return (int)val;
+}
+
+/**
+ * Parse the header of the image stored in `buf[0..len-1]` and set the
+ * fields of `img` accordingly; `name` is only used in diagnostics.
+ */
+static inline int pnm_parse(
+    const char* name, unsigned char* buf, size_t len, pnm_image_t* img
+) {
+  size_t pos = 2;
+
+  if (len < 2 || buf[0] != 'P' || (buf[1] != '5' && buf[1] != '6')) {
+    fprintf(stderr, "pnmio: %s: not a binary PGM/PPM file\n", name);
+    return -1;
+  }
+  img->type = buf[1] - '0';
+  img->width = pnm_header_field(buf, len, &pos, INT32_MAX);
+  img->height = pnm_header_field(buf, len, &pos, INT32_MAX);
+  img->maxval = pnm_header_field(buf, len, &pos, 65535);
+  /* exactly one whitespace character separates header and payload */
+  if (img->width <= 0 || img->height <= 0 || img->maxval <= 0 ||
+      pos >= len || !pnm_isspace(buf[pos])) {
+    fprintf(stderr, "pnmio: %s: malformed header\n", name);
+    return -1;
+  }
+  if (img->maxval > 255) {
+    fprintf(
+        stderr,
+        "pnmio: %s: maxval %d > 255 not supported\n",
+        name,
+        img->maxval
+    );
+    return -1;
+  }
+  pos++;
+  const size_t row = (size_t)img->width * pnm_channels(img->type);
+  if ((size_t)img->height > (SIZE_MAX - pos) / row ||
+      row * img->height > len - pos) {
+    fprintf(stderr, "pnmio: %s: truncated image\n", name);
+    return -1;
+  }
+  img->size = row * img->height;
+  img->pixels = buf + pos;
+  return 0;
+}
+
+/* Release the image `img` */
+static inline int pnm_close(pnm_image_t* img) {
+  int ret = 0;
+
+  if (img->mapped) {
+    ret = munmap(img->base, img->len);
+  } else {
+    free(img->base);
+  }
+  memset(img, 0, sizeof(*img));
+  return ret;
+}
+
+/**
+ * Open the image that can be read from file descriptor `fd`; `name` is
+ * only used in diagnostics. The descriptor can be closed afterwards.
+ */
+static inline int pnm_open_fd(int fd, const char* name, pnm_image_t* img) {
+  struct stat st;
+
+  memset(img, 0, sizeof(*img));
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* p = mmap(
+        NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0
+    );
+    if (p == MAP_FAILED) {
+      fprintf(stderr, "pnmio: %s: mmap: %s\n", name, strerror(errno));
+      return -1;
+    }
+    img->base = p;
+    img->len = st.st_size;
+    img->mapped = 1;
+  } else {
+    /* not a regular file: read everything into memory */
+    size_t cap = 1 << 20, len = 0;
+    unsigned char* buf = (unsigned char*)malloc(cap);
+    ssize_t nread;
+
+    while (buf != NULL && (nread = read(fd, buf + len, cap - len)) != 0) {
+      if (nread < 0) {
+        if (errno == EINTR) continue;
+        fprintf(stderr, "pnmio: %s: read: %s\n", name, strerror(errno));
+        free(buf);
+        return -1;
+      }
+      len += nread;
+      if (len == cap) {
+        unsigned char* tmp = (unsigned char*)realloc(buf, cap *= 2);
+        if (tmp == NULL) free(buf);
+        buf = tmp;
+      }
+    }
+    if (buf == NULL) {
+      fprintf(stderr, "pnmio: %s: out of memory\n", name);
+      return -1;
+    }
+    img->base = buf;
+    img->len = len;
+    img->mapped = 0;
+  }
+  if (pnm_parse(name, (unsigned char*)img->base, img->len, img) != 0) {
+    pnm_close(img);
+    return -1;
+  }
+  return 0;
+}
+
+/* Open the image stored in file `fname` */
+static inline int pnm_open(const char* fname, pnm_image_t* img) {
+  const int fd = open(fname, O_RDONLY);
+
+  memset(img, 0, sizeof(*img));
+  if (fd < 0) {
+    fprintf(stderr, "pnmio: %s: %s\n", fname, strerror(errno));
+    return -1;
+  }
+  const int ret = pnm_open_fd(fd, fname, img);
+  close(fd);
+  return ret;
+}
+
+/**
+ * Format into `hdr` (at least PNM_HEADER_MAX bytes) the header of an
+ * image of type `type`, size `width` x `height` and maximum sample
+ * value `maxval`. If `comment` is not NULL, its first line (at most
+ * PNM_COMMENT_MAX characters) is stored as a `#` comment. If `align` >
+ * 0, the comment is padded with blanks (or a blank comment is added)
+ * so that the length of the header is a multiple of `align`. Return
+ * the length of the header.
+ */
+static inline size_t pnm_format_header(
+    char* hdr,
+    int type,
+    int width,
+    int height,
+    int maxval,
+    const char* comment,
+    size_t align
+) {
+  char dims[64];
+  const int dlen =
+      snprintf(dims, sizeof(dims), "%d %d\n%d\n", width, height, maxval);
+  size_t len = 3;
+
+  memcpy(hdr, (type == 6 ? "P6\n" : "P5\n"), 3);
+  if (comment != NULL || align > 0) {
+    hdr[len++] = '#';
+    if (comment != NULL) {
+      hdr[len++] = ' ';
+      for (int i = 0; i < PNM_COMMENT_MAX && comment[i] != '\0' &&
+                      comment[i] != '\n' && comment[i] != '\r';
+           i++) {
+        hdr[len++] = comment[i];
+      }
+    }
+    /* the comment line ends with '\n' */
+    if (align > 0) {
+      const size_t pad = (align - (len + 1 + dlen) % align) % align;
+      memset(hdr + len, ' ', pad);
+      len += pad;
+    }
+    hdr[len++] = '\n';
+  }
+  memcpy(hdr + len, dims, dlen);
+  return len + dlen;
+}
+
+/**
+ * Create file `fname` holding an image of type `type` (5 or 6), size
+ * `width` x `height` and maximum sample value `maxval`, with the
+ * (optional) header comment `comment`, and map it in memory. The
+ * pixels can be filled through `img->pixels`, and are saved to the
+ * file by `pnm_close()` (or earlier, at the discretion of the OS).
+ *
+ * An existing file is truncated: `fname` must not be an image that is
+ * still open with `pnm_open()`, whose pixels would be lost.
+ */
+static inline int pnm_create(
+    const char* fname,
+    int type,
+    int width,
+    int height,
+    int maxval,
+    const char* comment,
+    pnm_image_t* img
+) {
+  char hdr[PNM_HEADER_MAX];
+  const size_t hlen = pnm_format_header(
+      hdr, type, width, height, maxval, comment, PNM_ALIGN
+  );
+  const size_t size = (size_t)width * height * pnm_channels(type);
+  const int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+  memset(img, 0, sizeof(*img));
+  if (fd < 0) {
+    fprintf(stderr, "pnmio: %s: %s\n", fname, strerror(errno));
+    return -1;
+  }
+  if (ftruncate(fd, hlen + size) != 0) {
+    fprintf(stderr, "pnmio: %s: ftruncate: %s\n", fname, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  void* p = mmap(NULL, hlen + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "pnmio: %s: mmap: %s\n", fname, strerror(errno));
+    return -1;
+  }
+  memcpy(p, hdr, hlen);
+  img->type = type;
+  img->width = width;
+  img->height = height;
+  img->maxval = maxval;
+  img->pixels = (unsigned char*)p + hlen;
+  img->size = size;
+  img->base = p;
+  img->len = hlen + size;
+  img->mapped = 1;
+  return 0;
+}
+
+/**
+ * Write an image of type `type`, size `width` x `height` and maximum
+ * sample value `maxval`, with the (optional) header comment `comment`,
+ * whose payload is `pixels`, to file descriptor `fd`. Header and
+ * payload are written with a single writev() call, repeated only on
+ * short writes.
+ */
+static inline int pnm_write_fd(
+    int fd,
+    int type,
+    int width,
+    int height,
+    int maxval,
+    const char* comment,
+    const unsigned char* pixels
+) {
+  char hdr[PNM_HEADER_MAX];
+  struct iovec iov[2];
+  int iovcnt = 2;
+  struct iovec* v = iov;
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len =
+      pnm_format_header(hdr, type, width, height, maxval, comment, 0);
+  iov[1].iov_base = (void*)pixels;
+  iov[1].iov_len = (size_t)width * height * pnm_channels(type);
+  while (iovcnt > 0) {
+    ssize_t nwritten = writev(fd, v, iovcnt);
+    if (nwritten < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "pnmio: writev: %s\n", strerror(errno));
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t)nwritten >= v->iov_len) {
+      nwritten -= v->iov_len;
+      v++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      v->iov_base = (char*)v->iov_base + nwritten;
+      v->iov_len -= nwritten;
+    }
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,523 @@
+/****************************************************************************
+ *
+ * mpi-ca.c - Distributed binary cellular automata with bit-sliced kernels
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/***
+% Distributed binary cellular automata with bit-sliced kernels
+
+This program is the MPI counterpart of [omp-ca](../omp-ca/main.c): it
+runs any elementary 1D cellular automaton (CA), or any 2D
+outer-totalistic CA on the Moore neighborhood, with the bit-sliced
+kernels of [ca.h](../../include/ca.h), and produces the same images.
+
+A 1D domain of `width` cells is partitioned in blocks of `width / P`
+cells, and each process exchanges one ghost word (64 cells) with the
+previous and next process, as in the bit-packed version of
+[mpi-rule30](../mpi-rule30/main.c). A 2D domain of `width` x `height`
+cells is partitioned on a $P_y \times P_x$ grid of processes created
+with `MPI_Dims_create()` and `MPI_Cart_create()`; each process
+exchanges one ghost row and one ghost word (64 columns) with its eight
+neighbors. In both cases the domain is cyclic.
+
+The ghost cells are exchanged with [halo.h](../../include/halo.h):
+while the exchange is in progress, each process updates the cells that
+do not depend on the ghosts, then it waits for the exchange to
+complete and updates the cells on the border of its block.
+
+The output image is written with MPI-IO: a 1D CA produces its history
+(one row per step), appended in batches of about 1 MB with
+`MPI_File_write_all()`; a 2D CA produces its final state. The file
+view of each process only covers its own block.
+
+The program prints the throughput in cells per second. If it is
+compiled with `-fopenmp`, each process also updates its block with
+multiple OpenMP threads.
+
+To compile:
+
+        mpicc -std=c99 -Wall -Wpedantic -O2 -I../../include mpi-ca.c -o mpi-ca
+
+To execute:
+
+        mpirun -n P ./mpi-ca [-s nsteps] [-o outfile] rule [width [height]]
+
+where `rule` is either the number of an elementary rule (0--255), or
+a 2D rule in the form "B.../S...", or "life", or "anneal". The width
+of the block of each process must be a multiple of 64.
+
+Example:
+
+        mpirun -n 4 ./mpi-ca -s 1024 -o rule30.pbm 30 4096
+        mpirun -n 4 ./mpi-ca -s 100 -o life.pbm life 1024 1024
+
+## Files
+
+- [mpi-ca.c](mpi-ca.c)
+- [ca.h](../../include/ca.h)
+- [halo.h](../../include/halo.h)
+
+***/
+#if _XOPEN_SOURCE < 600
+#define _XOPEN_SOURCE 600
+#endif
+#include <assert.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> /* for getopt() */
+
+#include "ca.h"
+#include "halo.h"
+
+/* approximate size of the batches of rows of the history of a 1D CA
+   written to the output image by each process */
+#ifndef BATCH_BYTES
+#define BATCH_BYTES (1 << 20)
+#endif
+
+/**
+ * Create the P4 PBM image `fname` of size `width` x `height` for
+ * collective writing. Process 0 of `comm` writes the header; the file
+ * view of each process covers the block of `local_width` x
+ * `local_height` pixels whose upper left corner is (`x0`, `y0`).
+ * `local_width` and `x0` must be multiples of 8.
+ */
+MPI_File create_image(
+    MPI_Comm comm,
+    const char* fname,
+    int width,
+    int height,
+    int local_width,
+    int local_height,
+    int x0,
+    int y0
+) {
+  MPI_File fh;
+  MPI_Datatype block;
+  char header[128];
+  int my_rank;
+
+  MPI_Comm_rank(comm, &my_rank);
+  const int hlen = snprintf(
+      header,
+      sizeof(header),
+      "P4\n# Produced by mpi-ca\n%d %d\n",
+      width,
+      height
+  );
+  const int row_bytes = width / 8;
+
+  if (MPI_File_open(
+          comm,
+          fname,
+          MPI_MODE_CREATE | MPI_MODE_WRONLY,
+          MPI_INFO_NULL,
+          &fh
+      ) != MPI_SUCCESS) {
+    if (0 == my_rank) {
+      fprintf(stderr, "FATAL: Cannot create %s\n", fname);
+    }
+    MPI_Abort(comm, EXIT_FAILURE);
+  }
+  MPI_File_set_size(fh, hlen + (MPI_Offset)row_bytes * height);
+  if (0 == my_rank) {
+    MPI_File_write_at(fh, 0, header, hlen, MPI_CHAR, MPI_STATUS_IGNORE);
+  }
+  /* An image with no rows is just the header; a subarray can not have
+     a zero extent, so the default view is kept. */
+  if (0 == height) {
+    return fh;
+  }
+
+  const int sizes[2] = {height, row_bytes};
+  const int subsizes[2] = {local_height, local_width / 8};
+  const int starts[2] = {y0, x0 / 8};
+  MPI_Type_create_subarray(
+      2,
+      sizes,
+      subsizes,
+      starts,
+      MPI_ORDER_C,
+      MPI_BYTE,
+      &block
+  );
+  MPI_Type_commit(&block);
+  MPI_File_set_view(fh, hlen, MPI_BYTE, block, "native", MPI_INFO_NULL);
+  MPI_Type_free(&block);
+  return fh;
+}
+
+/**
+ * Print the throughput and the communication statistics of `h`,
+ * gathered from all processes; `buf` is the local domain (its ghosts
+ * are overwritten).
+ */
+void report(halo_t* h, void* buf, const char* name, double ncells, double t) {
+  int my_rank;
+  double t_comm[2] = {h->t_exposed, 0.0};
+
+  MPI_Comm_rank(h->comm, &my_rank);
+  t_comm[1] = h->nexchanges * halo_calibrate(h, buf, 100);
+  MPI_Reduce(
+      my_rank == 0 ? MPI_IN_PLACE : t_comm,
+      t_comm,
+      2,
+      MPI_DOUBLE,
+      MPI_SUM,
+      0,
+      h->comm
+  );
+  if (0 == my_rank) {
+    printf(
+        "Rule %s: %g cell updates, %f s (%g cells/s)\n",
+        name,
+        ncells,
+        t,
+        ncells / t
+    );
+    /* the exposed time also includes the time spent waiting for
+       slower neighbors, so the estimate is pessimistic */
+    printf(
+        "Communication (s, summed over processes): %f exposed, %f "
+        "without overlap\n",
+        t_comm[0],
+        t_comm[1]
+    );
+  }
+}
+
+/**
+ * Evolve the elementary CA `rule` of `width` cells for `nsteps` steps,
+ * starting from a single live cell in the middle, and write its
+ * history to `outname`.
+ */
+void run_1d(unsigned rule, int width, int nsteps, const char* outname) {
+  int my_rank, comm_sz;
+  halo_t halo;
+  char name[8];
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &comm_sz);
+
+  const int local_width = width / comm_sz;
+  const int nw = local_width / CA_WORD_BITS;
+  const int x0 = my_rank * local_width;
+  const ca1d_kernel_t kernel = ca1d_kernel(rule);
+
+  /* `cur` and `next` hold `nw` words plus one ghost word on each
+     side; the local words are `cur[1]` to `cur[nw]`. */
+  ca_word_t* cur = (ca_word_t*)calloc(nw + 2, sizeof(*cur));
+  assert(cur != NULL);
+  ca_word_t* next = (ca_word_t*)calloc(nw + 2, sizeof(*next));
+  assert(next != NULL);
+  ca_word_t* tmp;
+
+  if (width / 2 >= x0 && width / 2 < x0 + local_width) {
+    const int x = width / 2 - x0;
+    cur[1 + x / CA_WORD_BITS] = (ca_word_t)1
+                                << (CA_WORD_BITS - 1 - x % CA_WORD_BITS);
+  }
+
+  halo_init_1d(&halo, MPI_COMM_WORLD, nw, 1, MPI_UINT64_T, 1);
+  MPI_File out = create_image(
+      MPI_COMM_WORLD,
+      outname,
+      width,
+      nsteps,
+      local_width,
+      nsteps,
+      x0,
+      0
+  );
+
+  /* Each process accumulates `batch` rows of its own slice of the
+     history before writing them. */
+  const int local_bytes = local_width / 8;
+  int batch = BATCH_BYTES / local_bytes;
+  if (batch > nsteps) {
+    batch = nsteps;
+  }
+  if (batch < 1) {
+    batch = 1;
+  }
+  unsigned char* rows = (unsigned char*)malloc((size_t)batch * local_bytes);
+  assert(rows != NULL);
+  int nrows = 0;
+  double elapsed = 0.0;
+
+  for (int s = 0; s < nsteps; s++) {
+    ca_store_row(cur + 1, nw, rows + (size_t)nrows * local_bytes);
+    nrows++;
+    if (nrows == batch) {
+      MPI_File_write_all(
+          out,
+          rows,
+          nrows * local_bytes,
+          MPI_BYTE,
+          MPI_STATUS_IGNORE
+      );
+      nrows = 0;
+    }
+
+    const double tstart = MPI_Wtime();
+    /* Only the first and last word depend on the ghosts */
+    halo_start(&halo, cur);
+    kernel(rule, cur, next, 2, nw - 1);
+    halo_wait(&halo);
+    kernel(rule, cur, next, 1, 1);
+    if (nw > 1) {
+      kernel(rule, cur, next, nw, nw);
+    }
+    elapsed += MPI_Wtime() - tstart;
+
+    tmp = cur;
+    cur = next;
+    next = tmp;
+  }
+  MPI_File_write_all(
+      out,
+      rows,
+      nrows * local_bytes,
+      MPI_BYTE,
+      MPI_STATUS_IGNORE
+  );
+  MPI_File_close(&out);
+
+  MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+  snprintf(name, sizeof(name), "%u", rule);
+  report(&halo, cur, name, (double)width * nsteps, elapsed);
+
+  halo_free(&halo);
+  free(cur);
+  free(next);
+  free(rows);
+}
+
+/**
+ * Evolve the 2D CA (`born`, `survive`) of `width` x `height` cells for
+ * `nsteps` steps, starting from a random configuration, and write the
+ * final state to `outname`.
+ */
+void run_2d(
+    unsigned born,
+    unsigned survive,
+    int width,
+    int height,
+    int nsteps,
+    const char* outname
+) {
+  int comm_sz, my_rank, coords[2];
+  int dims[2] = {0, 0};
+  const int periods[2] = {1, 1};
+  MPI_Comm cart;
+  halo_t halo;
+  char name[24];
+
+  MPI_Comm_size(MPI_COMM_WORLD, &comm_sz);
+  MPI_Dims_create(comm_sz, 2, dims);
+  MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &cart);
+  MPI_Comm_rank(cart, &my_rank);
+  MPI_Cart_coords(cart, my_rank, 2, coords);
+
+  if (width % (dims[1] * CA_WORD_BITS) || height % dims[0]) {
+    if (0 == my_rank) {
+      fprintf(
+          stderr,
+          "FATAL: with a %d x %d process grid, the width must be a "
+          "multiple of %d and the height a multiple of %d\n",
+          dims[0],
+          dims[1],
+          dims[1] * CA_WORD_BITS,
+          dims[0]
+      );
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  const int local_width = width / dims[1];
+  const int ny = height / dims[0];
+  const int nw = local_width / CA_WORD_BITS;
+  const int stride = nw + 2;
+  const int x0 = coords[1] * local_width;
+  const int y0 = coords[0] * ny;
+  const ca2d_kernel_t kernel = ca2d_kernel(born, survive);
+
+  /* `cur` and `next` hold `ny` rows of `nw` words, plus one ghost row
+     and one ghost word on each side; the local words are `cur[i *
+     stride + j]` for i = 1, ..., ny and j = 1, ..., nw. */
+  const size_t size = (size_t)stride * (ny + 2);
+  ca_word_t* cur = (ca_word_t*)calloc(size, sizeof(*cur));
+  assert(cur != NULL);
+  ca_word_t* next = (ca_word_t*)calloc(size, sizeof(*next));
+  assert(next != NULL);
+  ca_word_t* tmp;
+
+  /* The initial state of each cell only depends on its global
+     coordinates, so it does not depend on the number of processes */
+  for (int i = 0; i < ny; i++) {
+    for (int j = 0; j < local_width; j++) {
+      if (ca_random_cell(x0 + j, y0 + i, 0.5)) {
+        cur[(size_t)(i + 1) * stride + 1 + j / CA_WORD_BITS] |=
+            (ca_word_t)1 << (CA_WORD_BITS - 1 - j % CA_WORD_BITS);
+      }
+    }
+  }
+
+  halo_init_2d(&halo, cart, nw, ny, 1, MPI_UINT64_T);
+
+  MPI_Barrier(cart);
+  const double tstart = MPI_Wtime();
+  for (int s = 0; s < nsteps; s++) {
+    /* The cells that depend on the ghosts are those in the first and
+       last row, and in the first and last word of every row */
+    halo_start(&halo, cur);
+    kernel(born, survive, cur, next, stride, 2, ny - 1, 2, nw - 1);
+    halo_wait(&halo);
+    kernel(born, survive, cur, next, stride, 1, 1, 1, nw);
+    if (ny > 1) {
+      kernel(born, survive, cur, next, stride, ny, ny, 1, nw);
+    }
+    kernel(born, survive, cur, next, stride, 2, ny - 1, 1, 1);
+    if (nw > 1) {
+      kernel(born, survive, cur, next, stride, 2, ny - 1, nw, nw);
+    }
+
+    tmp = cur;
+    cur = next;
+    next = tmp;
+  }
+  double elapsed = MPI_Wtime() - tstart;
+  MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, cart);
+
+  const int local_bytes = local_width / 8;
+  unsigned char* block = (unsigned char*)malloc((size_t)ny * local_bytes);
+  assert(block != NULL);
+  for (int i = 0; i < ny; i++) {
+    ca_store_row(
+        cur + (size_t)(i + 1) * stride + 1,
+        nw,
+        block + (size_t)i * local_bytes
+    );
+  }
+  MPI_File out =
+      create_image(cart, outname, width, height, local_width, ny, x0, y0);
+  MPI_File_write_all(
+      out,
+      block,
+      ny * local_bytes,
+      MPI_BYTE,
+      MPI_STATUS_IGNORE
+  );
+  MPI_File_close(&out);
+
+  ca2d_format_rule(born, survive, name);
+  report(&halo, cur, name, (double)width * height * nsteps, elapsed);
+
+  halo_free(&halo);
+  MPI_Comm_free(&cart);
+  free(cur);
+  free(next);
+  free(block);
+}
+
+int main(int argc, char* argv[]) {
+  const char* outname = "ca.pbm";
+  int nsteps = 1024, width = 1024, height = 1024;
+  unsigned rule = 0, born, survive;
+  int is_2d = 0;
+  int my_rank, comm_sz, opt;
+
+  MPI_Init(&argc, &argv);
+  MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &comm_sz);
+
+  while ((opt = getopt(argc, argv, "s:o:")) != -1) {
+    switch (opt) {
+      case 's':
+        nsteps = atoi(optarg);
+        break;
+      case 'o':
+        outname = optarg;
+        break;
+      default:
+        if (0 == my_rank) {
+          fprintf(
+              stderr,
+              "Usage: %s [-s nsteps] [-o outfile] rule [width [height]]\n",
+              argv[0]
+          );
+        }
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+
+  if (optind >= argc) {
+    if (0 == my_rank) {
+      fprintf(stderr, "FATAL: missing rule\n");
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  char* end;
+  const long r = strtol(argv[optind], &end, 10);
+  if (*end == '\0' && r >= 0 && r <= 255) {
+    rule = r;
+  } else if (ca2d_parse_rule(argv[optind], &born, &survive) == 0) {
+    is_2d = 1;
+  } else {
+    if (0 == my_rank) {
+      fprintf(stderr, "FATAL: invalid rule \"%s\"\n", argv[optind]);
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  optind++;
+
+  if (optind < argc) {
+    width = height = atoi(argv[optind]);
+  }
+  if (optind + 1 < argc) {
+    height = atoi(argv[optind + 1]);
+  }
+
+  if (width <= 0 || height <= 0 || nsteps <= 0) {
+    if (0 == my_rank) {
+      fprintf(stderr, "FATAL: invalid width, height or number of steps\n");
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  if (is_2d) {
+    run_2d(born, survive, width, height, nsteps, outname);
+  } else {
+    if (width % (comm_sz * CA_WORD_BITS)) {
+      if (0 == my_rank) {
+        fprintf(
+            stderr,
+            "FATAL: the width must be a multiple of %d\n",
+            comm_sz * CA_WORD_BITS
+        );
+      }
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    run_1d(rule, width, nsteps, outname);
+  }
+
+  MPI_Finalize();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,435 @@
+/****************************************************************************
+ *
+ * mpi-cat-map.c - Arnold's cat map on distributed memory
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/***
+% Arnold's cat map on distributed memory
+
+This program applies $k$ iterations of [Arnold's cat
+map](../omp-cat-map/main.c) to a square PGM image that may be larger
+than the memory of a single node. The image of size $N \times N$ is
+partitioned into $P$ blocks of contiguous rows, where $P$ is the
+number of MPI processes; process $p$ owns rows $\lfloor pN/P \rfloor$
+to $\lfloor (p+1)N/P \rfloor - 1$.
+
+Since $C^k(x, y) = M^k (x, y)^T \bmod N$ with $M = \begin{pmatrix} 2
+& 1 \\ 1 & 1 \end{pmatrix}$, each process computes $M^k \bmod N$ by
+repeated squaring, and then the destination of each of its pixels,
+i.e., which process owns it after the transformation. The pixels are
+then exchanged with a single `MPI_Alltoallv()`: each process packs the
+pixels destined to process $q$ in a contiguous portion of its send
+buffer, so that no per-pixel messages are needed.
+
+The receiver must know where to store each byte it gets. This does
+not depend on the image, so it is computed once (a _plan_): during
+setup, every process sends the local offsets of the destinations of
+its pixels with another `MPI_Alltoallv()`. After that, each
+application of the map transfers exactly one byte per pixel.
+
+The input image is memory-mapped by every process, so that each one
+only reads its own rows; the output image is written with MPI-IO,
+each process writing its own rows.
+
+To compile:
+
+        mpicc -std=c99 -Wall -Wpedantic -fopenmp -I../../include mpi-cat-map.c -o mpi-cat-map
+
+To execute:
+
+        mpirun -n P ./mpi-cat-map k input_file output_file
+
+Example:
+
+        mpirun -n 4 ./mpi-cat-map 100 ../omp-cat-map/cat1368.pgm cat1368-100.pgm
+
+## Files
+
+- [mpi-cat-map.c](mpi-cat-map.c)
+
+***/
+#if _XOPEN_SOURCE < 600
+#define _XOPEN_SOURCE 600
+#endif
+#include <assert.h>
+#include <limits.h>
+#include <mpi.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pnmio.h"
+
+/* A 2x2 matrix [[a, b], [c, d]] with entries in [0, N) */
+typedef struct {
+  int64_t a, b, c, d;
+} mat2_t;
+
+/* Return (p * q) mod n; entries are < n <= 2^31, so the products of
+   two entries and their sums fit in 64 bits. */
+mat2_t mat2_mul(mat2_t p, mat2_t q, int64_t n) {
+  mat2_t r;
+  r.a = (p.a * q.a + p.b * q.c) % n;
+  r.b = (p.a * q.b + p.b * q.d) % n;
+  r.c = (p.c * q.a + p.d * q.c) % n;
+  r.d = (p.c * q.b + p.d * q.d) % n;
+  return r;
+}
+
+/* Return M^k mod n, where M = [[2, 1], [1, 1]] */
+mat2_t cat_matrix_pow(int k, int n) {
+  mat2_t result = {1 % n, 0, 0, 1 % n}; /* identity */
+  mat2_t base = {2 % n, 1 % n, 1 % n, 1 % n};
+
+  assert(k >= 0);
+  while (k > 0) {
+    if (k & 1) result = mat2_mul(result, base, n);
+    base = mat2_mul(base, base, n);
+    k >>= 1;
+  }
+  return result;
+}
+
+/**
+ * Communication plan for applying C^k to an image of size n x n
+ * distributed by blocks of rows. The local block has `nrows` rows
+ * starting from row `ystart`. Counts and displacements are in bytes
+ * (i.e., pixels).
+ */
+typedef struct {
+  int n, ystart, nrows;
+  int *sendcounts, *sdispls;
+  int *recvcounts, *rdispls;
+  uint32_t* sendpos; /* local pixel i goes to sendbuf[sendpos[i]] */
+  uint32_t* unpack;  /* recvbuf[j] goes to local pixel unpack[j] */
+} mpi_plan_t;
+
+/**
+ * Build the plan for `k` iterations on an image of size `n` x `n`; row
+ * `y` is owned by process owner[y].
+ */
+void mpi_plan_init(
+    mpi_plan_t* plan, int n, int k, const int* ystart, const int* owner
+) {
+  int my_rank, comm_sz;
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &comm_sz);
+
+  const int y0 = ystart[my_rank];
+  const int nrows = ystart[my_rank + 1] - y0;
+  const size_t npix = (size_t)nrows * n;
+  const mat2_t m = cat_matrix_pow(k, n);
+
+  plan->n = n;
+  plan->ystart = y0;
+  plan->nrows = nrows;
+  plan->sendcounts = (int*)calloc(comm_sz, sizeof(int));
+  plan->sdispls = (int*)malloc(comm_sz * sizeof(int));
+  plan->recvcounts = (int*)malloc(comm_sz * sizeof(int));
+  plan->rdispls = (int*)malloc(comm_sz * sizeof(int));
+  plan->sendpos = (uint32_t*)malloc(npix * sizeof(uint32_t));
+  uint32_t* dest = (uint32_t*)malloc(npix * sizeof(uint32_t));
+  assert(plan->sendcounts != NULL && plan->sdispls != NULL &&
+         plan->recvcounts != NULL && plan->rdispls != NULL &&
+         plan->sendpos != NULL && dest != NULL);
+
+  /* Compute the destination of each local pixel, and count how many
+     pixels go to each process. The destination of pixel (x, y) is
+     stored as the owner of the destination row, followed by the
+     local offset in its block; the first is kept in `sendpos` for
+     now. */
+  uint64_t count[comm_sz];
+  memset(count, 0, sizeof(count));
+  for (int y = y0; y < y0 + nrows; y++) {
+    int64_t xk = m.b * y % n, yk = m.d * y % n;
+    for (int x = 0; x < n; x++) {
+      const size_t i = (size_t)(y - y0) * n + x;
+      const int q = owner[yk];
+      plan->sendpos[i] = q;
+      dest[i] = (uint32_t)((yk - ystart[q]) * n + xk);
+      count[q]++;
+      xk += m.a;
+      if (xk >= n) xk -= n;
+      yk += m.c;
+      if (yk >= n) yk -= n;
+    }
+  }
+
+  uint64_t displ = 0;
+  for (int q = 0; q < comm_sz; q++) {
+    /* counts and displacements of MPI_Alltoallv() are int */
+    if (displ + count[q] > INT_MAX) {
+      fprintf(stderr, "FATAL: too many pixels for a single exchange\n");
+      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    plan->sendcounts[q] = (int)count[q];
+    plan->sdispls[q] = (int)displ;
+    displ += count[q];
+  }
+  MPI_Alltoall(
+      plan->sendcounts, 1, MPI_INT, plan->recvcounts, 1, MPI_INT, MPI_COMM_WORLD
+  );
+  plan->rdispls[0] = 0;
+  for (int q = 1; q < comm_sz; q++) {
+    plan->rdispls[q] = plan->rdispls[q - 1] + plan->recvcounts[q - 1];
+  }
+
+  /* Turn the owners into positions in the send buffer, and pack the
+     local destination offsets there. */
+  int next[comm_sz];
+  memcpy(next, plan->sdispls, sizeof(next));
+  uint32_t* sendidx = (uint32_t*)malloc(npix * sizeof(uint32_t));
+  assert(sendidx != NULL);
+  for (size_t i = 0; i < npix; i++) {
+    const uint32_t pos = next[plan->sendpos[i]]++;
+    plan->sendpos[i] = pos;
+    sendidx[pos] = dest[i];
+  }
+  free(dest);
+
+  /* Every process receives exactly as many pixels as it owns */
+  plan->unpack = (uint32_t*)malloc(npix * sizeof(uint32_t));
+  assert(plan->unpack != NULL);
+  MPI_Alltoallv(
+      sendidx,
+      plan->sendcounts,
+      plan->sdispls,
+      MPI_UINT32_T,
+      plan->unpack,
+      plan->recvcounts,
+      plan->rdispls,
+      MPI_UINT32_T,
+      MPI_COMM_WORLD
+  );
+  free(sendidx);
+}
+
+void mpi_plan_free(mpi_plan_t* plan) {
+  free(plan->sendcounts);
+  free(plan->sdispls);
+  free(plan->recvcounts);
+  free(plan->rdispls);
+  free(plan->sendpos);
+  free(plan->unpack);
+}
+
+/**
+ * Apply `plan` to the local block `cur`, storing the local block of
+ * the result in `next`; `sendbuf` and `recvbuf` are scratch buffers of
+ * the same size as the local block.
+ */
+void mpi_plan_apply(
+    const mpi_plan_t* plan,
+    const unsigned char* cur,
+    unsigned char* next,
+    unsigned char* sendbuf,
+    unsigned char* recvbuf
+) {
+  const size_t npix = (size_t)plan->nrows * plan->n;
+  const uint32_t* sendpos = plan->sendpos;
+  const uint32_t* unpack = plan->unpack;
+
+#pragma omp parallel for default(none) shared(npix, sendpos, sendbuf, cur)
+  for (size_t i = 0; i < npix; i++) {
+    sendbuf[sendpos[i]] = cur[i];
+  }
+  MPI_Alltoallv(
+      sendbuf,
+      plan->sendcounts,
+      plan->sdispls,
+      MPI_UNSIGNED_CHAR,
+      recvbuf,
+      plan->recvcounts,
+      plan->rdispls,
+      MPI_UNSIGNED_CHAR,
+      MPI_COMM_WORLD
+  );
+#pragma omp parallel for default(none) shared(npix, unpack, next, recvbuf)
+  for (size_t j = 0; j < npix; j++) {
+    next[unpack[j]] = recvbuf[j];
+  }
+}
+
+/**
+ * Write the distributed image of size `n` x `n` and maximum gray level
+ * `maxval` to file `fname`; each process writes its `nrows` rows
+ * starting from row `y0` in `bmap`.
+ */
+void write_image(
+    const char* fname,
+    int n,
+    int maxval,
+    int y0,
+    int nrows,
+    const unsigned char* bmap
+) {
+  char hdr[PNM_HEADER_MAX];
+  const size_t hlen = pnm_format_header(
+      hdr, 5, n, n, maxval, "produced by mpi-cat-map.c", 0
+  );
+  MPI_File fh;
+  MPI_Datatype row_t;
+  int my_rank;
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+  if (MPI_File_open(
+          MPI_COMM_WORLD,
+          fname,
+          MPI_MODE_CREATE | MPI_MODE_WRONLY,
+          MPI_INFO_NULL,
+          &fh
+      ) != MPI_SUCCESS) {
+    if (0 == my_rank) fprintf(stderr, "FATAL: can not create %s\n", fname);
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  MPI_File_set_size(fh, (MPI_Offset)(hlen + (size_t)n * n));
+  if (0 == my_rank) {
+    MPI_File_write_at(fh, 0, hdr, hlen, MPI_CHAR, MPI_STATUS_IGNORE);
+  }
+  /* count rows rather than bytes, so that blocks of more than INT_MAX
+     bytes can be written */
+  MPI_Type_contiguous(n, MPI_UNSIGNED_CHAR, &row_t);
+  MPI_Type_commit(&row_t);
+  MPI_File_write_at_all(
+      fh,
+      (MPI_Offset)(hlen + (size_t)y0 * n),
+      bmap,
+      nrows,
+      row_t,
+      MPI_STATUS_IGNORE
+  );
+  MPI_Type_free(&row_t);
+  MPI_File_close(&fh);
+}
+
+int main(int argc, char* argv[]) {
+  int my_rank, comm_sz;
+  const int NTESTS = 5; /* number of replications */
+  pnm_image_t in;
+
+  MPI_Init(&argc, &argv);
+  MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &comm_sz);
+
+  if (argc != 4) {
+    if (0 == my_rank) {
+      fprintf(stderr, "Usage: %s niter input_file output_file\n", argv[0]);
+    }
+    MPI_Finalize();
+    return EXIT_FAILURE;
+  }
+  const int niter = atoi(argv[1]);
+  if (niter < 0) {
+    if (0 == my_rank) {
+      fprintf(stderr, "FATAL: the number of iterations must be >= 0\n");
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  /* Every process maps the input, but only touches its own rows */
+  if (pnm_open(argv[2], &in) != 0) MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  if (in.type != 5 || in.width != in.height) {
+    if (0 == my_rank) {
+      fprintf(stderr, "FATAL: the input must be a square PGM image\n");
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  const int N = in.width;
+  const int maxval = in.maxval;
+  if (comm_sz > N) {
+    if (0 == my_rank) {
+      fprintf(stderr, "FATAL: at most %d processes can be used\n", N);
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  /* local offsets are 32 bits */
+  if ((size_t)(N / comm_sz + 1) * N > UINT32_MAX) {
+    if (0 == my_rank) {
+      fprintf(stderr, "FATAL: image too large, use more processes\n");
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  /* Partition the rows; ystart[comm_sz] == N */
+  int ystart[comm_sz + 1];
+  for (int p = 0; p <= comm_sz; p++) {
+    ystart[p] = (int)((int64_t)N * p / comm_sz);
+  }
+  int* owner = (int*)malloc(N * sizeof(int));
+  assert(owner != NULL);
+  for (int p = 0; p < comm_sz; p++) {
+    for (int y = ystart[p]; y < ystart[p + 1]; y++) owner[y] = p;
+  }
+
+  const int y0 = ystart[my_rank];
+  const int nrows = ystart[my_rank + 1] - y0;
+  const size_t npix = (size_t)nrows * N;
+  unsigned char* cur = (unsigned char*)malloc(npix);
+  unsigned char* next = (unsigned char*)malloc(npix);
+  unsigned char* sendbuf = (unsigned char*)malloc(npix);
+  unsigned char* recvbuf = (unsigned char*)malloc(npix);
+  assert(cur != NULL && next != NULL && sendbuf != NULL && recvbuf != NULL);
+  memcpy(cur, in.pixels + (size_t)y0 * N, npix);
+  pnm_close(&in);
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  double tstart = MPI_Wtime();
+  mpi_plan_t plan;
+  mpi_plan_init(&plan, N, niter, ystart, owner);
+  MPI_Barrier(MPI_COMM_WORLD);
+  const double setup_time = MPI_Wtime() - tstart;
+
+  /* Each application replaces the local block with the result, like
+     the functions of omp-cat-map.c; the first result is saved. */
+  double elapsed = 0.0;
+  for (int i = 0; i < NTESTS; i++) {
+    tstart = MPI_Wtime();
+    mpi_plan_apply(&plan, cur, next, sendbuf, recvbuf);
+    MPI_Barrier(MPI_COMM_WORLD);
+    elapsed += MPI_Wtime() - tstart;
+    unsigned char* tmp = cur;
+    cur = next;
+    next = tmp;
+    if (i == 0) write_image(argv[3], N, maxval, y0, nrows, cur);
+  }
+  elapsed /= NTESTS;
+
+  if (0 == my_rank) {
+    fprintf(stderr, "\n=== MPI cat map ===\n");
+    fprintf(stderr, "     Processes: %d\n", comm_sz);
+    fprintf(stderr, "    Iterations: %d\n", niter);
+    fprintf(stderr, "  Width,Height: %d,%d\n", N, N);
+    fprintf(stderr, "    Setup time: %.3f\n", setup_time);
+    fprintf(
+        stderr,
+        "      Mops/sec: %.4f\n",
+        1.0e-6 * N * N * (double)niter / elapsed
+    );
+    fprintf(stderr, "Execution time  %.3f\n\n", elapsed);
+  }
+
+  mpi_plan_free(&plan);
+  free(owner);
+  free(cur);
+  free(next);
+  free(sendbuf);
+  free(recvbuf);
+  MPI_Finalize();
+  return EXIT_SUCCESS;
+}
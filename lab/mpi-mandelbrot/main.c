@@ -73,7 +73,7 @@ message.
 
 To compile:
 
-        mpicc -std=c99 -Wall -Wpedantic mpi-mandelbrot.c -o mpi-mandelbrot
+        mpicc -std=c99 -Wall -Wpedantic -I../../include mpi-mandelbrot.c -o mpi-mandelbrot
 
 To execute:
 
@@ -88,12 +88,17 @@ Example:
 - [mpi-mandelbrot.c](mpi-mandelbrot.c)
 
 ***/
+#if _XOPEN_SOURCE < 600
+#define _XOPEN_SOURCE 600
+#endif
 #include <assert.h>
 #include <mpi.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "pnmio.h"
+
 const int MAXIT = 100;
 
 /* The __attribute__(( ... )) definition is gcc-specific, and tells
@@ -181,7 +186,7 @@ void draw_lines(int ystart, int yend, pixel_t* p, int xsize, int ysize) {
 
 int main(int argc, char* argv[]) {
   int my_rank, comm_sz;
-  FILE* out = NULL;
+  pnm_image_t out;
   const char* fname = "mpi-mandelbrot.ppm";
   pixel_t* bitmap = NULL;
   int xsize, ysize;
@@ -200,20 +205,13 @@ int main(int argc, char* argv[]) {
 
   /* xsize and ysize are known to all processes */
   if (0 == my_rank) {
-    out = fopen(fname, "w");
-    if (!out) {
+    /* Create the output file and map it in memory: the complete
+       bitmap is gathered directly into the file. */
+    if (pnm_create(fname, 6, xsize, ysize, 255, NULL, &out) != 0) {
       fprintf(stderr, "Error: cannot create %s\n", fname);
       MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
     }
-
-    /* Write the header of the output file */
-    fprintf(out, "P6\n");
-    fprintf(out, "%d %d\n", xsize, ysize);
-    fprintf(out, "255\n");
-
-    /* Allocate the complete bitmap */
-    bitmap = (pixel_t*)malloc(xsize * ysize * sizeof(*bitmap));
-    assert(bitmap != NULL);
+    bitmap = (pixel_t*)out.pixels;
   }
   /* This version makes use of MPI_Gatherv to collect portions of
      different sizes. To compile this version, use:
@@ -257,12 +255,10 @@ int main(int argc, char* argv[]) {
   const double elapsed = MPI_Wtime() - tstart;
 
   if (0 == my_rank) {
-    fwrite(bitmap, sizeof(*bitmap), xsize * ysize, out);
-    fclose(out);
+    pnm_close(&out);
 
     printf("Execution time %.3f\n", elapsed);
   }
-  free(bitmap);
   free(local_bitmap);
 
   MPI_Finalize();
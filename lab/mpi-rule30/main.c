@@ -138,19 +138,92 @@ _leftmost_ cell to the predecessor, and receives the value of the right
 ghost cell from the successor. All processes execute the same
 communication: therefore, each one should call `MPI_Sendrecv()` twice.
 
+## Bit-packed domain
+
+Storing one `cell_t` per cell wastes seven bits out of eight. With the
+`-b` option the program stores 64 cells in each `uint64_t` word: cell
+$i$ of a partition is bit $63 - (i \bmod 64)$ of word $\lfloor i / 64
+\rfloor$, so that the leftmost cell is the most significant bit. A
+word `c` holding 64 consecutive cells is updated all at once: the
+words `l` and `r` containing the left and right neighbors of each cell
+are obtained by shifting `c` by one position, and filling the vacated
+bit with the last (resp. first) cell of the previous (resp. next)
+word. Rule 30 is then
+
+```C
+next = l ^ (c | r);
+```
+
+With `-O2` each iteration of this loop updates one word (64 cells).
+At `-O3` gcc also vectorizes it, since `cur` and `next` are declared
+`restrict` (they never overlap): a 128-bit SSE2 instruction then
+updates 128 cells, and with `-O3 -march=native` on a CPU with AVX2 or
+AVX-512 a 256-bit instruction updates 256 cells (gcc prefers 256-bit
+vectors even on AVX-512, unless `-mprefer-vector-width=512` is
+given). The ghost cells become ghost words: only
+one bit of each ghost word is actually used, but the halo exchange
+moves a single `MPI_UINT64_T` instead of a single `MPI_CHAR`, and each
+partition must contain a multiple of 64 cells.
+
+## Deep halo
+
+With many processes the two `MPI_Sendrecv()` per step are dominated
+by latency, since each one moves a single cell. The `-H depth` option
+enlarges the halo so that the ghost cells are exchanged only once
+every _depth_ steps. After an exchange each process can compute
+_depth_ steps on its own, updating also the ghost cells: at each step
+the ghost cells next to the outer border become stale, so the valid
+region shrinks by one cell on each side, until the ghost cells are
+exhausted and a new exchange is required. The number of messages
+drops by a factor _depth_ in exchange for some redundant computation,
+and the result does not change. With `-H 0` the depth is chosen by
+measuring the latency of an exchange and the time required to update
+a cell. At the end, the program prints the depth and the number of
+exchanges.
+
+## Overlapping communication and computation
+
+The ghost cells are exchanged with the non-blocking functions of
+[halo.h](../../include/halo.h), that handles 1D and 2D domains with
+any ghost width and element type. After posting `MPI_Isend()` and
+`MPI_Irecv()`, each process updates the cells of its partition that
+do not depend on the ghost cells (all but the first and last one),
+then waits for the completion of the exchange and updates the
+remaining cells. At the end, the program compares the communication
+time that was not overlapped with the time that the same exchanges
+would take without overlapping, and prints the fraction that was
+hidden by the computation. Since the exposed time also includes the
+time spent waiting for slower processes, the estimate is meaningful
+only when each process runs on its own core.
+
+## Parallel output
+
+Gathering the whole domain on process 0 at every step, and writing
+it one `fprintf()` per cell, serializes the program on the output.
+Instead, the image is written in the binary PBM format (P4), where
+each row is stored with 8 pixels per byte; therefore, each partition
+must contain a multiple of 8 cells. The processes open the image with
+`MPI_File_open()`, and each one sets a file view (a subarray
+datatype) that covers only its own columns. At each step every
+process appends its slice of the current state to a local buffer;
+when the buffer contains about 1 MB, it is written with a single
+collective `MPI_File_write_all()`, and the MPI library merges the
+slices into large contiguous writes. No `MPI_Gather()` is required.
+
 To compile:
 
-        mpicc -std=c99 -Wall -Wpedantic mpi-rule30.c -o mpi-rule30
+        mpicc -std=c99 -Wall -Wpedantic -O2 -I../../include mpi-rule30.c -o mpi-rule30
 
 To execute:
 
-        mpirun -n P ./mpi-rule30 [width [steps]]
+        mpirun -n P ./mpi-rule30 [-b] [-H depth] [-o outfile] [width [steps]]
 
 Example:
 
-        mpirun -n 4 ./mpi-rule30 1024 1024
+        mpirun -n 4 ./mpi-rule30 -b -H 0 1024 1024
 
-The output is stored into a file `rule30.pbm`
+The output is stored into a file `rule30.pbm`, or into the file
+specified with the `-o` option.
 
 ## Files
 
@@ -158,10 +231,17 @@ The output is stored into a file `rule30.pbm`
 - [Additional information](mpi-rule30.pdf)
 
 ***/
+#if _XOPEN_SOURCE < 600
+#define _XOPEN_SOURCE 600
+#endif
 #include <assert.h>
 #include <mpi.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h> /* for getopt() */
+
+#include "halo.h"
 
 #define ASCENDING_ORDER_TAG 0
 #define DESCENDING_ORDER_TAG 1
@@ -169,8 +249,19 @@ The output is stored into a file `rule30.pbm`
 /* Note: the MPI datatype corresponding to "signed char" is MPI_CHAR */
 typedef signed char cell_t;
 
-/* number of ghost cells on each side; this program assumes HALO ==
-   1. */
+/* Bit-packed cells: WORD_BITS cells per word, leftmost cell in the
+   most significant bit. The MPI datatype is MPI_UINT64_T. */
+typedef uint64_t word_t;
+#define WORD_BITS 64
+
+/* approximate size of the batches of rows written to the output
+   image by each process */
+#ifndef BATCH_BYTES
+#define BATCH_BYTES (1 << 20)
+#endif
+
+/* number of ghost cells (or ghost words, in the bit-packed domain) on
+   each side; this program assumes HALO == 1. */
 const int HALO = 1;
 
 /* To make the code more readable, we make frequent use of the
@@ -216,6 +307,143 @@ void step(const cell_t* cur, cell_t* next, int ext_n) {
   }
 }
 
+/**
+ * Same as `step()`, on a bit-packed domain of `ext_nw` words
+ * (including one ghost word on each side). Only the last bit of the
+ * left ghost word and the first bit of the right ghost word are used.
+ */
+void step_packed(
+    const word_t* restrict cur,
+    word_t* restrict next,
+    int ext_nw
+) {
+  const int LEFT = HALO;
+  const int RIGHT = ext_nw - HALO - 1;
+  for (int i = LEFT; i <= RIGHT; i++) {
+    const word_t center = cur[i];
+    const word_t left = (center >> 1) | (cur[i - 1] << (WORD_BITS - 1));
+    const word_t right = (center << 1) | (cur[i + 1] >> (WORD_BITS - 1));
+    next[i] = left ^ (center | right);
+  }
+}
+
+/**
+ * Pack `nw * WORD_BITS` cells from `cells` into `nw` words.
+ */
+void pack_cells(const cell_t* cells, word_t* words, int nw) {
+  for (int i = 0; i < nw; i++) {
+    word_t w = 0;
+    for (int b = 0; b < WORD_BITS; b++) {
+      w = (w << 1) | (cells[i * WORD_BITS + b] != 0);
+    }
+    words[i] = w;
+  }
+}
+
+/**
+ * Update the elements `lo` to `hi` (inclusive) of the local domain
+ * `cur[]`, that must not be the first or last element.
+ */
+void update(const char* cur, char* next, int lo, int hi, int packed) {
+  if (lo > hi) {
+    return;
+  }
+  /* the first and last element of the range passed to `step()` are
+     treated as ghosts */
+  if (packed) {
+    step_packed(
+        (const word_t*)cur + lo - 1,
+        (word_t*)next + lo - 1,
+        hi - lo + 3
+    );
+  } else {
+    step((const cell_t*)cur + lo - 1, (cell_t*)next + lo - 1, hi - lo + 3);
+  }
+}
+
+/**
+ * Compute the `j`-th step (1 <= j <= depth) after the last halo
+ * exchange on the local domain `cur[]` of `ext_n` elements. The ghosts
+ * become stale after the first step: in the byte engine, the
+ * values that are still valid shrink by one cell on each side at each
+ * step, so only those are updated. In the bit-packed engine the
+ * invalid cells move inwards by one bit per step from the edge of the
+ * first and last word; updating the whole domain costs at most a few
+ * redundant words, so we do not bother.
+ */
+void substep(const char* cur, char* next, int ext_n, int j, int packed) {
+  const int skip = (packed ? 0 : j - 1);
+  update(cur, next, 1 + skip, ext_n - 2 - skip, packed);
+}
+
+/**
+ * Number of ghost elements required to compute `depth` steps
+ * between halo exchanges.
+ */
+int ghost_width(int depth, int packed) {
+  if (packed) {
+    /* the first word is never updated, hence it becomes stale after
+       one step; the domain must start at least `depth - 1` bits to
+       the right of it */
+    return 1 + (depth - 1 + WORD_BITS - 1) / WORD_BITS;
+  } else {
+    return depth;
+  }
+}
+
+/**
+ * Choose the halo depth. Exchanging every `depth` steps saves `depth -
+ * 1` exchanges out of `depth`, at the cost of computing the ghosts
+ * redundantly: on average, `depth - 1` extra cells per step in the
+ * byte engine, and `2 * depth / WORD_BITS` extra words in the
+ * bit-packed one. Given the measured latency of an exchange and the
+ * measured time to update an element, the depth that minimizes the
+ * time per step is the square root of the ratio between the two
+ * (times WORD_BITS / 2 for the bit-packed engine). The result is
+ * bounded by `max_depth`.
+ */
+int tune_depth(
+    int local_n,
+    int packed,
+    MPI_Datatype type,
+    size_t elem_size,
+    int max_depth
+) {
+  const int NREPS = 100;
+  const int ext_n = local_n + 2 * HALO;
+  char* cur = (char*)calloc(ext_n, elem_size);
+  assert(cur != NULL);
+  char* next = (char*)calloc(ext_n, elem_size);
+  assert(next != NULL);
+  halo_t halo;
+  double t[2];
+
+  if (halo_init_1d(&halo, MPI_COMM_WORLD, local_n, HALO, type, 1) != 0) {
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  t[0] = halo_calibrate(&halo, cur, NREPS); /* latency of an exchange */
+  halo_free(&halo);
+
+  const double tstart = MPI_Wtime();
+  for (int r = 0; r < NREPS; r++) {
+    substep(cur, next, ext_n, 1, packed);
+  }
+  t[1] = (MPI_Wtime() - tstart) / NREPS / local_n; /* time per element */
+  free(cur);
+  free(next);
+
+  /* all processes must agree on the depth */
+  MPI_Allreduce(MPI_IN_PLACE, t, 2, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+  const double ratio = t[0] / (t[1] > 0 ? t[1] : 1e-12);
+  const double target = (packed ? ratio * WORD_BITS / 2 : ratio);
+  int depth = 1;
+  while (depth < max_depth && (double)(depth + 1) * (depth + 1) <= target) {
+    depth++;
+  }
+  return depth;
+}
+
 /**
  * Initialize the domain; all cells are 0, with the exception of a
  * single cell in the middle of the domain. `ext_n` is the width of the
@@ -229,52 +457,209 @@ void init_domain(cell_t* cur, int ext_n) {
 }
 
 /**
- * Dump the current state of the automaton to PBM file `out`. `ext_n`
- * is the true width of the domain PLUS the ghost cells.
+ * Store the `n` cells of a local domain, starting at `cells` (one per
+ * element, or bit-packed if `packed` is nonzero), into `row[]` as
+ * part of a row of a P4 PBM image: 8 cells per byte, the leftmost
+ * cell in the most significant bit. `n` must be a multiple of 8.
  */
-void dump_state(FILE* out, const cell_t* cur, int ext_n) {
-  const int LEFT = HALO;
-  const int RIGHT = ext_n - HALO - 1;
+void store_row(const char* cells, unsigned char* row, int n, int packed) {
+  if (packed) {
+    /* the bit order is already the right one, we only need to
+       store the words as big-endian */
+    const word_t* w = (const word_t*)cells;
+    for (int i = 0; i < n / WORD_BITS; i++) {
+      for (int b = 0; b < WORD_BITS / 8; b++) {
+        row[i * (WORD_BITS / 8) + b] = w[i] >> (WORD_BITS - 8 * (b + 1));
+      }
+    }
+  } else {
+    const cell_t* c = (const cell_t*)cells;
+    for (int i = 0; i < n / 8; i++) {
+      unsigned char v = 0;
+      for (int b = 0; b < 8; b++) {
+        v = (v << 1) | (c[i * 8 + b] != 0);
+      }
+      row[i] = v;
+    }
+  }
+}
 
-  for (int i = LEFT; i <= RIGHT; i++) {
-    fprintf(out, "%d ", cur[i]);
+/**
+ * Create the P4 PBM image `fname` of size `width` x `height` for
+ * collective writing. Process 0 writes the header; the file view of
+ * each process includes only its own `local_width` columns (which
+ * must be a multiple of 8) of every row, so that each call to
+ * `MPI_File_write_all()` appends the next rows of every partition.
+ */
+MPI_File create_image(
+    const char* fname,
+    int width,
+    int height,
+    int local_width
+) {
+  MPI_File fh;
+  MPI_Datatype slice;
+  char header[128];
+  int my_rank;
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+  const int hlen = snprintf(
+      header,
+      sizeof(header),
+      "P4\n# Produced by mpi-rule30\n%d %d\n",
+      width,
+      height
+  );
+  const int row_bytes = width / 8;
+  const int local_bytes = local_width / 8;
+
+  if (MPI_File_open(
+          MPI_COMM_WORLD,
+          fname,
+          MPI_MODE_CREATE | MPI_MODE_WRONLY,
+          MPI_INFO_NULL,
+          &fh
+      ) != MPI_SUCCESS) {
+    if (0 == my_rank) {
+      fprintf(stderr, "FATAL: Cannot create %s\n", fname);
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  MPI_File_set_size(fh, hlen + (MPI_Offset)row_bytes * height);
+  if (0 == my_rank) {
+    MPI_File_write_at(fh, 0, header, hlen, MPI_CHAR, MPI_STATUS_IGNORE);
+  }
+  /* An image with no rows is just the header; a subarray can not have
+     a zero extent, so the default view is kept. */
+  if (0 == height) {
+    return fh;
   }
-  fprintf(out, "\n");
+
+  const int sizes[2] = {height, row_bytes};
+  const int subsizes[2] = {height, local_bytes};
+  const int starts[2] = {0, my_rank * local_bytes};
+  MPI_Type_create_subarray(
+      2,
+      sizes,
+      subsizes,
+      starts,
+      MPI_ORDER_C,
+      MPI_BYTE,
+      &slice
+  );
+  MPI_Type_commit(&slice);
+  MPI_File_set_view(fh, hlen, MPI_BYTE, slice, "native", MPI_INFO_NULL);
+  MPI_Type_free(&slice);
+  return fh;
 }
 
 int main(int argc, char* argv[]) {
   const char* outname = "rule30.pbm";
-  FILE* out = NULL;
+  MPI_File out;
   int width = 1024, nsteps = 1024;
   /* `cur` is the memory buffer containint `width` elements; this is
      the full state of the CA. */
-  cell_t *cur = NULL, *tmp;
+  cell_t *cur = NULL;
   // cell_t* next = NULL; /* This is not required by the parallel version */
-  int my_rank, comm_sz;
+  /* bit-packed copy of `cur`, without ghost words (`-b` only) */
+  word_t* cur_w = NULL;
+  int packed = 0;
+  /* number of steps between halo exchanges; 0 = auto-tuned */
+  int depth = 1;
+  halo_t halo;
+  int my_rank, comm_sz, opt;
 
   MPI_Init(&argc, &argv);
   MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
   MPI_Comm_size(MPI_COMM_WORLD, &comm_sz);
 
-  if (0 == my_rank && argc > 3) {
-    fprintf(stderr, "Usage: %s [width [nsteps]]\n", argv[0]);
+  while ((opt = getopt(argc, argv, "bH:o:")) != -1) {
+    switch (opt) {
+      case 'b':
+        packed = 1;
+        break;
+      case 'H':
+        depth = atoi(optarg);
+        break;
+      case 'o':
+        outname = optarg;
+        break;
+      default:
+        if (0 == my_rank) {
+          fprintf(
+              stderr,
+              "Usage: %s [-b] [-H depth] [-o outfile] [width [nsteps]]\n",
+              argv[0]
+          );
+        }
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+  }
+
+  if (argc - optind > 2 || depth < 0) {
+    if (0 == my_rank) {
+      fprintf(
+          stderr,
+          "Usage: %s [-b] [-H depth] [-o outfile] [width [nsteps]]\n",
+          argv[0]
+      );
+    }
     MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
   }
 
-  if (argc > 1) {
-    width = atoi(argv[1]);
+  if (argc > optind) {
+    width = atoi(argv[optind]);
   }
 
-  if (argc > 2) {
-    nsteps = atoi(argv[2]);
+  if (argc > optind + 1) {
+    nsteps = atoi(argv[optind + 1]);
   }
 
-  if ((0 == my_rank) && (width % comm_sz)) {
-    printf(
-        "The image width (%d) must be a multiple of comm_sz (%d)\n",
-        width,
-        comm_sz
-    );
+  if (width <= 0 || nsteps < 0) {
+    if (0 == my_rank) {
+      fprintf(
+          stderr,
+          "Usage: %s [-b] [-H depth] [-o outfile] [width [nsteps]]\n",
+          argv[0]
+      );
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  /* All ranks check the arguments, so that none of them goes on with
+     invalid sizes; only rank 0 prints the diagnostics. */
+  if (width % comm_sz) {
+    if (0 == my_rank) {
+      fprintf(
+          stderr,
+          "The image width (%d) must be a multiple of comm_sz (%d)\n",
+          width,
+          comm_sz
+      );
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  if ((width / comm_sz) % 8) {
+    if (0 == my_rank) {
+      fprintf(
+          stderr,
+          "The partition width (%d) must be a multiple of 8\n",
+          width / comm_sz
+      );
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  if (packed && (width / comm_sz) % WORD_BITS) {
+    if (0 == my_rank) {
+      fprintf(
+          stderr,
+          "The partition width (%d) must be a multiple of %d\n",
+          width / comm_sz,
+          WORD_BITS
+      );
+    }
     MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
   }
 
@@ -284,18 +669,10 @@ int main(int argc, char* argv[]) {
      would still require the halo in the local partitions. */
   const int ext_width = width + 2 * HALO;
 
-  /* The master creates the output file */
-  if (0 == my_rank) {
-    // out = fopen(outname, "w");
-    out = stdout;
-    if (!out) {
-      fprintf(stderr, "FATAL: Cannot create %s\n", outname);
-      MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
-    }
-    fprintf(out, "P1\n");
-    fprintf(out, "# Produced by mpi-rule30\n");
-    fprintf(out, "%d %d\n", width, nsteps);
+  /* All processes create the output file together */
+  out = create_image(outname, width, nsteps, width / comm_sz);
 
+  if (0 == my_rank) {
     /* Initialize the domain
 
        NOTE: the parallel version does not need ghost cells in the
@@ -310,25 +687,67 @@ int main(int argc, char* argv[]) {
     // next = (cell_t*)malloc(ext_width * sizeof(*next));
     // assert(next != NULL);
     init_domain(cur, ext_width);
+    if (packed) {
+      cur_w = (word_t*)malloc(width / WORD_BITS * sizeof(*cur_w));
+      assert(cur_w != NULL);
+      pack_cells(&cur[HALO], cur_w, width / WORD_BITS);
+    }
   }
 
-  /* Compute the rank of the next and previous processes. These will
-     be used to exchange the boundary. */
-  const int rank_next = (my_rank + 1) % comm_sz;
-  const int rank_prev = (my_rank - 1 + comm_sz) % comm_sz;
-
   /* compute the size of each local domain; this should be set to
      `width / comm_sz + 2*HALO`, since it must include the ghost
      cells */
   const int local_width = width / comm_sz;
-  const int local_ext_width = local_width + (2 * HALO);
+
+  /* The local domains hold either one cell per element (MPI_CHAR),
+     or WORD_BITS cells per element (MPI_UINT64_T) with `-b`; from
+     now on, the indices refer to elements, and the ghosts are
+     `ghost` elements on each side. */
+  const MPI_Datatype elem_type = packed ? MPI_UINT64_T : MPI_CHAR;
+  const size_t elem_size = packed ? sizeof(word_t) : sizeof(cell_t);
+  const int local_n = packed ? local_width / WORD_BITS : local_width;
+
+  /* The ghosts are filled by the neighbors, so there can not be more
+     than `local_n` of them. A halo deeper than the number of steps is
+     harmless but useless, so the depth is clamped to `nsteps`. */
+  const int max_depth = packed ? (local_n - 1) * WORD_BITS + 1 : local_n;
+  const int max_steps = (nsteps > 0 ? nsteps : 1);
+  if (depth > max_steps) {
+    depth = max_steps;
+  }
+  if (0 == depth) {
+    depth = tune_depth(
+        local_n,
+        packed,
+        elem_type,
+        elem_size,
+        (max_depth < max_steps ? max_depth : max_steps)
+    );
+  }
+  /* Every rank has the same `depth` and `max_depth`, so all of them
+     take this branch; only rank 0 prints the diagnostic. */
+  if (depth > max_depth) {
+    if (0 == my_rank) {
+      fprintf(stderr, "FATAL: the halo depth must be at most %d\n", max_depth);
+    }
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  const int ghost = ghost_width(depth, packed);
+  const int local_ext_width = local_n + (2 * ghost);
+
+  /* The ghosts are exchanged with the previous and next process;
+     the domain is cyclic. */
+  if (halo_init_1d(&halo, MPI_COMM_WORLD, local_n, ghost, elem_type, 1) != 0) {
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
 
   /* `local_cur` and `local_next` are the local domains; they both
      have `local_ext_width` elements each */
-  cell_t* local_cur = (cell_t*)malloc(local_ext_width * sizeof(*local_cur));
+  char* local_cur = (char*)malloc(local_ext_width * elem_size);
   assert(local_cur != NULL);
-  cell_t* local_next = (cell_t*)malloc(local_ext_width * sizeof(*local_next));
+  char* local_next = (char*)malloc(local_ext_width * elem_size);
   assert(local_next != NULL);
+  char* tmp;
 
   const int LEFT_GHOST = 0;
   const int LEFT = LEFT_GHOST + HALO;
@@ -360,78 +779,59 @@ int main(int argc, char* argv[]) {
                  LOCAL_LEFT_GHOST
   */
   const int LOCAL_LEFT_GHOST = LEFT_GHOST;
-  const int LOCAL_LEFT = LOCAL_LEFT_GHOST + HALO;
-  const int LOCAL_RIGHT = local_ext_width - HALO - 1;
-  const int LOCAL_RIGHT_GHOST = LOCAL_RIGHT + 1;
+  const int LOCAL_LEFT = LOCAL_LEFT_GHOST + ghost;
+  const int LOCAL_RIGHT = local_ext_width - ghost - 1;
 
   MPI_Scatter(
-      &cur[LEFT],              // sendbuf
-      local_width,             // sendcount
-      MPI_CHAR,                // sendtype
-      &local_cur[LOCAL_LEFT],  // recvbuf
-      local_width,             // recvcount
-      MPI_CHAR,                // recvtype
-      0,                       // root
-      MPI_COMM_WORLD           // comm
+      packed ? (void*)cur_w : (void*)&cur[LEFT],  // sendbuf
+      local_n,                                    // sendcount
+      elem_type,                                  // sendtype
+      local_cur + LOCAL_LEFT * elem_size,         // recvbuf
+      local_n,                                    // recvcount
+      elem_type,                                  // recvtype
+      0,                                          // root
+      MPI_COMM_WORLD                              // comm
   );
 
-  for (int s = 0; s < nsteps; s++) {
-    /* This is OK; the master dumps the current state of the automaton */
-    if (0 == my_rank) {
-      /* Dump the current state to the output image */
-      dump_state(out, cur, ext_width);
-    }
-
-    /* Send the right boundary to right neighbor; receive the left
-       boundary from left neighbor (X=halo)
+  /* Each process accumulates `batch` rows of its own slice of the
+     image (about BATCH_BYTES bytes) before writing them. */
+  const int local_bytes = local_width / 8;
+  int batch = BATCH_BYTES / local_bytes;
+  if (batch > nsteps) {
+    batch = nsteps;
+  }
+  if (batch < 1) {
+    batch = 1;
+  }
+  unsigned char* rows = (unsigned char*)malloc((size_t)batch * local_bytes);
+  assert(rows != NULL);
+  int nrows = 0;
 
-             _________          _________
-            /         V        /         V
-       ...---+-+     +-+--------+-+     +-+---...
-             |X|     |X|        |X|     |X|
-       ...---+-+     +-+--------+-+     +-+---...
-                       local_cur[]
+  const double tstart = MPI_Wtime();
 
-    */
-    MPI_Sendrecv(
-        &local_cur[LOCAL_RIGHT],       // sendbuf
-        HALO,                          // sendcount
-        MPI_CHAR,                      // sendtype
-        rank_next,                     // dest
-        ASCENDING_ORDER_TAG,           // sendtag
-        &local_cur[LOCAL_LEFT_GHOST],  // recvbuf
-        HALO,                          // recvcount
-        MPI_CHAR,                      // recvtype
-        rank_prev,                     // source
-        ASCENDING_ORDER_TAG,           // recvtag
-        MPI_COMM_WORLD,                // comm
-        MPI_STATUS_IGNORE              // status
+  for (int s = 0; s < nsteps; s++) {
+    /* Every process stores its part of the current state; no
+       communication is required until the batch is full */
+    store_row(
+        local_cur + LOCAL_LEFT * elem_size,
+        rows + (size_t)nrows * local_bytes,
+        local_width,
+        packed
     );
+    nrows++;
+    if (nrows == batch) {
+      MPI_File_write_all(
+          out,
+          rows,
+          nrows * local_bytes,
+          MPI_BYTE,
+          MPI_STATUS_IGNORE
+      );
+      nrows = 0;
+    }
 
-    /* send left boundary to left neighbor; receive right boundary
-       from right neighbor
-
-               _________          _________
-              V         \        V         \
-       ...---+-+     +-+--------+-+     +-+---...
-             |X|     |X|        |X|     |X|
-       ...---+-+     +-+--------+-+     +-+---...
-                       local_cur
-    */
-    MPI_Sendrecv(
-        &local_cur[LOCAL_LEFT],         // sendbuf
-        HALO,                           // sendcount
-        MPI_CHAR,                       // sendtype
-        rank_prev,                      // dest
-        DESCENDING_ORDER_TAG,           // sendtag
-        &local_cur[LOCAL_RIGHT_GHOST],  // recvbuf
-        HALO,                           // recvcount
-        MPI_CHAR,                       // recvtype
-        rank_next,                      // source
-        DESCENDING_ORDER_TAG,           // recvtag
-        MPI_COMM_WORLD,                 // comm
-        MPI_STATUS_IGNORE               // status
-    );
+    /* Refill the ghost cells once every `depth` steps */
+    const int j = s % depth + 1;
 
     /* [TODO] in the parallel version, all processes must execute
        the "step()" function on ther local domains */
@@ -442,41 +842,26 @@ int main(int argc, char* argv[]) {
       step(cur, next, ext_width);
     }
     */
-    step(local_cur, local_next, local_ext_width);
-
-    /* Gather the updated local domains at the root; it is
-       possible to gather the result at `cur[]` instead of
-       `next[]`; indeed, in the parallel version, `next[]` is not
-       needed at all.
-
-    LEFT_SHOT                           RIGHT_GHOST
-    | LEFT                                  RIGHT |
-    | |                                         | |
-    V V                                         V V
-   +-+----------+----------+----------+----------+-+
-   |X|          |          |          |          |X| cur[]
-   +-+----------+----------+----------+----------+-+
-                 ^^^^^^^^^^
-              +-+----------+-+
-              |X|          |X| local_cur[]
-              +-+----------+-+
-               ^ ^        ^ ^
-               | |        | |
-               | |        | LOCAL_RIGHT_GHOST
-               | |        LOCAL_RIGHT
-               | LOCAL_LEFT
-               LOCAL_LEFT_GHOST
-    */
-    MPI_Gather(
-        &local_next[LOCAL_LEFT],  // sendbuf
-        local_width,              // sendcount
-        MPI_CHAR,                 // sendtype
-        &cur[LEFT],               // recvbuf
-        local_width,              // recvcount
-        MPI_CHAR,                 // recvtype
-        0,                        // root
-        MPI_COMM_WORLD            // comm
-    );
+    if (1 == j) {
+      /* Send the `ghost` elements at both ends of the partition to
+         the neighbors, and receive their boundaries in the ghost
+         elements. In the meantime, update the elements that do not
+         depend on the ghosts, i.e., all but the first and last one
+         of the partition. */
+      halo_start(&halo, local_cur);
+      update(local_cur, local_next, LOCAL_LEFT + 1, LOCAL_RIGHT - 1, packed);
+      halo_wait(&halo);
+      update(local_cur, local_next, 1, LOCAL_LEFT, packed);
+      update(
+          local_cur,
+          local_next,
+          LOCAL_RIGHT,
+          local_ext_width - 2,
+          packed
+      );
+    } else {
+      substep(local_cur, local_next, local_ext_width, j, packed);
+    }
 
     /* swap current and next domain */
     /*
@@ -493,15 +878,59 @@ int main(int argc, char* argv[]) {
     local_cur = local_next;
     local_next = tmp;
   }
+  MPI_File_write_all(
+      out,
+      rows,
+      nrows * local_bytes,
+      MPI_BYTE,
+      MPI_STATUS_IGNORE
+  );
+  MPI_File_close(&out);
+
+  const double elapsed = MPI_Wtime() - tstart;
+
+  /* Compare the communication time that was not overlapped with
+     the time that the same exchanges would take without overlap */
+  const int nexchanges = halo.nexchanges;
+  double t_comm[2] = {halo.t_exposed, 0.0};
+  t_comm[1] = nexchanges * halo_calibrate(&halo, local_cur, 100);
+  halo_free(&halo);
+  MPI_Reduce(
+      my_rank == 0 ? MPI_IN_PLACE : t_comm,
+      t_comm,
+      2,
+      MPI_DOUBLE,
+      MPI_SUM,
+      0,
+      MPI_COMM_WORLD
+  );
 
   /* All done, free memory */
   // free(next);
   free(cur);
+  free(cur_w);
   free(local_cur);
   free(local_next);
+  free(rows);
 
   if (0 == my_rank) {
-    fclose(out);
+    printf("Execution time (s) %f\n", elapsed);
+    printf(
+        "Halo depth %d (%d ghost elements), %d exchanges\n",
+        depth,
+        ghost,
+        nexchanges
+    );
+    /* the exposed time also includes the time spent waiting for
+       slower neighbors, so the estimate is pessimistic */
+    double hidden = (t_comm[1] > 0 ? 1.0 - t_comm[0] / t_comm[1] : 0.0);
+    printf(
+        "Communication (s, summed over processes): %f exposed, %f "
+        "without overlap (%.1f%% hidden)\n",
+        t_comm[0],
+        t_comm[1],
+        100.0 * (hidden > 0 ? hidden : 0.0)
+    );
   }
 
   MPI_Finalize();
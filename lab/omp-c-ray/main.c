@@ -9,10 +9,19 @@
  * see "http://www.gnu.org/licenses/gpl.txt" for details.
  * ---------------------------------------------------------------------------
  * Usage:
- *   compile:  gcc -std=c99 -Wall -Wpedantic -fopenmp -O2 -o omp-c-ray
- * omp-c-ray.c -lm
+ *   compile:  gcc -std=c99 -Wall -Wpedantic -fopenmp -pthread -O2
+ * -fno-math-errno -I../../include -o omp-c-ray omp-c-ray.c -lm
  *
  *   run:      ./omp-c-ray -s 1280x1024 < sphfract.small.in > sphfract.ppm
+ *
+ *   MPI:      mpicc -std=c99 -Wall -Wpedantic -fopenmp -pthread -O2 -DUSE_MPI
+ * -fno-math-errno -I../../include -o mpi-c-ray omp-c-ray.c -lm
+ *             mpirun -n 4 ./mpi-c-ray -s 1280x1024 -i sphfract.small.in
+ * -o sphfract.ppm
+ *
+ *             Process 0 reads the scene and writes the image; the other
+ *             processes render bands of the image handed out on demand.
+ *             With -k, each process renders whole frames of the animation.
  *   convert:  convert sphfract.ppm sphfract.jpeg
  * ---------------------------------------------------------------------------
  * Scene file format:
@@ -22,6 +31,10 @@
  *   l  x y z
  *   # camera (one)
  *   c  x y z  fov_deg   targetx targety targetz
+ *
+ * Camera path file format (option -k):
+ *   # keyframe (many, in increasing frame order)
+ *   frame  x y z  fov_deg   targetx targety targetz
  ******************************************************************************/
 
 /***
@@ -93,7 +106,7 @@ pixel color is highly variable, leading to load imbalance.
 
 To compile:
 
-        gcc -std=c99 -Wall -Wpedantic -fopenmp omp-c-ray.c -o omp-c-ray -lm
+        gcc -std=c99 -Wall -Wpedantic -fopenmp -I../../include omp-c-ray.c -o omp-c-ray -lm
 
 To render a scene, e.g., [sphfract.small.in](sphfract.small.in):
 
@@ -118,16 +131,26 @@ see the complete list:
 - [dna.in](dna.in) (generated by [gen-dna.c](gen-dna.c))
 
 ***/
+#if _XOPEN_SOURCE < 600
+#define _XOPEN_SOURCE 600
+#endif
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <float.h>
 #include <getopt.h>
 #include <math.h>
 #include <omp.h>
+#include <pthread.h>
 #include <stdint.h> /* for uint8_t */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+#include "pnmio.h"
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -147,11 +170,11 @@ typedef struct {
   double refl; /* reflection intensity */
 } material_t;
 
-typedef struct sphere {
+typedef struct {
   vec3_t pos;
   double rad;
   material_t mat;
-  struct sphere* next;
+  int id; /* position in the scene, used to break ties */
 } sphere_t;
 
 typedef struct {
@@ -162,8 +185,24 @@ typedef struct {
 typedef struct {
   vec3_t pos, targ;
   double half_fov_rad; /* half field of view in radiants */
+  double m[3][3];      /* camera basis, see update_camera() */
+  float mf[3][3];      /* the same basis in single precision */
 } camera_t;
 
+/* Node of the bounding volume hierarchy. Nodes are stored in a flat
+   array, and the two children of an interior node are adjacent, so
+   that a node fits in a single cache line. */
+typedef struct {
+  vec3_t min, max; /* bounding box */
+  int first;       /* leaf: index of the first sphere in `spheres`;
+                      interior: index of the left child (the right
+                      child is `first + 1`) */
+  int count;       /* number of spheres of a leaf, 0 if interior */
+  int axis;        /* split axis of an interior node; the spheres of
+                      the left child have the smaller centers */
+  int pad;
+} bvh_node_t;
+
 /* The __attribute__(( ... )) definition is gcc-specific, and tells
    the compiler that the fields of this structure should not be padded
    or aligned. Since the structure only contains unsigned chars, it
@@ -176,7 +215,7 @@ typedef struct __attribute__((__packed__)) {
 
 /* forward declarations */
 vec3_t trace(ray_t ray, int depth);
-vec3_t shade(sphere_t* obj, spoint_t* sp, int depth);
+vec3_t shade(const sphere_t* obj, spoint_t* sp, int depth);
 
 #define MAX_LIGHTS 16          /* maximum number of lights     */
 const double RAY_MAG = 1000.0; /* trace rays of this magnitude */
@@ -189,15 +228,22 @@ const double DEG_TO_RAD = M_PI / 180.0; /* convert degrees to radians   */
 int xres = 800;
 int yres = 600;
 double aspect;
-sphere_t* obj_list = NULL;
+sphere_t* spheres = NULL; /* spheres in BVH leaf order */
+int nspheres = 0;
+bvh_node_t* bvh_nodes = NULL;
+int bvh_nnodes = 0;
+int packet_size = 1; /* number of primary rays traced together */
+int use_float = 0;   /* trace rays in single precision */
+double adapt_threshold = -1.0; /* adaptive sampling if non-negative */
+int min_samples = 4; /* samples per pixel taken before each check */
 vec3_t lights[MAX_LIGHTS];
 int lnum = 0; /* number of lights */
 camera_t cam;
+int my_rank = 0; /* rank of this process, always 0 without MPI */
+int comm_sz = 1; /* number of processes, always 1 without MPI   */
 
-#define NRAN 1024
-#define MASK (NRAN - 1)
-vec3_t urand[NRAN];
-int irand[NRAN];
+/* key of the counter-based generator of the jitter */
+const uint32_t JITTER_KEY[2] = {0x2545F491u, 0x9E3779B9u};
 
 const char* usage = {
     "\n"
@@ -207,6 +253,20 @@ const char* usage = {
     "Options:\n"
     "  -s WxH     width (W) and height (H) of the image (default 800x600)\n"
     "  -r <rays>  shoot <rays> rays per pixel (antialiasing, default 1)\n"
+    "  -p <n>     trace packets of <n> = 1, 4, 8 or 16 primary rays\n"
+    "             (default 1, no packets)\n"
+    "  -a <err>   adaptive sampling: stop sampling a pixel when the standard\n"
+    "             error of its color is at most <err> (e.g., 0.01); -r is\n"
+    "             then the maximum number of rays per pixel\n"
+    "  -m <rays>  with -a, check the error every <rays> rays (default 4)\n"
+    "  -k <file>  render an animation along the camera path in <file>; -o\n"
+    "             is then a file name pattern (default \"frame%04d.ppm\")\n"
+    "  -f         trace rays in single precision (not with -p)\n"
+    "  -d <file>  print the difference between the image and the PPM\n"
+    "             image in <file>, e.g., rendered without -f\n"
+    "  -t <size>  render square tiles of <size> pixels per side (default 16)\n"
+    "  -c <file>  cache the parsed scene and its BVH in <file>, and reuse\n"
+    "             it if the scene has not changed\n"
     "  -i <file>  read from <file> instead of stdin\n"
     "  -o <file>  write to <file> instead of stdout\n"
     "  -h         this help screen\n\n"
@@ -245,15 +305,64 @@ vec3_t cross_product(vec3_t v1, vec3_t v2) {
   return res;
 }
 
-/* jitter function taken from Graphics Gems I. */
+/*
+ * Philox4x32-10 counter-based random number generator (J. K. Salmon et
+ * al., _Parallel random numbers: as easy as 1, 2, 3_, SC 2011,
+ * <https://doi.org/10.1145/2063384.2063405>): the output is a
+ * bijective function of a 128-bit counter, with a 64-bit key. The
+ * jitter of sample `s` of pixel (x, y) is derived from counter
+ * (x, y, s, 0), so it does not depend on the order in which pixels
+ * and samples are computed, there is no limit on the number of
+ * samples, and there is no state, so the jitter of several rays can
+ * be computed in parallel (see `jitter_packet()`).
+ */
+typedef struct {
+  uint32_t v[4];
+} philox_t;
+
+philox_t philox(philox_t c, const uint32_t* key) {
+  uint32_t k0 = key[0], k1 = key[1];
+
+  for (int round = 0; round < 10; round++) {
+    const uint64_t p0 = (uint64_t)0xD2511F53u * c.v[0];
+    const uint64_t p1 = (uint64_t)0xCD9E8D57u * c.v[2];
+    philox_t r;
+    r.v[0] = (uint32_t)(p1 >> 32) ^ c.v[1] ^ k0;
+    r.v[1] = (uint32_t)p1;
+    r.v[2] = (uint32_t)(p0 >> 32) ^ c.v[3] ^ k1;
+    r.v[3] = (uint32_t)p0;
+    c = r;
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+  return c;
+}
+
+/* uniform random number in [-0.5, 0.5) */
+double centered_unit(uint32_t r) { return r * (1.0 / 4294967296.0) - 0.5; }
+
 vec3_t jitter(int x, int y, int s) {
+  const philox_t c = {{(uint32_t)x, (uint32_t)y, (uint32_t)s, 0}};
+  const philox_t r = philox(c, JITTER_KEY);
   vec3_t pt;
-  pt.x = urand[(x + ((unsigned)y << 2) + irand[(x + s) & MASK]) & MASK].x;
-  pt.y = urand[(y + ((unsigned)x << 2) + irand[(y + s) & MASK]) & MASK].y;
+  pt.x = centered_unit(r.v[0]);
+  pt.y = centered_unit(r.v[1]);
   pt.z = 0;
   return pt;
 }
 
+/* Jitter of sample `s` of pixels (x0, y), ..., (x0 + n - 1, y); the
+   same values of `jitter()` */
+void jitter_packet(int x0, int y, int s, int n, double* jx, double* jy) {
+#pragma omp simd
+  for (int l = 0; l < n; l++) {
+    const philox_t c = {{(uint32_t)(x0 + l), (uint32_t)y, (uint32_t)s, 0}};
+    const philox_t r = philox(c, JITTER_KEY);
+    jx[l] = centered_unit(r.v[0]);
+    jy[l] = centered_unit(r.v[1]);
+  }
+}
+
 /*
  * Compute ray-sphere intersection, and return {1, 0} meaning hit or
  * no hit.  Also the surface point parameters like position, normal,
@@ -299,7 +408,362 @@ int ray_sphere(const sphere_t* sph, ray_t ray, spoint_t* sp) {
   return 1;
 }
 
-vec3_t get_sample_pos(int x, int y, int sample) {
+/******************************************************************************
+ * Bounding volume hierarchy
+ *
+ * The BVH is built top-down with binned SAH (surface area heuristic)
+ * splits; subtrees are built in parallel with OpenMP tasks. Both
+ * queries give the same result as testing the ray against every
+ * sphere: a ray can only hit a sphere at a distance that is within
+ * the box of every node containing that sphere, and ties between
+ * spheres at the same distance are broken with the position in the
+ * scene list, as the linear scan did.
+ ******************************************************************************/
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF 4        /* always split larger leaves      */
+#define BVH_TASK_CUTOFF 4096  /* build smaller subtrees serially */
+#define BVH_STACK_SIZE 64
+/* a depth-first traversal keeps at most one pending sibling per level
+   plus the two children just pushed, so nodes deeper than this are
+   turned into leaves; this only happens with very unbalanced scenes */
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 1)
+
+typedef struct {
+  vec3_t min, max;
+} bbox_t;
+
+const bbox_t EMPTY_BOX = {{INFINITY, INFINITY, INFINITY},
+                          {-INFINITY, -INFINITY, -INFINITY}};
+
+double vcomp(vec3_t v, int axis) {
+  return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+bbox_t box_union(bbox_t a, bbox_t b) {
+  bbox_t r;
+  r.min.x = fmin(a.min.x, b.min.x);
+  r.min.y = fmin(a.min.y, b.min.y);
+  r.min.z = fmin(a.min.z, b.min.z);
+  r.max.x = fmax(a.max.x, b.max.x);
+  r.max.y = fmax(a.max.y, b.max.y);
+  r.max.z = fmax(a.max.z, b.max.z);
+  return r;
+}
+
+bbox_t box_add_point(bbox_t a, vec3_t p) {
+  bbox_t b = {p, p};
+  return box_union(a, b);
+}
+
+double box_area(bbox_t b) {
+  const double dx = b.max.x - b.min.x;
+  const double dy = b.max.y - b.min.y;
+  const double dz = b.max.z - b.min.z;
+  if (dx < 0.0) return 0.0; /* empty box */
+  return 2.0 * (dx * dy + dy * dz + dz * dx);
+}
+
+/* bounding box of a sphere, slightly enlarged so that rounding in
+   the ray-box test never culls a sphere that `ray_sphere()` hits */
+bbox_t sphere_box(const sphere_t* sph) {
+  const double r = sph->rad * (1.0 + 1e-9) + 1e-9;
+  bbox_t b;
+  b.min.x = sph->pos.x - r;
+  b.min.y = sph->pos.y - r;
+  b.min.z = sph->pos.z - r;
+  b.max.x = sph->pos.x + r;
+  b.max.y = sph->pos.y + r;
+  b.max.z = sph->pos.z + r;
+  return b;
+}
+
+/* Build the subtree rooted at `node`, at depth `depth`, containing
+   the spheres `idx[0..count-1]` (indices into `list`), which start at
+   position `first` of the final sphere array. `boxes` and `centers`
+   are the bounding boxes and centers of the spheres in `list`. */
+void bvh_build_node(int node,
+                    int depth,
+                    int* idx,
+                    int count,
+                    int first,
+                    const bbox_t* boxes,
+                    const vec3_t* centers) {
+  bvh_node_t* n = &bvh_nodes[node];
+  bbox_t bounds = EMPTY_BOX, cbounds = EMPTY_BOX;
+
+  for (int i = 0; i < count; i++) {
+    bounds = box_union(bounds, boxes[idx[i]]);
+    cbounds = box_add_point(cbounds, centers[idx[i]]);
+  }
+  n->min = bounds.min;
+  n->max = bounds.max;
+  n->first = first;
+  n->count = count;
+
+  if (count <= 1 || depth >= BVH_MAX_DEPTH) return;
+
+  /* evaluate the SAH cost of splitting at the boundaries of
+     `BVH_BINS` equal bins of the centers, along each axis */
+  int best_axis = -1, best_split = 0;
+  double best_cost = INFINITY;
+  for (int axis = 0; axis < 3; axis++) {
+    const double lo = vcomp(cbounds.min, axis);
+    const double extent = vcomp(cbounds.max, axis) - lo;
+    int bin_count[BVH_BINS] = {0};
+    bbox_t bin_box[BVH_BINS];
+    double right_area[BVH_BINS];
+    int right_count[BVH_BINS];
+
+    if (extent <= 0.0) continue;
+    for (int b = 0; b < BVH_BINS; b++) bin_box[b] = EMPTY_BOX;
+    for (int i = 0; i < count; i++) {
+      int b = (int)(BVH_BINS * (vcomp(centers[idx[i]], axis) - lo) / extent);
+      if (b >= BVH_BINS) b = BVH_BINS - 1;
+      bin_count[b]++;
+      bin_box[b] = box_union(bin_box[b], boxes[idx[i]]);
+    }
+    bbox_t acc = EMPTY_BOX;
+    int acc_count = 0;
+    for (int b = BVH_BINS - 1; b > 0; b--) {
+      acc = box_union(acc, bin_box[b]);
+      acc_count += bin_count[b];
+      right_area[b] = box_area(acc);
+      right_count[b] = acc_count;
+    }
+    acc = EMPTY_BOX;
+    acc_count = 0;
+    for (int b = 1; b < BVH_BINS; b++) {
+      acc = box_union(acc, bin_box[b - 1]);
+      acc_count += bin_count[b - 1];
+      const double cost =
+          acc_count * box_area(acc) + right_count[b] * right_area[b];
+      if (acc_count > 0 && right_count[b] > 0 && cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b;
+      }
+    }
+  }
+
+  /* make a leaf if no split is cheaper than intersecting all the
+     spheres (the cost of a traversal step is taken as one sphere) */
+  const double leaf_cost = count * box_area(bounds);
+  int nleft;
+  if (best_axis < 0 || (count <= BVH_MAX_LEAF &&
+                        box_area(bounds) + best_cost >= leaf_cost)) {
+    if (count <= BVH_MAX_LEAF) return;
+    /* the centers coincide: split in half */
+    nleft = count / 2;
+  } else {
+    /* partition `idx` around the chosen bin boundary */
+    const double lo = vcomp(cbounds.min, best_axis);
+    const double extent = vcomp(cbounds.max, best_axis) - lo;
+    int i = 0, j = count - 1;
+    while (i <= j) {
+      int b = (int)(BVH_BINS * (vcomp(centers[idx[i]], best_axis) - lo) /
+                    extent);
+      if (b >= BVH_BINS) b = BVH_BINS - 1;
+      if (b < best_split) {
+        i++;
+      } else {
+        const int tmp = idx[i];
+        idx[i] = idx[j];
+        idx[j] = tmp;
+        j--;
+      }
+    }
+    nleft = i;
+  }
+
+  int left;
+#pragma omp atomic capture
+  {
+    left = bvh_nnodes;
+    bvh_nnodes += 2;
+  }
+  n->first = left;
+  n->count = 0;
+  n->axis = (best_axis < 0 ? 0 : best_axis);
+
+  if (count > BVH_TASK_CUTOFF) {
+#pragma omp task default(none) \
+    firstprivate(left, depth, idx, nleft, first, boxes, centers)
+    bvh_build_node(left, depth + 1, idx, nleft, first, boxes, centers);
+#pragma omp task default(none) \
+    firstprivate(left, depth, idx, nleft, count, first, boxes, centers)
+    bvh_build_node(left + 1, depth + 1, idx + nleft, count - nleft,
+                   first + nleft, boxes, centers);
+#pragma omp taskwait
+  } else {
+    bvh_build_node(left, depth + 1, idx, nleft, first, boxes, centers);
+    bvh_build_node(left + 1, depth + 1, idx + nleft, count - nleft,
+                   first + nleft, boxes, centers);
+  }
+}
+
+/* Build the BVH of the `n` spheres in `objs`, and copy the spheres
+   into the array `spheres` so that the spheres of each leaf are
+   contiguous. The `id` of each sphere is set to its index in `objs`. */
+void bvh_build(sphere_t* objs, int n) {
+  bbox_t* boxes;
+  vec3_t* centers;
+  int* idx;
+
+  nspheres = n;
+  boxes = (bbox_t*)malloc(nspheres * sizeof(*boxes));
+  centers = (vec3_t*)malloc(nspheres * sizeof(*centers));
+  idx = (int*)malloc(nspheres * sizeof(*idx));
+  spheres = (sphere_t*)malloc(nspheres * sizeof(*spheres));
+  /* a binary tree with at most one sphere per leaf has at most
+     2n - 1 nodes */
+  bvh_nodes = (bvh_node_t*)malloc((2 * nspheres + 1) * sizeof(*bvh_nodes));
+  assert(boxes != NULL && centers != NULL && idx != NULL && spheres != NULL &&
+         bvh_nodes != NULL);
+
+  for (int i = 0; i < nspheres; i++) {
+    objs[i].id = i;
+    boxes[i] = sphere_box(&objs[i]);
+    centers[i] = objs[i].pos;
+    idx[i] = i;
+  }
+
+  bvh_nnodes = 1;
+  if (nspheres == 0) {
+    bvh_nodes[0].min = EMPTY_BOX.min;
+    bvh_nodes[0].max = EMPTY_BOX.max;
+    bvh_nodes[0].first = bvh_nodes[0].count = 0;
+  } else {
+#pragma omp parallel default(none) shared(idx, boxes, centers, nspheres)
+#pragma omp single
+    bvh_build_node(0, 0, idx, nspheres, 0, boxes, centers);
+  }
+
+#pragma omp parallel for default(none) shared(spheres, objs, idx, nspheres)
+  for (int k = 0; k < nspheres; k++) spheres[k] = objs[idx[k]];
+
+  free(boxes);
+  free(centers);
+  free(idx);
+}
+
+/* Ray-box intersection with the slab method; `inv_dir` is the
+   componentwise reciprocal of the ray direction. Returns 1 if the
+   box is hit at some parametric distance in [0, tmax], and the
+   entry distance in `tenter`. */
+int ray_box(const bvh_node_t* n,
+            vec3_t orig,
+            vec3_t inv_dir,
+            double tmax,
+            double* tenter) {
+  double t0 = 0.0, t1 = tmax;
+  double ta, tb;
+
+  ta = (n->min.x - orig.x) * inv_dir.x;
+  tb = (n->max.x - orig.x) * inv_dir.x;
+  t0 = fmax(t0, fmin(ta, tb));
+  t1 = fmin(t1, fmax(ta, tb));
+  ta = (n->min.y - orig.y) * inv_dir.y;
+  tb = (n->max.y - orig.y) * inv_dir.y;
+  t0 = fmax(t0, fmin(ta, tb));
+  t1 = fmin(t1, fmax(ta, tb));
+  ta = (n->min.z - orig.z) * inv_dir.z;
+  tb = (n->max.z - orig.z) * inv_dir.z;
+  t0 = fmax(t0, fmin(ta, tb));
+  t1 = fmin(t1, fmax(ta, tb));
+  *tenter = t0;
+  return t0 <= t1;
+}
+
+vec3_t inverse(vec3_t v) {
+  vec3_t r;
+  r.x = 1.0 / v.x;
+  r.y = 1.0 / v.y;
+  r.z = 1.0 / v.z;
+  return r;
+}
+
+/* Find the sphere nearest to the origin of `ray`; returns NULL if no
+   sphere is hit, otherwise the surface point is stored in `sp`.
+   Children are visited nearest-first, and nodes farther than the
+   nearest hit found so far are skipped. */
+const sphere_t* bvh_nearest(ray_t ray, spoint_t* sp) {
+  const vec3_t inv_dir = inverse(ray.dir);
+  const sphere_t* nearest = NULL;
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  double tenter;
+  spoint_t tmp;
+
+  sp->dist = INFINITY;
+  /* the root of an empty scene is not a leaf, but has no children */
+  if (nspheres == 0) return NULL;
+  /* `ray_sphere()` only reports hits in the parametric range [0, 1]
+     of the ray, except when the origin is inside the sphere, in
+     which case the box contains the origin anyway */
+  if (!ray_box(&bvh_nodes[0], ray.orig, inv_dir, 1.0, &tenter)) return NULL;
+  stack[top++] = 0;
+  while (top > 0) {
+    const bvh_node_t* n = &bvh_nodes[stack[--top]];
+    if (n->count > 0) {
+      for (int i = n->first; i < n->first + n->count; i++) {
+        if (ray_sphere(&spheres[i], ray, &tmp) &&
+            (!nearest || tmp.dist < sp->dist ||
+             (tmp.dist == sp->dist && spheres[i].id < nearest->id))) {
+          nearest = &spheres[i];
+          *sp = tmp;
+        }
+      }
+    } else {
+      const double tmax = fmin(1.0, sp->dist);
+      double tl, tr;
+      const int hl = ray_box(&bvh_nodes[n->first], ray.orig, inv_dir, tmax, &tl);
+      const int hr =
+          ray_box(&bvh_nodes[n->first + 1], ray.orig, inv_dir, tmax, &tr);
+      /* push the farther child first, so that the nearer is visited
+         first */
+      if (hl && hr) {
+        assert(top + 2 <= BVH_STACK_SIZE);
+        stack[top++] = (tl <= tr ? n->first + 1 : n->first);
+        stack[top++] = (tl <= tr ? n->first : n->first + 1);
+      } else if (hl || hr) {
+        assert(top + 1 <= BVH_STACK_SIZE);
+        stack[top++] = (hl ? n->first : n->first + 1);
+      }
+    }
+  }
+  return nearest;
+}
+
+/* Return 1 if any sphere intersects `ray`; stops at the first
+   hit. This is the query used for shadow rays. */
+int bvh_occluded(ray_t ray) {
+  const vec3_t inv_dir = inverse(ray.dir);
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  double tenter;
+
+  if (nspheres == 0) return 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const bvh_node_t* n = &bvh_nodes[stack[--top]];
+    if (!ray_box(n, ray.orig, inv_dir, 1.0, &tenter)) continue;
+    if (n->count > 0) {
+      for (int i = n->first; i < n->first + n->count; i++) {
+        if (ray_sphere(&spheres[i], ray, 0)) return 1;
+      }
+    } else {
+      assert(top + 2 <= BVH_STACK_SIZE);
+      stack[top++] = n->first + 1;
+      stack[top++] = n->first;
+    }
+  }
+  return 0;
+}
+
+/* Position of sample `sample` of pixel (x, y) with jitter `jt`; sample
+   0 is the center of the pixel, and is not jittered */
+vec3_t sample_pos(int x, int y, int sample, vec3_t jt) {
   vec3_t pt;
   static double sf = -1.0;
 
@@ -312,18 +776,21 @@ vec3_t get_sample_pos(int x, int y, int sample) {
   pt.z = 0;
 
   if (sample) {
-    vec3_t jt = jitter(x, y, sample);
     pt.x += jt.x * sf;
     pt.y += jt.y * sf / aspect;
   }
   return pt;
 }
 
-/* determine the primary ray corresponding to the specified pixel (x, y) */
-ray_t get_primary_ray(int x, int y, int sample) {
-  ray_t ray;
-  double m[3][3];
-  vec3_t i, j = {0, 1, 0}, k, dir, orig, foo;
+vec3_t get_sample_pos(int x, int y, int sample) {
+  const vec3_t no_jitter = {0, 0, 0};
+  return sample_pos(x, y, sample, sample ? jitter(x, y, sample) : no_jitter);
+}
+
+/* Compute the basis of the camera, which depends only on the camera
+   position and target; it must be called whenever `cam` changes. */
+void update_camera(void) {
+  vec3_t i, j = {0, 1, 0}, k;
 
   k.x = cam.targ.x - cam.pos.x;
   k.y = cam.targ.y - cam.pos.y;
@@ -332,50 +799,55 @@ ray_t get_primary_ray(int x, int y, int sample) {
 
   i = cross_product(j, k);
   j = cross_product(k, i);
-  m[0][0] = i.x;
-  m[0][1] = j.x;
-  m[0][2] = k.x;
-  m[1][0] = i.y;
-  m[1][1] = j.y;
-  m[1][2] = k.y;
-  m[2][0] = i.z;
-  m[2][1] = j.z;
-  m[2][2] = k.z;
-
-  ray.orig.x = ray.orig.y = ray.orig.z = 0.0;
-  ray.dir = get_sample_pos(x, y, sample);
-  ray.dir.z = 1.0 / cam.half_fov_rad;
-  ray.dir.x *= RAY_MAG;
-  ray.dir.y *= RAY_MAG;
-  ray.dir.z *= RAY_MAG;
-
-  dir.x = ray.dir.x + ray.orig.x;
-  dir.y = ray.dir.y + ray.orig.y;
-  dir.z = ray.dir.z + ray.orig.z;
+  cam.m[0][0] = i.x;
+  cam.m[0][1] = j.x;
+  cam.m[0][2] = k.x;
+  cam.m[1][0] = i.y;
+  cam.m[1][1] = j.y;
+  cam.m[1][2] = k.y;
+  cam.m[2][0] = i.z;
+  cam.m[2][1] = j.z;
+  cam.m[2][2] = k.z;
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 3; c++) cam.mf[r][c] = (float)cam.m[r][c];
+  }
+}
+
+/* Return the primary ray through the sample position `pt` */
+ray_t camera_ray(vec3_t pt) {
+  ray_t ray;
+  double(*m)[3] = cam.m;
+  vec3_t dir = pt, foo;
+
+  dir.z = 1.0 / cam.half_fov_rad;
+  dir.x *= RAY_MAG;
+  dir.y *= RAY_MAG;
+  dir.z *= RAY_MAG;
+
   foo.x = dir.x * m[0][0] + dir.y * m[0][1] + dir.z * m[0][2];
   foo.y = dir.x * m[1][0] + dir.y * m[1][1] + dir.z * m[1][2];
   foo.z = dir.x * m[2][0] + dir.y * m[2][1] + dir.z * m[2][2];
 
-  orig.x = ray.orig.x * m[0][0] + ray.orig.y * m[0][1] + ray.orig.z * m[0][2] +
-           cam.pos.x;
-  orig.y = ray.orig.x * m[1][0] + ray.orig.y * m[1][1] + ray.orig.z * m[1][2] +
-           cam.pos.y;
-  orig.z = ray.orig.x * m[2][0] + ray.orig.y * m[2][1] + ray.orig.z * m[2][2] +
-           cam.pos.z;
-
-  ray.orig = orig;
-  ray.dir.x = foo.x + orig.x;
-  ray.dir.y = foo.y + orig.y;
-  ray.dir.z = foo.z + orig.z;
+  /* the ray starts from the origin of the camera space, which is the
+     camera position in world space */
+  ray.orig = cam.pos;
+  ray.dir.x = foo.x + ray.orig.x;
+  ray.dir.y = foo.y + ray.orig.y;
+  ray.dir.z = foo.z + ray.orig.z;
 
   return ray;
 }
 
+/* determine the primary ray corresponding to the specified pixel (x, y) */
+ray_t get_primary_ray(int x, int y, int sample) {
+  return camera_ray(get_sample_pos(x, y, sample));
+}
+
 /*
  * Compute direct illumination with the phong reflectance model.  Also
  * handles reflections by calling trace again, if necessary.
  */
-vec3_t shade(sphere_t* obj, spoint_t* sp, int depth) {
+vec3_t shade(const sphere_t* obj, spoint_t* sp, int depth) {
   vec3_t col = {0, 0, 0};
 
   /* for all lights ... */
@@ -383,7 +855,6 @@ vec3_t shade(sphere_t* obj, spoint_t* sp, int depth) {
     double ispec, idiff;
     vec3_t ldir;
     ray_t shadow_ray;
-    sphere_t* iter = obj_list;
     int in_shadow = 0;
 
     ldir.x = lights[i].x - sp->pos.x;
@@ -395,11 +866,7 @@ vec3_t shade(sphere_t* obj, spoint_t* sp, int depth) {
 
     /* shoot shadow rays to determine if we have a line of sight
        with the light */
-    for (iter = obj_list; (iter != NULL) && !ray_sphere(iter, shadow_ray, 0);
-         iter = iter->next) {
-      /* empty body */
-    }
-    in_shadow = (iter != NULL);
+    in_shadow = bvh_occluded(shadow_ray);
     /* and if we're not in shadow, calculate direct illumination
        with the phong model. */
     if (!in_shadow) {
@@ -444,10 +911,8 @@ vec3_t shade(sphere_t* obj, spoint_t* sp, int depth) {
  */
 vec3_t trace(ray_t ray, int depth) {
   vec3_t col;
-  spoint_t sp, nearest_sp;
-  sphere_t* nearest_obj = NULL;
-
-  nearest_sp.dist = INFINITY;
+  spoint_t nearest_sp;
+  const sphere_t* nearest_obj;
 
   /* if we reached the recursion limit, bail out */
   if (depth >= MAX_RAY_DEPTH) {
@@ -456,13 +921,7 @@ vec3_t trace(ray_t ray, int depth) {
   }
 
   /* find the nearest intersection ... */
-  for (sphere_t* iter = obj_list; iter != NULL; iter = iter->next) {
-    if (ray_sphere(iter, ray, &sp) &&
-        (!nearest_obj || sp.dist < nearest_sp.dist)) {
-      nearest_obj = iter;
-      nearest_sp = sp;
-    }
-  }
+  nearest_obj = bvh_nearest(ray, &nearest_sp);
 
   /* and perform shading calculations as needed by calling shade() */
   if (nearest_obj != NULL) {
@@ -474,139 +933,1786 @@ vec3_t trace(ray_t ray, int depth) {
   return col;
 }
 
-/* render a frame of xsz/ysz dimensions into the provided framebuffer */
-void render(int xsz, int ysz, pixel_t* fb, int samples) {
+/******************************************************************************
+ * Single precision
+ *
+ * With -f, rays are traced in single precision, using float copies of
+ * the spheres and of the BVH. The boxes of the float BVH are rounded
+ * outwards, so that they still contain their spheres. The ray-sphere
+ * test uses the relative position of the ray origin and the stable
+ * form of the quadratic formula, which lose less precision than the
+ * expanded form of `ray_sphere()`; hit points are moved off the
+ * surface by a multiple of their rounding error, to avoid acne from
+ * self-intersections. The specular
+ * term pow(x, spow), x in [0, 1], is interpolated from a lookup table
+ * of each distinct specular power (up to `MAX_SPEC_TABLES`; the other
+ * powers fall back to powf()).
+ *
+ * Use -d to measure the difference from the image rendered in double
+ * precision.
+ ******************************************************************************/
+
+#define SPEC_TABLE_LEN 2048 /* intervals of a specular lookup table */
+#define MAX_SPEC_TABLES 64
+
+typedef struct {
+  float x, y, z;
+} vec3f_t;
+
+typedef struct {
+  vec3f_t orig, dir;
+} rayf_t;
+
+typedef struct {
+  vec3f_t pos;
+  float rad;
+  vec3f_t col;
+  float refl;
+  float spow;
+  int spec; /* index of the specular table, -1 if none */
+  int id;
+} spheref_t;
+
+typedef struct {
+  vec3f_t min, max;
+  int first, count;
+} bvhf_node_t;
+
+typedef struct {
+  vec3f_t pos, normal, vref;
+  float dist;
+} spointf_t;
+
+const float ERR_MARGIN_F = 1e-6f;
+spheref_t* spheres_f = NULL;  /* same order of `spheres` */
+bvhf_node_t* bvh_nodes_f = NULL;
+float (*spec_tables)[SPEC_TABLE_LEN + 1] = NULL;
+int nspec_tables = 0;
+
+vec3f_t to_float(vec3_t v) {
+  vec3f_t f = {(float)v.x, (float)v.y, (float)v.z};
+  return f;
+}
+
+float dotf(vec3f_t a, vec3f_t b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+vec3f_t normalizef(vec3f_t v) {
+  const float inv_len = 1.0f / sqrtf(dotf(v, v));
+  vec3f_t result = {v.x * inv_len, v.y * inv_len, v.z * inv_len};
+  return result;
+}
+
+vec3f_t reflectf(vec3f_t v, vec3f_t n) {
+  const float d = dotf(v, n);
+  vec3f_t res = {-(2.0f * d * n.x - v.x), -(2.0f * d * n.y - v.y),
+                 -(2.0f * d * n.z - v.z)};
+  return res;
+}
+
+/* Round `x` to the nearest float not greater (dir < 0) or not smaller
+   (dir > 0) than `x` */
+float round_float(double x, int dir) {
+  float f = (float)x;
+  if (dir < 0 && (double)f > x) f = nextafterf(f, -INFINITY);
+  if (dir > 0 && (double)f < x) f = nextafterf(f, INFINITY);
+  return f;
+}
+
+/* Return the index of the lookup table of specular power `spow`,
+   creating it if necessary; return -1 if there are too many tables */
+int spec_table(double spow) {
+  static double table_spow[MAX_SPEC_TABLES];
+
+  for (int t = 0; t < nspec_tables; t++) {
+    if (table_spow[t] == spow) return t;
+  }
+  if (nspec_tables == MAX_SPEC_TABLES) return -1;
+  const int t = nspec_tables++;
+  table_spow[t] = spow;
+  for (int k = 0; k <= SPEC_TABLE_LEN; k++) {
+    spec_tables[t][k] = (float)pow((double)k / SPEC_TABLE_LEN, spow);
+  }
+  return t;
+}
+
+/* Create the single-precision copies of the spheres and of the BVH */
+void float_init_scene(void) {
+  spheres_f = (spheref_t*)malloc(nspheres * sizeof(*spheres_f));
+  bvh_nodes_f = (bvhf_node_t*)malloc(bvh_nnodes * sizeof(*bvh_nodes_f));
+  spec_tables = malloc(MAX_SPEC_TABLES * sizeof(*spec_tables));
+  assert(spheres_f != NULL && bvh_nodes_f != NULL && spec_tables != NULL);
+
+  nspec_tables = 0;
+  for (int i = 0; i < nspheres; i++) {
+    const sphere_t* s = &spheres[i];
+    spheref_t* f = &spheres_f[i];
+    f->pos = to_float(s->pos);
+    f->rad = (float)s->rad;
+    f->col = to_float(s->mat.col);
+    f->refl = (float)s->mat.refl;
+    f->spow = (float)s->mat.spow;
+    f->spec = (s->mat.spow > 0.0 ? spec_table(s->mat.spow) : -1);
+    f->id = s->id;
+  }
+  for (int n = 0; n < bvh_nnodes; n++) {
+    const bvh_node_t* b = &bvh_nodes[n];
+    bvhf_node_t* f = &bvh_nodes_f[n];
+    f->min.x = round_float(b->min.x, -1);
+    f->min.y = round_float(b->min.y, -1);
+    f->min.z = round_float(b->min.z, -1);
+    f->max.x = round_float(b->max.x, 1);
+    f->max.y = round_float(b->max.y, 1);
+    f->max.z = round_float(b->max.z, 1);
+    f->first = b->first;
+    f->count = b->count;
+  }
+}
+
+void float_free_scene(void) {
+  free(spheres_f);
+  free(bvh_nodes_f);
+  free(spec_tables);
+  spheres_f = NULL;
+  bvh_nodes_f = NULL;
+  spec_tables = NULL;
+}
+
+/* pow(x, spow) of sphere `s`, for x in [0, 1] */
+float specular(const spheref_t* s, float x) {
+  if (s->spec < 0) return powf(x, s->spow);
+
+  const float u = x * SPEC_TABLE_LEN;
+  const int k = (int)u;
+  if (k >= SPEC_TABLE_LEN) return spec_tables[s->spec][SPEC_TABLE_LEN];
+  const float w = u - k;
+  return spec_tables[s->spec][k] +
+         w * (spec_tables[s->spec][k + 1] - spec_tables[s->spec][k]);
+}
+
+/* Single-precision version of `ray_sphere()` */
+int ray_sphere_f(const spheref_t* sph, rayf_t ray, spointf_t* sp) {
+  const vec3f_t oc = {ray.orig.x - sph->pos.x, ray.orig.y - sph->pos.y,
+                      ray.orig.z - sph->pos.z};
+  const float a = dotf(ray.dir, ray.dir);
+  const float b = dotf(ray.dir, oc); /* half of the linear coefficient */
+  const float c = dotf(oc, oc) - sph->rad * sph->rad;
+  const float d = b * b - a * c;
+  float t1, t2;
+
+  if (d < 0.0f) return 0;
+
+  /* the root of smaller magnitude is computed as c / q, which does not
+     suffer from cancellation when a secondary ray leaves the surface
+     of a sphere and c is close to zero */
+  const float q = -(b + copysignf(sqrtf(d), b));
+  t1 = q / a;
+  t2 = (q != 0.0f ? c / q : t1);
+
+  if ((t1 < ERR_MARGIN_F && t2 < ERR_MARGIN_F) || (t1 > 1.0f && t2 > 1.0f))
+    return 0;
+
+  if (sp) {
+    if (t1 < ERR_MARGIN_F) t1 = t2;
+    if (t2 < ERR_MARGIN_F) t2 = t1;
+    sp->dist = t1 < t2 ? t1 : t2;
+
+    sp->pos.x = ray.orig.x + ray.dir.x * sp->dist;
+    sp->pos.y = ray.orig.y + ray.dir.y * sp->dist;
+    sp->pos.z = ray.orig.z + ray.dir.z * sp->dist;
+
+    const float inv_rad = 1.0f / sph->rad;
+    sp->normal.x = (sp->pos.x - sph->pos.x) * inv_rad;
+    sp->normal.y = (sp->pos.y - sph->pos.y) * inv_rad;
+    sp->normal.z = (sp->pos.z - sph->pos.z) * inv_rad;
+
+    sp->vref = normalizef(reflectf(ray.dir, sp->normal));
+
+    /* the rounding error of the hit point is proportional to the
+       magnitude of the coordinates and of the radius (the walls of
+       the scenes are huge spheres); the point is moved outwards by a
+       few times that error, so that the secondary rays do not hit
+       the sphere they start from */
+    const float mag = sph->rad + fmaxf(fabsf(sp->pos.x),
+                                       fmaxf(fabsf(sp->pos.y), fabsf(sp->pos.z)));
+    const float offset = 8.0f * FLT_EPSILON * mag;
+    sp->pos.x += sp->normal.x * offset;
+    sp->pos.y += sp->normal.y * offset;
+    sp->pos.z += sp->normal.z * offset;
+  }
+  return 1;
+}
+
+/* Slab test of `ray_box()`. Unlike fminf()/fmaxf(), which are
+   usually library calls, the comparisons below compile to single
+   min/max instructions; they are ordered so that a NaN (0 * inf, when
+   the origin lies on a slab plane) never shrinks the interval. */
+int ray_box_f(const bvhf_node_t* n,
+              vec3f_t orig,
+              vec3f_t inv_dir,
+              float tmax,
+              float* tenter) {
+  float t0 = 0.0f, t1 = tmax;
+  float ta, tb, lo, hi;
+
+  ta = (n->min.x - orig.x) * inv_dir.x;
+  tb = (n->max.x - orig.x) * inv_dir.x;
+  lo = (ta < tb ? ta : tb);
+  hi = (ta < tb ? tb : ta);
+  t0 = (lo > t0 ? lo : t0);
+  t1 = (hi < t1 ? hi : t1);
+  ta = (n->min.y - orig.y) * inv_dir.y;
+  tb = (n->max.y - orig.y) * inv_dir.y;
+  lo = (ta < tb ? ta : tb);
+  hi = (ta < tb ? tb : ta);
+  t0 = (lo > t0 ? lo : t0);
+  t1 = (hi < t1 ? hi : t1);
+  ta = (n->min.z - orig.z) * inv_dir.z;
+  tb = (n->max.z - orig.z) * inv_dir.z;
+  lo = (ta < tb ? ta : tb);
+  hi = (ta < tb ? tb : ta);
+  t0 = (lo > t0 ? lo : t0);
+  t1 = (hi < t1 ? hi : t1);
+  *tenter = t0;
+  return t0 <= t1;
+}
+
+vec3f_t inversef(vec3f_t v) {
+  vec3f_t r = {1.0f / v.x, 1.0f / v.y, 1.0f / v.z};
+  return r;
+}
+
+/* Single-precision version of `bvh_nearest()` */
+const spheref_t* bvh_nearest_f(rayf_t ray, spointf_t* sp) {
+  const vec3f_t inv_dir = inversef(ray.dir);
+  const spheref_t* nearest = NULL;
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  float tenter;
+  spointf_t tmp;
+
+  sp->dist = INFINITY;
+  if (nspheres == 0) return NULL;
+  if (!ray_box_f(&bvh_nodes_f[0], ray.orig, inv_dir, 1.0f, &tenter))
+    return NULL;
+  stack[top++] = 0;
+  while (top > 0) {
+    const bvhf_node_t* n = &bvh_nodes_f[stack[--top]];
+    if (n->count > 0) {
+      for (int i = n->first; i < n->first + n->count; i++) {
+        if (ray_sphere_f(&spheres_f[i], ray, &tmp) &&
+            (!nearest || tmp.dist < sp->dist ||
+             (tmp.dist == sp->dist && spheres_f[i].id < nearest->id))) {
+          nearest = &spheres_f[i];
+          *sp = tmp;
+        }
+      }
+    } else {
+      const float tmax = fminf(1.0f, sp->dist);
+      float tl, tr;
+      const int hl =
+          ray_box_f(&bvh_nodes_f[n->first], ray.orig, inv_dir, tmax, &tl);
+      const int hr =
+          ray_box_f(&bvh_nodes_f[n->first + 1], ray.orig, inv_dir, tmax, &tr);
+      if (hl && hr) {
+        assert(top + 2 <= BVH_STACK_SIZE);
+        stack[top++] = (tl <= tr ? n->first + 1 : n->first);
+        stack[top++] = (tl <= tr ? n->first : n->first + 1);
+      } else if (hl || hr) {
+        assert(top + 1 <= BVH_STACK_SIZE);
+        stack[top++] = (hl ? n->first : n->first + 1);
+      }
+    }
+  }
+  return nearest;
+}
+
+/* Single-precision version of `bvh_occluded()` */
+int bvh_occluded_f(rayf_t ray) {
+  const vec3f_t inv_dir = inversef(ray.dir);
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  float tenter;
+
+  if (nspheres == 0) return 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const bvhf_node_t* n = &bvh_nodes_f[stack[--top]];
+    if (!ray_box_f(n, ray.orig, inv_dir, 1.0f, &tenter)) continue;
+    if (n->count > 0) {
+      for (int i = n->first; i < n->first + n->count; i++) {
+        if (ray_sphere_f(&spheres_f[i], ray, 0)) return 1;
+      }
+    } else {
+      assert(top + 2 <= BVH_STACK_SIZE);
+      stack[top++] = n->first + 1;
+      stack[top++] = n->first;
+    }
+  }
+  return 0;
+}
+
+/* Single-precision version of `get_primary_ray()`; the sample position
+   is computed in double precision, since it is cheap and it is shared
+   with the double-precision path */
+rayf_t get_primary_ray_f(int x, int y, int sample) {
+  const vec3_t pt = get_sample_pos(x, y, sample);
+  const vec3f_t dir = {(float)(pt.x * RAY_MAG), (float)(pt.y * RAY_MAG),
+                       (float)(RAY_MAG / cam.half_fov_rad)};
+  rayf_t ray;
+
+  ray.orig = to_float(cam.pos);
+  ray.dir.x = dir.x * cam.mf[0][0] + dir.y * cam.mf[0][1] +
+              dir.z * cam.mf[0][2] + ray.orig.x;
+  ray.dir.y = dir.x * cam.mf[1][0] + dir.y * cam.mf[1][1] +
+              dir.z * cam.mf[1][2] + ray.orig.y;
+  ray.dir.z = dir.x * cam.mf[2][0] + dir.y * cam.mf[2][1] +
+              dir.z * cam.mf[2][2] + ray.orig.z;
+  return ray;
+}
+
+vec3f_t trace_f(rayf_t ray, int depth);
+
+/* Single-precision version of `shade()` */
+vec3f_t shade_f(const spheref_t* obj, const spointf_t* sp, int depth) {
+  vec3f_t col = {0.0f, 0.0f, 0.0f};
+
+  for (int i = 0; i < lnum; i++) {
+    rayf_t shadow_ray;
+
+    shadow_ray.orig = sp->pos;
+    shadow_ray.dir.x = (float)lights[i].x - sp->pos.x;
+    shadow_ray.dir.y = (float)lights[i].y - sp->pos.y;
+    shadow_ray.dir.z = (float)lights[i].z - sp->pos.z;
+
+    if (!bvh_occluded_f(shadow_ray)) {
+      const vec3f_t ldir = normalizef(shadow_ray.dir);
+      const float idiff = fmaxf(dotf(sp->normal, ldir), 0.0f);
+      const float ispec =
+          obj->spow > 0.0f ? specular(obj, fmaxf(dotf(sp->vref, ldir), 0.0f))
+                           : 0.0f;
+
+      col.x += idiff * obj->col.x + ispec;
+      col.y += idiff * obj->col.y + ispec;
+      col.z += idiff * obj->col.z + ispec;
+    }
+  }
+
+  if (obj->refl > 0.0f) {
+    rayf_t ray;
+
+    ray.orig = sp->pos;
+    ray.dir.x = sp->vref.x * (float)RAY_MAG;
+    ray.dir.y = sp->vref.y * (float)RAY_MAG;
+    ray.dir.z = sp->vref.z * (float)RAY_MAG;
+
+    const vec3f_t rcol = trace_f(ray, depth + 1);
+    col.x += rcol.x * obj->refl;
+    col.y += rcol.y * obj->refl;
+    col.z += rcol.z * obj->refl;
+  }
+
+  return col;
+}
+
+/* Single-precision version of `trace()` */
+vec3f_t trace_f(rayf_t ray, int depth) {
+  vec3f_t col = {0.0f, 0.0f, 0.0f};
+  spointf_t nearest_sp;
+  const spheref_t* nearest_obj;
+
+  if (depth >= MAX_RAY_DEPTH) return col;
+
+  nearest_obj = bvh_nearest_f(ray, &nearest_sp);
+  if (nearest_obj != NULL) col = shade_f(nearest_obj, &nearest_sp, depth);
+  return col;
+}
+
+/* Compare the image in `fb` with the PPM image in file `fname`, and
+   print the maximum difference of a color channel and the PSNR */
+void compare_image(const char* fname, const pixel_t* fb, int xsz, int ysz) {
+  pnm_image_t ref;
+
+  if (pnm_open(fname, &ref) != 0 || ref.type != 6 || ref.width != xsz ||
+      ref.height != ysz || ref.maxval != 255) {
+    fprintf(stderr, "Can not compare with %s: not a %dx%d PPM image\n", fname,
+            xsz, ysz);
+    if (ref.base != NULL) pnm_close(&ref);
+    return;
+  }
+
+  const uint8_t* img = (const uint8_t*)fb;
+  const size_t n = ref.size;
+  double sse = 0.0;
+  size_t nbig = 0; /* channels that differ by more than 2 */
+  int max_diff = 0;
+  for (size_t k = 0; k < n; k++) {
+    const int d = abs((int)img[k] - (int)ref.pixels[k]);
+    if (d > max_diff) max_diff = d;
+    nbig += (d > 2);
+    sse += (double)d * d;
+  }
+  if (sse == 0.0) {
+    fprintf(stderr, "Difference from %s: none (identical images)\n", fname);
+  } else {
+    const double mse = sse / n;
+    fprintf(stderr,
+            "Difference from %s: max %d, PSNR %.2f dB, "
+            "%.3f%% of the channels differ by more than 2\n",
+            fname, max_diff, 10.0 * log10(255.0 * 255.0 / mse),
+            100.0 * nbig / n);
+  }
+  pnm_close(&ref);
+}
+
+/******************************************************************************
+ * Adaptive sampling
+ *
+ * Without adaptive sampling, each pixel is the average of `samples`
+ * primary rays. With adaptive sampling, rays are shot in batches of
+ * `min_samples`, and after each batch the standard error of the mean
+ * color of the pixel is estimated from the variance of the samples
+ * (clamped to [0, 1], since that is the range that ends up in the
+ * image). Sampling stops as soon as the standard error of all three
+ * channels is at most `adapt_threshold`, or when `samples` rays have
+ * been shot. Flat regions, such as the background, converge after
+ * the first batch. Sample `s` of a pixel is always the same ray, so
+ * a pixel that is sampled `samples` times gets exactly the color of
+ * the non-adaptive renderer.
+ ******************************************************************************/
+
+typedef struct {
+  vec3_t sum;          /* sum of the samples                          */
+  vec3_t csum, csum2;  /* sum, sum of squares of the clamped samples  */
+  int n;               /* number of samples                           */
+} pixel_acc_t;
+
+const pixel_acc_t EMPTY_ACC = {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0},
+                               {0.0, 0.0, 0.0}, 0};
+
+void acc_add(pixel_acc_t* a, double r, double g, double b) {
+  a->sum.x += r;
+  a->sum.y += g;
+  a->sum.z += b;
+  if (adapt_threshold >= 0.0) {
+    r = fmin(r, 1.0);
+    g = fmin(g, 1.0);
+    b = fmin(b, 1.0);
+    a->csum.x += r;
+    a->csum.y += g;
+    a->csum.z += b;
+    a->csum2.x += r * r;
+    a->csum2.y += g * g;
+    a->csum2.z += b * b;
+  }
+  a->n++;
+}
+
+/* Return nonzero if the standard error of each channel is at most
+   `adapt_threshold`; always return 0 without adaptive sampling. */
+int acc_converged(const pixel_acc_t* a) {
+  if (adapt_threshold < 0.0 || a->n < 2) return 0;
+
+  const double n = a->n;
+  /* the squared standard error is var / n, where var is the unbiased
+     sample variance */
+  const double max_var = sq(adapt_threshold) * n;
+  const double var_r = (a->csum2.x - sq(a->csum.x) / n) / (n - 1);
+  const double var_g = (a->csum2.y - sq(a->csum.y) / n) / (n - 1);
+  const double var_b = (a->csum2.z - sq(a->csum.z) / n) / (n - 1);
+  return var_r <= max_var && var_g <= max_var && var_b <= max_var;
+}
+
+/* Store the average of the samples into pixel `px` */
+void acc_store(const pixel_acc_t* a, pixel_t* px) {
+  const double r = a->sum.x / a->n;
+  const double g = a->sum.y / a->n;
+  const double b = a->sum.z / a->n;
+
+  px->r = (uint8_t)(fmin(r, 1.0) * 255.0);
+  px->g = (uint8_t)(fmin(g, 1.0) * 255.0);
+  px->b = (uint8_t)(fmin(b, 1.0) * 255.0);
+}
+
+/* Number of samples taken before checking for convergence */
+int sample_batch(int samples) {
+  return (adapt_threshold >= 0.0 ? min_samples : samples);
+}
+
+/******************************************************************************
+ * Ray packets
+ *
+ * Primary rays of adjacent pixels are traced together as a packet of
+ * up to `PACKET_MAX` rays. Rays are stored as structure of arrays, one
+ * array element (lane) per ray, and the spheres are also copied into
+ * a structure of arrays, so that the loops over the lanes can be
+ * vectorized. A mask tells which lanes are still active: lanes are
+ * masked off when the ray misses the scene, or when it hits a
+ * non-reflective surface and therefore spawns no reflection ray.
+ *
+ * The arithmetic of each lane is the same as in the scalar path, so
+ * the image is bit-identical for any packet size.
+ *
+ * The loops over the lanes contain no branches: conditions are
+ * computed as masks (`&` and `|` instead of `&&` and `||`), and
+ * results are selected with conditional expressions, which the
+ * compiler turns into blends. `sqrt()` is only vectorized if the
+ * compiler may ignore `errno`, hence `-fno-math-errno` in the compile
+ * line. With the compile line above (gcc 12, SSE2, one thread),
+ * sphfract.small.in at 400x300 with `-r 4` renders in 2.31 s with
+ * `-p 1`, and in 0.75, 0.73 and 0.80 s with `-p 4`, `-p 8` and `-p 16`;
+ * adding `-O3 -march=native` (AVX-512) gives 1.99 s with `-p 1` and
+ * 0.32 s with `-p 16`.
+ ******************************************************************************/
+
+#define PACKET_MAX 16
+
+typedef struct {
+  double ox[PACKET_MAX], oy[PACKET_MAX], oz[PACKET_MAX];
+  double dx[PACKET_MAX], dy[PACKET_MAX], dz[PACKET_MAX];
+} packet_t;
+
+/* coordinates and radii of `spheres`, as structure of arrays */
+double *sph_x = NULL, *sph_y = NULL, *sph_z = NULL, *sph_rad = NULL;
+
+void packet_init_spheres(void) {
+  sph_x = (double*)malloc(nspheres * sizeof(*sph_x));
+  sph_y = (double*)malloc(nspheres * sizeof(*sph_y));
+  sph_z = (double*)malloc(nspheres * sizeof(*sph_z));
+  sph_rad = (double*)malloc(nspheres * sizeof(*sph_rad));
+  assert(sph_x != NULL && sph_y != NULL && sph_z != NULL && sph_rad != NULL);
+  for (int i = 0; i < nspheres; i++) {
+    sph_x[i] = spheres[i].pos.x;
+    sph_y[i] = spheres[i].pos.y;
+    sph_z[i] = spheres[i].pos.z;
+    sph_rad[i] = spheres[i].rad;
+  }
+}
+
+void packet_free_spheres(void) {
+  free(sph_x);
+  free(sph_y);
+  free(sph_z);
+  free(sph_rad);
+  sph_x = sph_y = sph_z = sph_rad = NULL;
+}
+
+/* Reciprocal of the ray directions; zero components are replaced by
+   a tiny value (by adding it, which leaves the other components
+   unchanged), so that the slab test never computes 0 * inf. */
+void packet_inverse(const packet_t* p,
+                    int n,
+                    double* ix,
+                    double* iy,
+                    double* iz) {
+#pragma omp simd
+  for (int l = 0; l < n; l++) {
+    ix[l] = 1.0 / (p->dx[l] + (p->dx[l] == 0.0 ? 1e-300 : 0.0));
+    iy[l] = 1.0 / (p->dy[l] + (p->dy[l] == 0.0 ? 1e-300 : 0.0));
+    iz[l] = 1.0 / (p->dz[l] + (p->dz[l] == 0.0 ? 1e-300 : 0.0));
+  }
+}
+
+/* Return nonzero if the box of node `nd` is hit by some lane whose
+   `tmax[l]` is non-negative, within [0, tmax[l]]. */
+int packet_box(const bvh_node_t* nd,
+               const packet_t* p,
+               int n,
+               const double* ix,
+               const double* iy,
+               const double* iz,
+               const double* tmax) {
+  const double bx0 = nd->min.x, by0 = nd->min.y, bz0 = nd->min.z;
+  const double bx1 = nd->max.x, by1 = nd->max.y, bz1 = nd->max.z;
+  /* a count of the lanes that hit, in the same type as the lanes */
+  double any = 0.0;
+#pragma omp simd reduction(+ : any)
+  for (int l = 0; l < n; l++) {
+    /* `lo > t0 ? lo : t0` is `fmax(t0, lo)` for non-NaN `t0` */
+    double ta, tb, lo, hi, t0 = 0.0, t1 = tmax[l];
+    ta = (bx0 - p->ox[l]) * ix[l];
+    tb = (bx1 - p->ox[l]) * ix[l];
+    lo = ta < tb ? ta : tb;
+    hi = ta < tb ? tb : ta;
+    t0 = lo > t0 ? lo : t0;
+    t1 = hi < t1 ? hi : t1;
+    ta = (by0 - p->oy[l]) * iy[l];
+    tb = (by1 - p->oy[l]) * iy[l];
+    lo = ta < tb ? ta : tb;
+    hi = ta < tb ? tb : ta;
+    t0 = lo > t0 ? lo : t0;
+    t1 = hi < t1 ? hi : t1;
+    ta = (bz0 - p->oz[l]) * iz[l];
+    tb = (bz1 - p->oz[l]) * iz[l];
+    lo = ta < tb ? ta : tb;
+    hi = ta < tb ? tb : ta;
+    t0 = lo > t0 ? lo : t0;
+    t1 = hi < t1 ? hi : t1;
+    any += (t0 <= t1 ? 1.0 : 0.0);
+  }
+  return any > 0.0;
+}
+
+/* Intersect all lanes with sphere `i`: `t[l]` is set to the distance
+   of the hit, or to a negative value if lane `l` misses. This is the
+   same computation of `ray_sphere()`. */
+void packet_sphere(const packet_t* p, int n, int i, double* t) {
+  const double px = sph_x[i], py = sph_y[i], pz = sph_z[i];
+  const double c0 = sq(px) + sq(py) + sq(pz);
+  const double r2 = sq(sph_rad[i]);
+#pragma omp simd
+  for (int l = 0; l < n; l++) {
+    const double a = sq(p->dx[l]) + sq(p->dy[l]) + sq(p->dz[l]);
+    const double b = 2.0 * p->dx[l] * (p->ox[l] - px) +
+                     2.0 * p->dy[l] * (p->oy[l] - py) +
+                     2.0 * p->dz[l] * (p->oz[l] - pz);
+    const double c = c0 + sq(p->ox[l]) + sq(p->oy[l]) + sq(p->oz[l]) +
+                     2.0 * (-px * p->ox[l] - py * p->oy[l] - pz * p->oz[l]) -
+                     r2;
+    const double d = sq(b) - 4.0 * a * c;
+    const double sqrt_d = sqrt(d >= 0.0 ? d : 0.0);
+    const double t1 = (-b + sqrt_d) / (2.0 * a);
+    const double t2 = (-b - sqrt_d) / (2.0 * a);
+    const int miss = (d < 0.0) | ((t1 < ERR_MARGIN) & (t2 < ERR_MARGIN)) |
+                     ((t1 > 1.0) & (t2 > 1.0));
+    const double u1 = (t1 < ERR_MARGIN ? t2 : t1);
+    const double u2 = (t2 < ERR_MARGIN ? u1 : t2);
+    t[l] = miss ? -1.0 : (u1 < u2 ? u1 : u2);
+  }
+}
+
+/* Index of the first active lane, used to order the traversal of the
+   whole packet; -1 if there are no active lanes. */
+int packet_first(const int* active, int n) {
+  for (int l = 0; l < n; l++) {
+    if (active[l]) return l;
+  }
+  return -1;
+}
+
+/* For each active lane, find the nearest sphere hit by the ray:
+   `hit[l]` is its index in `spheres`, or -1. The packet descends into
+   a node if any active lane hits its box before its nearest hit. */
+void packet_nearest(const packet_t* p, int n, const int* active, int* hit) {
+  double ix[PACKET_MAX], iy[PACKET_MAX], iz[PACKET_MAX];
+  double dist[PACKET_MAX], tmax[PACKET_MAX], t[PACKET_MAX];
+  int hit_id[PACKET_MAX];
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+  const int lead = packet_first(active, n);
+
+  for (int l = 0; l < n; l++) {
+    hit[l] = -1;
+    hit_id[l] = -1;
+    dist[l] = INFINITY;
+  }
+  if (lead < 0 || nspheres == 0) return;
+  packet_inverse(p, n, ix, iy, iz);
+  const double lead_dir[3] = {p->dx[lead], p->dy[lead], p->dz[lead]};
+
+  stack[top++] = 0;
+  while (top > 0) {
+    const bvh_node_t* nd = &bvh_nodes[stack[--top]];
+    /* same culling of the scalar traversal; inactive lanes get a
+       negative range and never hit */
+#pragma omp simd
+    for (int l = 0; l < n; l++) {
+      const double d = (dist[l] < 1.0 ? dist[l] : 1.0);
+      tmax[l] = active[l] ? d : -1.0;
+    }
+    if (!packet_box(nd, p, n, ix, iy, iz, tmax)) continue;
+    if (nd->count > 0) {
+      for (int i = nd->first; i < nd->first + nd->count; i++) {
+        const int id = spheres[i].id;
+        packet_sphere(p, n, i, t);
+#pragma omp simd
+        for (int l = 0; l < n; l++) {
+          const int closer = (hit[l] < 0) | (t[l] < dist[l]) |
+                             ((t[l] == dist[l]) & (id < hit_id[l]));
+          const int upd = (active[l] != 0) & (t[l] >= 0.0) & closer;
+          hit[l] = upd ? i : hit[l];
+          hit_id[l] = upd ? id : hit_id[l];
+          dist[l] = upd ? t[l] : dist[l];
+        }
+      }
+    } else {
+      /* visit first the child that comes first along the direction
+         of the leading ray */
+      assert(top + 2 <= BVH_STACK_SIZE);
+      const int near = (lead_dir[nd->axis] < 0.0);
+      stack[top++] = nd->first + 1 - near;
+      stack[top++] = nd->first + near;
+    }
+  }
+}
+
+/* Clear `active[l]` for every lane whose ray hits some sphere; this
+   is the any-hit query of shadow rays, and stops as soon as all
+   lanes are occluded. */
+void packet_occluded(const packet_t* p, int n, int* active) {
+  double ix[PACKET_MAX], iy[PACKET_MAX], iz[PACKET_MAX];
+  double tmax[PACKET_MAX], t[PACKET_MAX];
+  int stack[BVH_STACK_SIZE];
+  int top = 0;
+
+  if (nspheres == 0) return;
+  packet_inverse(p, n, ix, iy, iz);
+  stack[top++] = 0;
+  while (top > 0) {
+    const bvh_node_t* nd = &bvh_nodes[stack[--top]];
+    int any = 0;
+    for (int l = 0; l < n; l++) {
+      tmax[l] = active[l] ? 1.0 : -1.0;
+      any |= active[l];
+    }
+    if (!any) return;
+    if (!packet_box(nd, p, n, ix, iy, iz, tmax)) continue;
+    if (nd->count > 0) {
+      for (int i = nd->first; i < nd->first + nd->count; i++) {
+        packet_sphere(p, n, i, t);
+#pragma omp simd
+        for (int l = 0; l < n; l++) {
+          active[l] = (t[l] >= 0.0) ? 0 : active[l];
+        }
+      }
+    } else {
+      assert(top + 2 <= BVH_STACK_SIZE);
+      stack[top++] = nd->first + 1;
+      stack[top++] = nd->first;
+    }
+  }
+}
+
+/* Packet version of `trace()` and `shade()`: the color of each active
+   lane is stored in `r`, `g`, `b`; inactive lanes are black. */
+void trace_packet(const packet_t* p,
+                  int n,
+                  const int* active,
+                  int depth,
+                  double* r,
+                  double* g,
+                  double* b) {
+  int hit[PACKET_MAX], live[PACKET_MAX], refl[PACKET_MAX];
+  spoint_t sp[PACKET_MAX];
+  packet_t shadow = {0};
+  int any_refl = 0;
+
+  for (int l = 0; l < n; l++) r[l] = g[l] = b[l] = 0.0;
+
+  /* if we reached the recursion limit, bail out */
+  if (depth >= MAX_RAY_DEPTH) return;
+
+  packet_nearest(p, n, active, hit);
+  for (int l = 0; l < n; l++) {
+    live[l] = active[l] && hit[l] >= 0;
+    if (live[l]) {
+      ray_t ray;
+      ray.orig.x = p->ox[l];
+      ray.orig.y = p->oy[l];
+      ray.orig.z = p->oz[l];
+      ray.dir.x = p->dx[l];
+      ray.dir.y = p->dy[l];
+      ray.dir.z = p->dz[l];
+      ray_sphere(&spheres[hit[l]], ray, &sp[l]);
+    }
+  }
+
+  /* for all lights ... */
+  for (int i = 0; i < lnum; i++) {
+    int lit[PACKET_MAX];
+    for (int l = 0; l < n; l++) {
+      lit[l] = live[l];
+      shadow.ox[l] = live[l] ? sp[l].pos.x : 0.0;
+      shadow.oy[l] = live[l] ? sp[l].pos.y : 0.0;
+      shadow.oz[l] = live[l] ? sp[l].pos.z : 0.0;
+      shadow.dx[l] = lights[i].x - shadow.ox[l];
+      shadow.dy[l] = lights[i].y - shadow.oy[l];
+      shadow.dz[l] = lights[i].z - shadow.oz[l];
+    }
+    packet_occluded(&shadow, n, lit);
+    for (int l = 0; l < n; l++) {
+      if (!lit[l]) continue;
+      const material_t* mat = &spheres[hit[l]].mat;
+      vec3_t ldir = {shadow.dx[l], shadow.dy[l], shadow.dz[l]};
+      ldir = normalize(ldir);
+      const double idiff = fmax(dot(sp[l].normal, ldir), 0.0);
+      const double ispec =
+          mat->spow > 0.0 ? pow(fmax(dot(sp[l].vref, ldir), 0.0), mat->spow)
+                          : 0.0;
+      r[l] += idiff * mat->col.x + ispec;
+      g[l] += idiff * mat->col.y + ispec;
+      b[l] += idiff * mat->col.z + ispec;
+    }
+  }
+
+  /* reflection rays of the lanes that hit a reflective surface;
+     the other lanes are masked off */
+  packet_t rp;
+  for (int l = 0; l < n; l++) {
+    refl[l] = live[l] && spheres[hit[l]].mat.refl > 0.0;
+    any_refl |= refl[l];
+    rp.ox[l] = refl[l] ? sp[l].pos.x : 0.0;
+    rp.oy[l] = refl[l] ? sp[l].pos.y : 0.0;
+    rp.oz[l] = refl[l] ? sp[l].pos.z : 0.0;
+    rp.dx[l] = refl[l] ? sp[l].vref.x * RAY_MAG : 1.0;
+    rp.dy[l] = refl[l] ? sp[l].vref.y * RAY_MAG : 1.0;
+    rp.dz[l] = refl[l] ? sp[l].vref.z * RAY_MAG : 1.0;
+  }
+  if (any_refl) {
+    double rr[PACKET_MAX], rg[PACKET_MAX], rb[PACKET_MAX];
+    trace_packet(&rp, n, refl, depth + 1, rr, rg, rb);
+    for (int l = 0; l < n; l++) {
+      if (!refl[l]) continue;
+      const double k = spheres[hit[l]].mat.refl;
+      r[l] += rr[l] * k;
+      g[l] += rg[l] * k;
+      b[l] += rb[l] * k;
+    }
+  }
+}
+
+/* Render the pixels (i, j), ..., (i + n - 1, j) with one packet per
+   sample, and store their colors into the framebuffer. Lanes whose
+   pixel has converged are masked off. Return the number of primary
+   rays traced. */
+long render_packet(int i, int j, int n, int xsz, pixel_t* fb, int samples) {
+  const int batch = sample_batch(samples);
+  pixel_acc_t acc[PACKET_MAX];
+  int active[PACKET_MAX];
+  packet_t p;
+  int any = (n > 0);
+  int s = 0;
+  long nrays = 0;
+
+  for (int l = 0; l < n; l++) {
+    acc[l] = EMPTY_ACC;
+    active[l] = 1;
+  }
+  while (s < samples && any) {
+    const int end = (s + batch < samples ? s + batch : samples);
+    for (; s < end; s++) {
+      double cr[PACKET_MAX], cg[PACKET_MAX], cb[PACKET_MAX];
+      double jx[PACKET_MAX], jy[PACKET_MAX];
+      jitter_packet(i, j, s, n, jx, jy);
+      for (int l = 0; l < n; l++) {
+        const vec3_t jt = {jx[l], jy[l], 0};
+        const ray_t ray = camera_ray(sample_pos(i + l, j, s, jt));
+        p.ox[l] = ray.orig.x;
+        p.oy[l] = ray.orig.y;
+        p.oz[l] = ray.orig.z;
+        p.dx[l] = ray.dir.x;
+        p.dy[l] = ray.dir.y;
+        p.dz[l] = ray.dir.z;
+      }
+      trace_packet(&p, n, active, 0, cr, cg, cb);
+      for (int l = 0; l < n; l++) {
+        if (active[l]) acc_add(&acc[l], cr[l], cg[l], cb[l]);
+      }
+    }
+    any = 0;
+    for (int l = 0; l < n; l++) {
+      if (active[l] && acc_converged(&acc[l])) active[l] = 0;
+      any |= active[l];
+    }
+  }
+
+  for (int l = 0; l < n; l++) {
+    acc_store(&acc[l], &fb[j * xsz + i + l]);
+    nrays += acc[l].n;
+  }
+  return nrays;
+}
+
+/* Render pixel (i, j) and store its color into the framebuffer;
+   return the number of primary rays traced. */
+int render_pixel(int i, int j, int xsz, pixel_t* fb, int samples) {
+  const int batch = sample_batch(samples);
+  pixel_acc_t acc = EMPTY_ACC;
+  int s = 0;
+
   /*
    * for each subpixel, trace a ray through the scene, accumulate
-   * the colors of the subpixels of each pixel, then put the colors
+   * the colors of the subpixels of the pixel, then put the color
    * into the framebuffer.
    */
-#pragma omp parallel for default(none) shared(ysz, xsz, samples, fb) \
-    schedule(dynamic) collapse(2)
-  for (int j = 0; j < ysz; j++) {
-    for (int i = 0; i < xsz; i++) {
-      double r, g, b;
-      r = g = b = 0.0;
-
-      for (int s = 0; s < samples; s++) {
-        vec3_t col = trace(get_primary_ray(i, j, s), 0);
-        r += col.x;
-        g += col.y;
-        b += col.z;
+  while (s < samples) {
+    const int end = (s + batch < samples ? s + batch : samples);
+    for (; s < end; s++) {
+      if (use_float) {
+        const vec3f_t col = trace_f(get_primary_ray_f(i, j, s), 0);
+        acc_add(&acc, col.x, col.y, col.z);
+      } else {
+        const vec3_t col = trace(get_primary_ray(i, j, s), 0);
+        acc_add(&acc, col.x, col.y, col.z);
+      }
+    }
+    if (acc_converged(&acc)) break;
+  }
+
+  acc_store(&acc, &fb[j * xsz + i]);
+  return s;
+}
+
+/******************************************************************************
+ * Tile scheduler
+ *
+ * The image is split into square tiles of `tile_size` pixels per side
+ * (default 16: a 16x16 tile of primary rays and their pixels fits
+ * comfortably in L1 together with the top of the BVH). A row of tiles
+ * is a "band". Tiles are dealt round-robin to per-thread deques, so
+ * that all threads start from the first band; each thread takes tiles
+ * from the front of its own deque, and when that is empty it steals
+ * from the back of the deque of another thread. Tiles are never
+ * created during the rendering, so a thread can stop as soon as all
+ * deques are empty.
+ *
+ * When a band is complete, it is written to the output file as soon
+ * as all the bands above it have been written, so that a reader of
+ * the PPM can start consuming the image before the frame is done.
+ ******************************************************************************/
+
+int tile_size = 16; /* side of a tile, in pixels */
+long tiles_rendered = 0; /* tiles rendered by `render()`, all frames */
+long tiles_stolen = 0;   /* how many of them were stolen            */
+
+typedef struct {
+  omp_lock_t lock;
+  int head, tail; /* the deque holds tiles[head .. tail-1] */
+  int* tiles;
+  char pad[64]; /* keep the deques of different threads apart */
+} tile_deque_t;
+
+/* Pop a tile from the front of deque `q`; return -1 if it is empty */
+int deque_pop_front(tile_deque_t* q) {
+  int t = -1;
+  omp_set_lock(&q->lock);
+  if (q->head < q->tail) t = q->tiles[q->head++];
+  omp_unset_lock(&q->lock);
+  return t;
+}
+
+/* Pop a tile from the back of deque `q`; return -1 if it is empty */
+int deque_pop_back(tile_deque_t* q) {
+  int t = -1;
+  omp_set_lock(&q->lock);
+  if (q->head < q->tail) t = q->tiles[--q->tail];
+  omp_unset_lock(&q->lock);
+  return t;
+}
+
+/* Get the next tile of thread `me`, stealing it from another thread if
+   necessary; return -1 if there are no tiles left. */
+int next_tile(tile_deque_t* q, int nq, int me, int* nstolen) {
+  int t = deque_pop_front(&q[me]);
+  for (int k = 1; k < nq && t < 0; k++) {
+    t = deque_pop_back(&q[(me + k) % nq]);
+    if (t >= 0) (*nstolen)++;
+  }
+  return t;
+}
+
+/* Render tile `tile`; return the number of primary rays traced */
+long render_tile(int tile, int xsz, int ysz, pixel_t* fb, int samples) {
+  const int ntx = (xsz + tile_size - 1) / tile_size;
+  const int x0 = (tile % ntx) * tile_size;
+  const int y0 = (tile / ntx) * tile_size;
+  const int x1 = (x0 + tile_size < xsz ? x0 + tile_size : xsz);
+  const int y1 = (y0 + tile_size < ysz ? y0 + tile_size : ysz);
+  long nrays = 0;
+
+  for (int j = y0; j < y1; j++) {
+    if (packet_size > 1) {
+      for (int i = x0; i < x1; i += packet_size) {
+        const int n = (x1 - i < packet_size ? x1 - i : packet_size);
+        nrays += render_packet(i, j, n, xsz, fb, samples);
+      }
+    } else {
+      for (int i = x0; i < x1; i++) {
+        nrays += render_pixel(i, j, xsz, fb, samples);
+      }
+    }
+  }
+  return nrays;
+}
+
+/* render a frame of xsz/ysz dimensions into the provided framebuffer;
+   if `out` is not NULL, the rows of the image are written to `out` as
+   soon as they are complete. Return the number of primary rays
+   traced. */
+long render(int xsz, int ysz, pixel_t* fb, int samples, FILE* out) {
+  const int ntx = (xsz + tile_size - 1) / tile_size;
+  const int nbands = (ysz + tile_size - 1) / tile_size;
+  const int ntiles = ntx * nbands;
+  const int nq = omp_get_max_threads();
+  int* band_left = (int*)malloc(nbands * sizeof(*band_left));
+  int* tiles = (int*)malloc(ntiles * sizeof(*tiles));
+  tile_deque_t* q = (tile_deque_t*)malloc(nq * sizeof(*q));
+  int next_band = 0; /* first band not yet written to `out` */
+  int nstolen = 0;
+  long nrays = 0;
+  omp_lock_t out_lock;
+
+  assert(band_left != NULL && tiles != NULL && q != NULL);
+  for (int b = 0; b < nbands; b++) band_left[b] = ntx;
+  /* deal the tiles round-robin; the tiles of deque `k` are stored
+     contiguously in `tiles`, in increasing order */
+  for (int k = 0, pos = 0; k < nq; k++) {
+    omp_init_lock(&q[k].lock);
+    q[k].tiles = tiles + pos;
+    q[k].head = 0;
+    for (int t = k; t < ntiles; t += nq) tiles[pos++] = t;
+    q[k].tail = (int)(tiles + pos - q[k].tiles);
+  }
+  omp_init_lock(&out_lock);
+
+#pragma omp parallel num_threads(nq) default(none) \
+    shared(xsz, ysz, fb, samples, out, ntx, nbands, nq, band_left, q, \
+               next_band, out_lock, tile_size) \
+    reduction(+ : nstolen, nrays)
+  {
+    const int me = omp_get_thread_num();
+    int t;
+
+    while ((t = next_tile(q, nq, me, &nstolen)) >= 0) {
+      const int band = t / ntx;
+      int left;
+
+      nrays += render_tile(t, xsz, ysz, fb, samples);
+#pragma omp atomic capture
+      left = --band_left[band];
+      if (left == 0 && out != NULL) {
+        /* the thread that completes a band writes it, together with
+           the following complete bands, if it is the next one */
+        omp_set_lock(&out_lock);
+        while (next_band < nbands && band_left[next_band] == 0) {
+          const int y0 = next_band * tile_size;
+          const int y1 = (y0 + tile_size < ysz ? y0 + tile_size : ysz);
+#pragma omp flush
+          fwrite(fb + y0 * xsz, sizeof(*fb), (y1 - y0) * xsz, out);
+          fflush(out);
+          next_band++;
+        }
+        omp_unset_lock(&out_lock);
       }
+    }
+  }
 
-      r /= samples;
-      g /= samples;
-      b /= samples;
+  tiles_rendered += ntiles;
+  tiles_stolen += nstolen;
 
-      fb[j * xsz + i].r = (uint8_t)(fmin(r, 1.0) * 255.0);
-      fb[j * xsz + i].g = (uint8_t)(fmin(g, 1.0) * 255.0);
-      fb[j * xsz + i].b = (uint8_t)(fmin(b, 1.0) * 255.0);
+  omp_destroy_lock(&out_lock);
+  for (int k = 0; k < nq; k++) omp_destroy_lock(&q[k].lock);
+  free(q);
+  free(tiles);
+  free(band_left);
+  return nrays;
+}
+
+/* Print the tile statistics of the whole run, summed over all
+   processes; this must be called by all processes. */
+void print_tile_stats(void) {
+  long stats[2] = {tiles_rendered, tiles_stolen};
+#ifdef USE_MPI
+  MPI_Allreduce(MPI_IN_PLACE, stats, 2, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+#endif
+  if (my_rank == 0 && stats[0] > 0) {
+    fprintf(stderr, "%ld tiles of %dx%d pixels, %ld stolen\n", stats[0],
+            tile_size, tile_size, stats[1]);
+  }
+}
+
+/******************************************************************************
+ * MPI driver
+ *
+ * Process 0 (the master) reads the scene and builds the BVH, which
+ * are then broadcast to all processes. The other processes (the
+ * workers) render one band of `tile_size` rows at a time, using all
+ * their OpenMP threads on the tiles of the band. Bands are handed out
+ * on demand by the master: a worker sends the band it has just
+ * completed (-1 at the beginning) and receives the next band to
+ * render, or -1 if there are none left. The master copies each band
+ * into the framebuffer and writes it to the output file as soon as
+ * all the bands above it have been received.
+ ******************************************************************************/
+
+/* Terminate all processes after a fatal error */
+int fatal_exit(void) {
+#ifdef USE_MPI
+  MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+#endif
+  return EXIT_FAILURE;
+}
+
+#ifdef USE_MPI
+
+enum { TAG_DONE = 1, TAG_PIXELS, TAG_WORK };
+
+/* Send the scene and the BVH from process 0 to all other processes.
+   The structures are sent as bytes, so all processes must run on the
+   same architecture. */
+void bcast_scene(void) {
+  MPI_Bcast(&nspheres, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&bvh_nnodes, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (my_rank != 0) {
+    spheres = (sphere_t*)malloc(nspheres * sizeof(*spheres));
+    bvh_nodes = (bvh_node_t*)malloc(bvh_nnodes * sizeof(*bvh_nodes));
+    assert(spheres != NULL && bvh_nodes != NULL);
+  }
+  MPI_Bcast(spheres, nspheres * sizeof(*spheres), MPI_BYTE, 0, MPI_COMM_WORLD);
+  MPI_Bcast(bvh_nodes, bvh_nnodes * sizeof(*bvh_nodes), MPI_BYTE, 0,
+            MPI_COMM_WORLD);
+
+  MPI_Bcast(&lnum, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  MPI_Bcast(lights, lnum * sizeof(*lights), MPI_BYTE, 0, MPI_COMM_WORLD);
+  MPI_Bcast(&cam, sizeof(cam), MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
+/* Render the tiles of band `band` with all OpenMP threads; return the
+   number of primary rays traced */
+long render_band(int band, int xsz, int ysz, pixel_t* fb, int samples) {
+  const int ntx = (xsz + tile_size - 1) / tile_size;
+  long nrays = 0;
+
+#pragma omp parallel for default(none) \
+    shared(band, xsz, ysz, fb, samples, ntx) schedule(dynamic) \
+    reduction(+ : nrays)
+  for (int k = 0; k < ntx; k++) {
+    nrays += render_tile(band * ntx + k, xsz, ysz, fb, samples);
+  }
+  return nrays;
+}
+
+/* Render a frame across all MPI processes; the image is assembled in
+   the framebuffer of process 0, and written to `out` if it is not
+   NULL. Return the number of primary rays traced by all processes
+   (only meaningful on process 0). */
+long render_mpi(int xsz, int ysz, pixel_t* fb, int samples, FILE* out) {
+  const int nbands = (ysz + tile_size - 1) / tile_size;
+  long nrays = 0, total = 0;
+  int band;
+
+  if (comm_sz == 1) return render(xsz, ysz, fb, samples, out);
+
+  if (my_rank == 0) {
+    char* done = (char*)calloc(nbands, 1);
+    int next_band = 0;           /* next band to hand out       */
+    int next_write = 0;          /* first band not yet written  */
+    int nworkers = comm_sz - 1;  /* workers still running       */
+
+    assert(done != NULL);
+    while (nworkers > 0) {
+      MPI_Status status;
+
+      MPI_Recv(&band, 1, MPI_INT, MPI_ANY_SOURCE, TAG_DONE, MPI_COMM_WORLD,
+               &status);
+      if (band >= 0) {
+        const int y0 = band * tile_size;
+        const int y1 = (y0 + tile_size < ysz ? y0 + tile_size : ysz);
+        MPI_Recv(fb + y0 * xsz, (y1 - y0) * xsz * sizeof(*fb), MPI_BYTE,
+                 status.MPI_SOURCE, TAG_PIXELS, MPI_COMM_WORLD,
+                 MPI_STATUS_IGNORE);
+        done[band] = 1;
+        while (out != NULL && next_write < nbands && done[next_write]) {
+          const int w0 = next_write * tile_size;
+          const int w1 = (w0 + tile_size < ysz ? w0 + tile_size : ysz);
+          fwrite(fb + w0 * xsz, sizeof(*fb), (w1 - w0) * xsz, out);
+          fflush(out);
+          next_write++;
+        }
+      }
+      band = (next_band < nbands ? next_band++ : -1);
+      if (band < 0) nworkers--;
+      MPI_Send(&band, 1, MPI_INT, status.MPI_SOURCE, TAG_WORK, MPI_COMM_WORLD);
+    }
+    free(done);
+  } else {
+    band = -1;
+    for (;;) {
+      MPI_Send(&band, 1, MPI_INT, 0, TAG_DONE, MPI_COMM_WORLD);
+      if (band >= 0) {
+        const int y0 = band * tile_size;
+        const int y1 = (y0 + tile_size < ysz ? y0 + tile_size : ysz);
+        MPI_Send(fb + y0 * xsz, (y1 - y0) * xsz * sizeof(*fb), MPI_BYTE, 0,
+                 TAG_PIXELS, MPI_COMM_WORLD);
+      }
+      MPI_Recv(&band, 1, MPI_INT, 0, TAG_WORK, MPI_COMM_WORLD,
+               MPI_STATUS_IGNORE);
+      if (band < 0) break;
+      nrays += render_band(band, xsz, ysz, fb, samples);
     }
   }
+  MPI_Reduce(&nrays, &total, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  return total;
 }
 
-/* Load the scene from an extremely simple scene description file */
-void load_scene(FILE* fp) {
+#endif
+
+/******************************************************************************
+ * Animation
+ *
+ * The camera moves along a path defined by keyframes; the camera of
+ * the frames between two keyframes is interpolated linearly. The
+ * scene and the BVH are loaded once and used for all frames. Each
+ * frame is written to its own PPM file by a writer thread, while the
+ * next frame is rendered into a second framebuffer. With MPI, frame
+ * `f` is rendered by process `f % comm_sz`.
+ ******************************************************************************/
+
+typedef struct {
+  int frame;
+  camera_t cam;
+} keyframe_t;
+
+/* Load the camera path; return the array of keyframes and set `*nkf`
+   to its length. */
+keyframe_t* load_keyframes(FILE* fp, int* nkf) {
   char line[256], *ptr;
+  keyframe_t* kf = NULL;
+  int n = 0, capacity = 0;
+
+  while ((ptr = fgets(line, sizeof(line), fp))) {
+    keyframe_t k;
+    double fov;
+
+    while ((*ptr == ' ') || (*ptr == '\t')) ptr++;
+    if ((*ptr == '#') || (*ptr == '\n') || (*ptr == '\0')) continue;
+
+    const int nread = sscanf(ptr, "%d %lf %lf %lf %lf %lf %lf %lf", &k.frame,
+                             &k.cam.pos.x, &k.cam.pos.y, &k.cam.pos.z, &fov,
+                             &k.cam.targ.x, &k.cam.targ.y, &k.cam.targ.z);
+    if (nread != 8 || k.frame < 0 || (n > 0 && k.frame <= kf[n - 1].frame)) {
+      fprintf(stderr, "FATAL: invalid keyframe \"%s\"\n", strtok(ptr, "\n"));
+      exit(fatal_exit());
+    }
+    k.cam.half_fov_rad = fov * DEG_TO_RAD * 0.5;
+    if (n == capacity) {
+      capacity = (capacity == 0 ? 16 : 2 * capacity);
+      kf = (keyframe_t*)realloc(kf, capacity * sizeof(*kf));
+      assert(kf != NULL);
+    }
+    kf[n++] = k;
+  }
+  if (n == 0) {
+    fprintf(stderr, "FATAL: the camera path is empty\n");
+    exit(fatal_exit());
+  }
+  *nkf = n;
+  return kf;
+}
+
+#ifdef USE_MPI
+/* Send the camera path from process 0 to all other processes */
+keyframe_t* bcast_keyframes(keyframe_t* kf, int* nkf) {
+  MPI_Bcast(nkf, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (my_rank != 0) {
+    kf = (keyframe_t*)malloc(*nkf * sizeof(*kf));
+    assert(kf != NULL);
+  }
+  MPI_Bcast(kf, *nkf * sizeof(*kf), MPI_BYTE, 0, MPI_COMM_WORLD);
+  return kf;
+}
+#endif
+
+vec3_t lerp(vec3_t a, vec3_t b, double t) {
+  vec3_t v;
+  v.x = a.x + (b.x - a.x) * t;
+  v.y = a.y + (b.y - a.y) * t;
+  v.z = a.z + (b.z - a.z) * t;
+  return v;
+}
+
+/* Return the camera of frame `frame` */
+camera_t camera_at(const keyframe_t* kf, int nkf, int frame) {
+  int k = 0;
+
+  if (frame <= kf[0].frame) return kf[0].cam;
+  while (k + 1 < nkf && kf[k + 1].frame <= frame) k++;
+  if (k + 1 == nkf) return kf[k].cam;
+
+  const double t =
+      (double)(frame - kf[k].frame) / (kf[k + 1].frame - kf[k].frame);
+  camera_t c = kf[k].cam;
+  c.pos = lerp(kf[k].cam.pos, kf[k + 1].cam.pos, t);
+  c.targ = lerp(kf[k].cam.targ, kf[k + 1].cam.targ, t);
+  c.half_fov_rad = kf[k].cam.half_fov_rad +
+                   (kf[k + 1].cam.half_fov_rad - kf[k].cam.half_fov_rad) * t;
+  return c;
+}
+
+/* The writer thread waits for a frame to be submitted, writes it and
+   waits for the next one. There is a single slot: submitting a frame
+   blocks until the previous one has been written, so that the caller
+   can then render into the framebuffer of the previous frame. */
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  const char* pattern; /* printf pattern of the file names */
+  int xsz, ysz;
+  const pixel_t* fb; /* frame being written */
+  int frame;
+  int busy; /* nonzero if a frame is pending or being written */
+  int quit;
+} frame_writer_t;
+
+void write_frame(const char* pattern, int frame, int xsz, int ysz,
+                 const pixel_t* fb) {
+  char fname[1024];
+  int fd;
+
+  snprintf(fname, sizeof(fname), pattern, frame);
+  if ((fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    fprintf(stderr, "FATAL: failed to open output file %s: %s\n", fname,
+            strerror(errno));
+    exit(fatal_exit());
+  }
+  if (pnm_write_fd(fd, 6, xsz, ysz, 255, NULL,
+                   (const unsigned char*)fb) != 0) {
+    exit(fatal_exit());
+  }
+  close(fd);
+}
+
+void* writer_thread(void* arg) {
+  frame_writer_t* w = (frame_writer_t*)arg;
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (!w->busy && !w->quit) pthread_cond_wait(&w->cond, &w->lock);
+    if (!w->busy) break;
+    pthread_mutex_unlock(&w->lock);
+    write_frame(w->pattern, w->frame, w->xsz, w->ysz, w->fb);
+    pthread_mutex_lock(&w->lock);
+    w->busy = 0;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+void writer_start(frame_writer_t* w, const char* pattern, int xsz, int ysz) {
+  w->pattern = pattern;
+  w->xsz = xsz;
+  w->ysz = ysz;
+  w->fb = NULL;
+  w->busy = w->quit = 0;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  pthread_create(&w->thread, NULL, writer_thread, w);
+}
+
+void writer_submit(frame_writer_t* w, const pixel_t* fb, int frame) {
+  pthread_mutex_lock(&w->lock);
+  while (w->busy) pthread_cond_wait(&w->cond, &w->lock);
+  w->fb = fb;
+  w->frame = frame;
+  w->busy = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* Wait until the last frame has been written and stop the writer */
+void writer_stop(frame_writer_t* w) {
+  pthread_mutex_lock(&w->lock);
+  while (w->busy) pthread_cond_wait(&w->cond, &w->lock);
+  w->quit = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+}
 
-  obj_list = NULL;
+/* Return nonzero if `pattern` contains exactly one conversion, which
+   is an integer conversion such as "%d" or "%04d" */
+int valid_pattern(const char* pattern) {
+  int nconv = 0;
+
+  for (const char* p = pattern; *p != '\0'; p++) {
+    if (*p != '%') continue;
+    if (*(p + 1) == '%') {
+      p++;
+      continue;
+    }
+    p++;
+    while (*p == '0' || *p == '-' || *p == ' ' || *p == '+') p++;
+    while (isdigit(*p)) p++;
+    if (*p != 'd') return 0;
+    nconv++;
+  }
+  return nconv == 1;
+}
+
+/* Render the frames of the camera path, and write frame `f` to the
+   file whose name is `pattern` formatted with `f`. Return the number
+   of primary rays traced by this process. */
+long render_animation(const keyframe_t* kf, int nkf, int xsz, int ysz,
+                      int samples, const char* pattern) {
+  const int nframes = kf[nkf - 1].frame + 1;
+  pixel_t* fb[2];
+  frame_writer_t writer;
+  long nrays = 0;
+  int cur = 0;
+
+  fb[0] = (pixel_t*)malloc(xsz * ysz * sizeof(*fb[0]));
+  fb[1] = (pixel_t*)malloc(xsz * ysz * sizeof(*fb[1]));
+  assert(fb[0] != NULL && fb[1] != NULL);
+
+  writer_start(&writer, pattern, xsz, ysz);
+  for (int f = my_rank; f < nframes; f += comm_sz) {
+    const double tstart = omp_get_wtime();
+
+    cam = camera_at(kf, nkf, f);
+    update_camera();
+    nrays += render(xsz, ysz, fb[cur], samples, NULL);
+    /* the frame is written while the next one is rendered into the
+       other framebuffer */
+    writer_submit(&writer, fb[cur], f);
+    cur = 1 - cur;
+    fprintf(stderr, "Frame %d rendered in %f seconds\n", f,
+            omp_get_wtime() - tstart);
+  }
+  writer_stop(&writer);
+
+  free(fb[0]);
+  free(fb[1]);
+  return nrays;
+}
+
+/******************************************************************************
+ * Scene loading
+ *
+ * The scene file is read into memory at once, and parsed in place
+ * into a contiguous array of spheres. Numbers are parsed with the
+ * "fast path" of W. D. Clinger (_How to read floating point numbers
+ * accurately_, PLDI 1990): a decimal with at most 15 significant
+ * digits and a power of ten in [-22, 22] is the result of a single
+ * exact multiplication or division, which is correctly rounded, so
+ * the result is the same of strtod(); other numbers are parsed by
+ * strtod().
+ *
+ * With -c, the spheres, the BVH, the lights and the camera are saved
+ * into a binary cache file, together with the FNV-1a hash of the
+ * scene file. If the cache file exists and was created from a scene
+ * file with the same hash, the scene is read from there instead, and
+ * the parsing and the BVH construction are skipped.
+ ******************************************************************************/
+
+/* bump when the layout of the cache file or the BVH changes */
+#define SCENE_CACHE_VERSION 1
+
+typedef struct {
+  char magic[8]; /* "C-RAY" followed by zeros */
+  uint32_t version;
+  uint32_t sphere_size, node_size, camera_size;
+  uint64_t hash; /* FNV-1a hash of the scene file */
+  int32_t nspheres, nnodes, nlights;
+  int32_t pad;
+} scene_cache_header_t;
+
+/* Read the whole content of `fp` into a NUL-terminated buffer */
+char* read_file(FILE* fp, size_t* len) {
+  size_t capacity = 1 << 20, n = 0, nread;
+  char* buf = (char*)malloc(capacity + 1);
+
+  assert(buf != NULL);
+  while ((nread = fread(buf + n, 1, capacity - n, fp)) > 0) {
+    n += nread;
+    if (n == capacity) {
+      capacity *= 2;
+      buf = (char*)realloc(buf, capacity + 1);
+      assert(buf != NULL);
+    }
+  }
+  buf[n] = '\0';
+  *len = n;
+  return buf;
+}
+
+uint64_t fnv1a(const char* buf, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)buf[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* Parse a number starting at `*p`, after optional blanks; on success,
+   store it in `*v`, advance `*p` past it and return 1 */
+int parse_number(const char** p, double* v) {
+  static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                 1e18, 1e19, 1e20, 1e21, 1e22};
+  const char* s = *p;
+  const char* q;
+  uint64_t m = 0;
+  int exp10 = 0, ndigits = 0, nsig = 0, neg = 0;
+
+  while (*s == ' ' || *s == '\t') s++;
+  q = s;
+  if (*q == '-' || *q == '+') neg = (*q++ == '-');
+  for (; isdigit((unsigned char)*q); q++, ndigits++) {
+    if (m > 0 || *q != '0') nsig++;
+    if (nsig <= 15) m = m * 10 + (*q - '0');
+    else exp10++;
+  }
+  if (*q == '.') {
+    for (q++; isdigit((unsigned char)*q); q++, ndigits++) {
+      if (m > 0 || *q != '0') nsig++;
+      if (nsig <= 15) {
+        m = m * 10 + (*q - '0');
+        exp10--;
+      }
+    }
+  }
+  if (ndigits > 0 && (*q == 'e' || *q == 'E')) {
+    const char* e = q + 1;
+    int eneg = 0, ev = 0, edigits = 0;
+    if (*e == '-' || *e == '+') eneg = (*e++ == '-');
+    for (; isdigit((unsigned char)*e) && edigits < 4; e++, edigits++) {
+      ev = ev * 10 + (*e - '0');
+    }
+    if (edigits > 0 && !isdigit((unsigned char)*e)) {
+      exp10 += (eneg ? -ev : ev);
+      q = e;
+    } else {
+      nsig = 16; /* let strtod() deal with it */
+    }
+  }
+
+  if (ndigits > 0 && nsig <= 15 && exp10 >= -22 && exp10 <= 22) {
+    const double x = (double)m;
+    *v = (exp10 < 0 ? x / pow10[-exp10] : x * pow10[exp10]);
+    if (neg) *v = -*v;
+    *p = q;
+    return 1;
+  } else {
+    char* end;
+    *v = strtod(s, &end);
+    if (end == s) return 0;
+    *p = end;
+    return 1;
+  }
+}
+
+/* Parse `n` numbers of line `lineno` of the scene file */
+void parse_numbers(const char** p, double** v, int n, int lineno) {
+  for (int k = 0; k < n; k++) {
+    if (!parse_number(p, v[k])) {
+      fprintf(stderr, "FATAL: line %d of the scene: expected %d numbers\n",
+              lineno, n);
+      exit(fatal_exit());
+    }
+  }
+}
+
+/* Parse the scene file in `buf`; return the array of spheres, in the
+   order in which they are numbered, and set `*n` to its length. */
+sphere_t* parse_scene(const char* buf, int* n) {
+  sphere_t* objs = NULL;
+  int nobjs = 0, capacity = 0, lineno = 0;
+  const char* ptr = buf;
 
   /* Default camera */
   cam.pos.x = cam.pos.y = cam.pos.z = 10.0;
   cam.half_fov_rad = 45 * DEG_TO_RAD * 0.5;
   cam.targ.x = cam.targ.y = cam.targ.z = 0.0;
+  lnum = 0;
 
-  while ((ptr = fgets(line, sizeof(line), fp))) {
-    int nread;
-    sphere_t* sph;
+  for (; *ptr != '\0'; ptr += (*ptr != '\0')) {
     char type;
     double fov;
 
-    while ((*ptr == ' ') || (*ptr == '\t')) /* checking '\0' is implied */
-      ptr++;
-    if ((*ptr == '#') || (*ptr == '\n') || (*ptr == '\0')) continue;
-
-    type = *ptr;
-    ptr++;
+    lineno++;
+    while ((*ptr == ' ') || (*ptr == '\t')) ptr++;
+    if (*ptr == '#' || *ptr == '\n' || *ptr == '\r' || *ptr == '\0') {
+      while (*ptr != '\n' && *ptr != '\0') ptr++;
+      continue;
+    }
 
+    type = *ptr++;
     switch (type) {
-      case 's': /* sphere */
-        sph = (sphere_t*)malloc(sizeof *sph);
-        assert(sph != NULL);
-        sph->next = obj_list;
-        obj_list = sph;
-
-        nread = sscanf(
-            ptr,
-            "%lf %lf %lf %lf %lf %lf %lf %lf %lf",
-            &(sph->pos.x),
-            &(sph->pos.y),
-            &(sph->pos.z),
-            &(sph->rad),
-            &(sph->mat.col.x),
-            &(sph->mat.col.y),
-            &(sph->mat.col.z),
-            &(sph->mat.spow),
-            &(sph->mat.refl)
-        );
-        assert(9 == nread);
+      case 's': { /* sphere */
+        if (nobjs == capacity) {
+          capacity = (capacity == 0 ? 1024 : 2 * capacity);
+          objs = (sphere_t*)realloc(objs, capacity * sizeof(*objs));
+          assert(objs != NULL);
+        }
+        sphere_t* sph = &objs[nobjs++];
+        double* v[] = {&sph->pos.x,     &sph->pos.y,     &sph->pos.z,
+                       &sph->rad,       &sph->mat.col.x, &sph->mat.col.y,
+                       &sph->mat.col.z, &sph->mat.spow,  &sph->mat.refl};
+        parse_numbers(&ptr, v, 9, lineno);
         break;
-      case 'l': /* light */
+      }
+      case 'l': { /* light */
         if (lnum >= MAX_LIGHTS) {
           fprintf(stderr, "FATAL: too many lights\n");
-          exit(-1);
+          exit(fatal_exit());
         }
-        nread = sscanf(
-            ptr,
-            "%lf %lf %lf",
-            &(lights[lnum].x),
-            &(lights[lnum].y),
-            &(lights[lnum].z)
-        );
-        assert(3 == nread);
+        double* v[] = {&lights[lnum].x, &lights[lnum].y, &lights[lnum].z};
+        parse_numbers(&ptr, v, 3, lineno);
         lnum++;
         break;
-      case 'c': /* camera */
-        nread = sscanf(
-            ptr,
-            "%lf %lf %lf %lf %lf %lf %lf",
-            &cam.pos.x,
-            &cam.pos.y,
-            &cam.pos.z,
-            &fov,
-            &cam.targ.x,
-            &cam.targ.y,
-            &cam.targ.z
-        );
-        assert(7 == nread);
+      }
+      case 'c': { /* camera */
+        double* v[] = {&cam.pos.x,  &cam.pos.y,  &cam.pos.z, &fov,
+                       &cam.targ.x, &cam.targ.y, &cam.targ.z};
+        parse_numbers(&ptr, v, 7, lineno);
         cam.half_fov_rad = fov * DEG_TO_RAD * 0.5;
         break;
+      }
       default:
-        fprintf(stderr, "unknown type: %c\n", type);
-        abort();
+        fprintf(stderr, "FATAL: line %d of the scene: unknown type: %c\n",
+                lineno, type);
+        exit(fatal_exit());
     }
+    /* ignore the rest of the line */
+    while (*ptr != '\n' && *ptr != '\0') ptr++;
+  }
+
+  /* The original loader prepended each sphere to a linked list; the
+     spheres are numbered in the same order (last sphere first), so
+     that ties between hits are broken in the same way. */
+  for (int i = 0, j = nobjs - 1; i < j; i++, j--) {
+    const sphere_t tmp = objs[i];
+    objs[i] = objs[j];
+    objs[j] = tmp;
   }
+  *n = nobjs;
+  return objs;
 }
 
-/* Relinquish all memory used by the linked list of spheres */
-void free_scene(void) {
-  while (obj_list != NULL) {
-    sphere_t* next = obj_list->next;
-    free(obj_list);
-    obj_list = next;
+/* Read the scene from cache file `fname`; return 1 on success, 0 if
+   the file does not exist or does not match the scene with hash
+   `hash` (or this build of the program) */
+int load_scene_cache(const char* fname, uint64_t hash) {
+  FILE* f = fopen(fname, "rb");
+  scene_cache_header_t h;
+  int ok = 0;
+
+  if (f == NULL) return 0;
+  if (fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, "C-RAY", 6) == 0 &&
+      h.version == SCENE_CACHE_VERSION && h.sphere_size == sizeof(sphere_t) &&
+      h.node_size == sizeof(bvh_node_t) && h.camera_size == sizeof(camera_t) &&
+      h.hash == hash && h.nspheres >= 0 && h.nnodes > 0 && h.nlights >= 0 &&
+      h.nlights <= MAX_LIGHTS) {
+    spheres = (sphere_t*)malloc(h.nspheres * sizeof(*spheres));
+    bvh_nodes = (bvh_node_t*)malloc(h.nnodes * sizeof(*bvh_nodes));
+    assert(spheres != NULL && bvh_nodes != NULL);
+    ok = fread(&cam, sizeof(cam), 1, f) == 1 &&
+         fread(lights, sizeof(*lights), h.nlights, f) == (size_t)h.nlights &&
+         fread(spheres, sizeof(*spheres), h.nspheres, f) ==
+             (size_t)h.nspheres &&
+         fread(bvh_nodes, sizeof(*bvh_nodes), h.nnodes, f) ==
+             (size_t)h.nnodes;
+    if (ok) {
+      nspheres = h.nspheres;
+      bvh_nnodes = h.nnodes;
+      lnum = h.nlights;
+    } else {
+      free(spheres);
+      free(bvh_nodes);
+      spheres = NULL;
+      bvh_nodes = NULL;
+    }
+  }
+  fclose(f);
+  return ok;
+}
+
+/* Save the scene into cache file `fname`. The file is written under a
+   temporary name and then renamed, so that a concurrent reader never
+   sees a partial file. */
+void save_scene_cache(const char* fname, uint64_t hash) {
+  char tmpname[1024];
+  scene_cache_header_t h;
+  FILE* f;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "C-RAY", 6);
+  h.version = SCENE_CACHE_VERSION;
+  h.sphere_size = sizeof(sphere_t);
+  h.node_size = sizeof(bvh_node_t);
+  h.camera_size = sizeof(camera_t);
+  h.hash = hash;
+  h.nspheres = nspheres;
+  h.nnodes = bvh_nnodes;
+  h.nlights = lnum;
+
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+  if ((f = fopen(tmpname, "wb")) == NULL ||
+      fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(&cam, sizeof(cam), 1, f) != 1 ||
+      fwrite(lights, sizeof(*lights), lnum, f) != (size_t)lnum ||
+      fwrite(spheres, sizeof(*spheres), nspheres, f) != (size_t)nspheres ||
+      fwrite(bvh_nodes, sizeof(*bvh_nodes), bvh_nnodes, f) !=
+          (size_t)bvh_nnodes ||
+      fclose(f) != 0 || rename(tmpname, fname) != 0) {
+    fprintf(stderr, "WARNING: can not write the scene cache %s: %s\n", fname,
+            strerror(errno));
+    remove(tmpname);
   }
 }
 
+/* Load the scene from an extremely simple scene description file, and
+   build its BVH; if `cache_name` is not NULL, use or update that scene
+   cache file */
+void load_scene(FILE* fp, const char* cache_name) {
+  double tstart = omp_get_wtime();
+  size_t len;
+  char* text = read_file(fp, &len);
+  const uint64_t hash = fnv1a(text, len);
+
+  if (cache_name != NULL && load_scene_cache(cache_name, hash)) {
+    fprintf(stderr, "Scene of %d spheres read from cache %s in %f seconds\n",
+            nspheres, cache_name, omp_get_wtime() - tstart);
+  } else {
+    int nobjs;
+    sphere_t* objs = parse_scene(text, &nobjs);
+    fprintf(stderr, "Scene of %d spheres (%zu bytes) parsed in %f seconds\n",
+            nobjs, len, omp_get_wtime() - tstart);
+
+    tstart = omp_get_wtime();
+    bvh_build(objs, nobjs);
+    fprintf(stderr, "BVH of %d spheres (%d nodes) built in %f seconds\n",
+            nspheres, bvh_nnodes, omp_get_wtime() - tstart);
+    free(objs);
+    if (cache_name != NULL) save_scene_cache(cache_name, hash);
+  }
+  free(text);
+}
+
+/* Relinquish all memory used by the spheres and by the BVH */
+void free_scene(void) {
+  packet_free_spheres();
+  float_free_scene();
+  free(spheres);
+  free(bvh_nodes);
+  spheres = NULL;
+  bvh_nodes = NULL;
+}
+
 int main(int argc, char* argv[]) {
   double tstart, elapsed;
+  long nrays;
   pixel_t* pixels; /* framebuffer (where the image is drawn) */
   int rays_per_pixel = 1;
-  FILE *infile = stdin, *outfile = stdout;
+  FILE *infile = stdin, *outfile = stdout, *keyfile = NULL;
+  const char *outname = NULL, *keyname = NULL, *refname = NULL;
+  const char* cachename = NULL;
+  keyframe_t* keyframes = NULL;
+  int nkeyframes = 0;
   int opt;
   char* sep = NULL;
 
-  while ((opt = getopt(argc, argv, "s:i:o:r:h")) != -1) {
+#ifdef USE_MPI
+  MPI_Init(&argc, &argv);
+  MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &comm_sz);
+#endif
+
+  while ((opt = getopt(argc, argv, "s:i:o:r:p:a:m:k:fd:c:t:h")) != -1) {
     switch (opt) {
       case 's':
         if (!isdigit(optarg[0]) || !(sep = strchr(optarg, 'x')) ||
@@ -615,7 +2721,7 @@ int main(int argc, char* argv[]) {
               stderr,
               "FATAL: -s must be followed by something like \"640x480\"\n"
           );
-          return EXIT_FAILURE;
+          return fatal_exit();
         }
         xres = atoi(optarg);
         assert(xres > 0);
@@ -624,77 +2730,203 @@ int main(int argc, char* argv[]) {
         break;
 
       case 'i':
-        if ((infile = fopen(optarg, "r")) == NULL) {
+        if (my_rank == 0 && (infile = fopen(optarg, "r")) == NULL) {
           fprintf(
               stderr,
               "FATAL: failed to open input file %s: %s\n",
               optarg,
               strerror(errno)
           );
-          return EXIT_FAILURE;
+          return fatal_exit();
         }
         break;
 
       case 'o':
-        if ((outfile = fopen(optarg, "w")) == NULL) {
-          fprintf(
-              stderr,
-              "FATAL: failed to open output file %s: %s\n",
-              optarg,
-              strerror(errno)
-          );
-          return EXIT_FAILURE;
-        }
+        outname = optarg;
+        break;
+
+      case 'k':
+        keyname = optarg;
         break;
 
       case 'r':
         rays_per_pixel = atoi(optarg);
-        if (rays_per_pixel < 0 || rays_per_pixel > NRAN) {
-          fprintf(stderr, "FATAL: the number of rays must be in 0-%d\n", NRAN);
-          return EXIT_FAILURE;
+        if (rays_per_pixel < 0) {
+          fprintf(stderr, "FATAL: the number of rays must be non-negative\n");
+          return fatal_exit();
+        }
+        break;
+
+      case 'p':
+        packet_size = atoi(optarg);
+        if (packet_size != 1 && packet_size != 4 && packet_size != 8 &&
+            packet_size != 16) {
+          fprintf(stderr, "FATAL: the packet size must be 1, 4, 8 or 16\n");
+          return fatal_exit();
+        }
+        break;
+
+      case 'a':
+        adapt_threshold = atof(optarg);
+        if (adapt_threshold < 0.0) {
+          fprintf(stderr, "FATAL: the error threshold must be non-negative\n");
+          return fatal_exit();
+        }
+        break;
+
+      case 'm':
+        min_samples = atoi(optarg);
+        if (min_samples < 2) {
+          fprintf(stderr, "FATAL: -m must be at least 2\n");
+          return fatal_exit();
+        }
+        break;
+
+      case 'f':
+        use_float = 1;
+        break;
+
+      case 'd':
+        refname = optarg;
+        break;
+
+      case 'c':
+        cachename = optarg;
+        break;
+
+      case 't':
+        tile_size = atoi(optarg);
+        if (tile_size < 1) {
+          fprintf(stderr, "FATAL: the tile size must be positive\n");
+          return fatal_exit();
         }
         break;
 
       case 'h':
-        fputs(usage, stdout);
+        if (my_rank == 0) fputs(usage, stdout);
+#ifdef USE_MPI
+        MPI_Finalize();
+#endif
         return EXIT_SUCCESS;
 
       default:
         fputs(usage, stderr);
-        return EXIT_FAILURE;
+        return fatal_exit();
+    }
+  }
+
+  if (use_float && packet_size > 1) {
+    fprintf(stderr, "FATAL: -f can not be used with -p\n");
+    return fatal_exit();
+  }
+  if (keyname != NULL) {
+    if (outname == NULL) outname = "frame%04d.ppm";
+    if (!valid_pattern(outname)) {
+      fprintf(stderr,
+              "FATAL: -o must be a pattern such as \"frame%%04d.ppm\"\n");
+      return fatal_exit();
     }
+    if (my_rank == 0 && (keyfile = fopen(keyname, "r")) == NULL) {
+      fprintf(
+          stderr,
+          "FATAL: failed to open camera path file %s: %s\n",
+          keyname,
+          strerror(errno)
+      );
+      return fatal_exit();
+    }
+  } else if (outname != NULL && my_rank == 0 &&
+             (outfile = fopen(outname, "w")) == NULL) {
+    fprintf(
+        stderr,
+        "FATAL: failed to open output file %s: %s\n",
+        outname,
+        strerror(errno)
+    );
+    return fatal_exit();
   }
 
   aspect = (double)xres / (double)yres;
 
+  if (my_rank == 0) {
+    load_scene(infile, cachename);
+    if (keyname != NULL) keyframes = load_keyframes(keyfile, &nkeyframes);
+  }
+#ifdef USE_MPI
+  bcast_scene();
+  if (keyname != NULL) keyframes = bcast_keyframes(keyframes, &nkeyframes);
+#endif
+  if (packet_size > 1) packet_init_spheres();
+  if (use_float) float_init_scene();
+
+  if (keyname != NULL) {
+    const int nframes = keyframes[nkeyframes - 1].frame + 1;
+    long total = 0;
+
+    tstart = omp_get_wtime();
+    nrays = render_animation(keyframes, nkeyframes, xres, yres,
+                             rays_per_pixel, outname);
+#ifdef USE_MPI
+    MPI_Reduce(&nrays, &total, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+#else
+    total = nrays;
+#endif
+    elapsed = omp_get_wtime() - tstart;
+    print_tile_stats();
+    if (my_rank == 0) {
+      fprintf(stderr, "%d frames rendered in %f seconds (%f frames/s)\n",
+              nframes, elapsed, nframes / elapsed);
+      fprintf(stderr, "%ld primary rays traced (%.2f per pixel)\n", total,
+              (double)total / ((double)xres * yres * nframes));
+    }
+    free(keyframes);
+    free_scene();
+    if (infile != stdin) fclose(infile);
+    if (keyfile != NULL) fclose(keyfile);
+#ifdef USE_MPI
+    MPI_Finalize();
+#endif
+    return EXIT_SUCCESS;
+  }
+
+  update_camera();
   if ((pixels = (pixel_t*)malloc(xres * yres * sizeof(*pixels))) == NULL) {
     fprintf(stderr, "FATAL: pixel buffer allocation failed");
-    return EXIT_FAILURE;
+    return fatal_exit();
   }
-  load_scene(infile);
 
-  /* initialize the random number tables for the jitter */
-  for (int i = 0; i < NRAN; i++) urand[i].x = (double)rand() / RAND_MAX - 0.5;
-  for (int i = 0; i < NRAN; i++) urand[i].y = (double)rand() / RAND_MAX - 0.5;
-  for (int i = 0; i < NRAN; i++)
-    irand[i] = (int)(NRAN * ((double)rand() / RAND_MAX));
+  /* the header is written first, and the rows of the image are
+     written by render() as soon as they are complete */
+  if (my_rank == 0) {
+    fprintf(outfile, "P6\n%d %d\n255\n", xres, yres);
+    fflush(outfile);
+  }
 
   tstart = omp_get_wtime();
-  render(xres, yres, pixels, rays_per_pixel);
+#ifdef USE_MPI
+  nrays = render_mpi(xres, yres, pixels, rays_per_pixel,
+                     my_rank == 0 ? outfile : NULL);
+#else
+  nrays = render(xres, yres, pixels, rays_per_pixel, outfile);
+#endif
   elapsed = omp_get_wtime() - tstart;
 
   /* output statistics to stderr */
-  fprintf(stderr, "Rendering took %f seconds\n", elapsed);
-
-  /* output the image */
-  fprintf(outfile, "P6\n%d %d\n255\n", xres, yres);
-  fwrite(pixels, sizeof(*pixels), xres * yres, outfile);
-  fflush(outfile);
+  print_tile_stats();
+  if (my_rank == 0) {
+    fprintf(stderr, "Rendering took %f seconds\n", elapsed);
+    fprintf(stderr, "%ld primary rays traced (%.2f per pixel)\n", nrays,
+            (double)nrays / ((double)xres * yres));
+    if (refname != NULL) compare_image(refname, pixels, xres, yres);
+  }
 
   free(pixels);
   free_scene();
 
   if (infile != stdin) fclose(infile);
   if (outfile != stdout) fclose(outfile);
+#ifdef USE_MPI
+  MPI_Finalize();
+#endif
   return EXIT_SUCCESS;
 }
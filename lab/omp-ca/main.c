@@ -0,0 +1,619 @@
+/****************************************************************************
+ *
+ * omp-ca.c - Binary cellular automata with bit-sliced kernels
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/***
+% Binary cellular automata with bit-sliced kernels
+
+The labs [mpi-rule30](../mpi-rule30/main.c),
+[cuda-rule30](../cuda-rule30/main.cu) and
+[cuda-anneal](../cuda-anneal/main.cu) implement specific cellular
+automata (CA), storing one cell per byte. This program runs any
+elementary 1D CA (the 256 rules of which Rule 30 is one) and any 2D
+outer-totalistic CA on the Moore neighborhood (e.g., the Game of Life
+"B3/S23", or ANNEAL "B4678/S35678") using the kernels of
+[ca.h](../../include/ca.h).
+
+The kernels store 64 cells per 64-bit word, and update a whole word
+with bitwise operations. A 1D rule is a table of 8 bits, indexed by
+the configuration $lcr$ of the left, center and right cells; the
+table is evaluated as a tree of multiplexers, where each input selects
+between two words. A 2D rule depends on the number of live neighbors,
+which is computed for 64 cells at once by a network of bitwise full
+adders that produce the four bits of the count in four separate words.
+Since the rule is known at compile time for the 256 elementary rules,
+the Game of Life and ANNEAL, `ca.h` contains a kernel specialized for
+each of them, where the compiler has removed the operations that do not
+affect the result. The updates are parallelized with OpenMP.
+
+The domain is cyclic, and its width must be a multiple of 64. A 1D
+CA starts with a single live cell in the middle, and the output image
+shows its evolution (one row per step, as in `mpi-rule30`). A 2D CA
+starts from a random configuration where each cell is alive with
+probability 0.5, and the output image is the final state.
+
+With the `-b` option, the program benchmarks the kernels: it runs all
+256 elementary rules, the Game of Life, ANNEAL and HighLife
+("B36/S23") with a simple byte-per-cell implementation, with the
+generic bit-sliced kernel (that evaluates the rule passed as a
+parameter), and with the specialized ones. Each implementation is
+repeated from the same initial state after a warm-up step, and the
+fastest run is reported. The program checks that they all produce the
+same result and prints the throughput in cells per second; HighLife
+has no specialized kernel, so its last column is empty.
+
+To compile:
+
+        gcc -std=c99 -Wall -Wpedantic -O2 -fopenmp -I../../include omp-ca.c -o omp-ca
+
+To execute:
+
+        ./omp-ca [-s nsteps] [-o outfile] rule [width [height]]
+        ./omp-ca -b [width [height]]
+
+where `rule` is either the number of an elementary rule (0--255), or
+a 2D rule in the form "B.../S...", or "life", or "anneal".
+
+Example:
+
+        ./omp-ca -s 512 -o rule110.pbm 110 1024
+        ./omp-ca -s 100 -o life.pbm B3/S23 1024 1024
+
+## Files
+
+- [omp-ca.c](omp-ca.c)
+- [ca.h](../../include/ca.h)
+
+***/
+#if _XOPEN_SOURCE < 600
+#define _XOPEN_SOURCE 600
+#endif
+#include <assert.h>
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> /* for getopt() */
+
+#include "ca.h"
+
+/* HighLife: a 2D rule without a specialized kernel */
+#define HIGHLIFE_BORN 0x048u   /* B36 */
+#define HIGHLIFE_SURVIVE 0x00cu /* S23 */
+
+/**
+ * Reference implementation of the elementary rule `rule`, one byte per
+ * cell, on a cyclic domain of `n` cells.
+ */
+void ref1d_step(unsigned rule, const uint8_t* cur, uint8_t* next, int n) {
+#pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    const int l = cur[(i - 1 + n) % n];
+    const int r = cur[(i + 1) % n];
+    next[i] = (rule >> (4 * l + 2 * cur[i] + r)) & 1;
+  }
+}
+
+/**
+ * Reference implementation of the 2D rule (`born`, `survive`), one
+ * byte per cell, on a cyclic domain of `w` x `h` cells.
+ */
+void ref2d_step(
+    unsigned born,
+    unsigned survive,
+    const uint8_t* cur,
+    uint8_t* next,
+    int w,
+    int h
+) {
+#pragma omp parallel for
+  for (int i = 0; i < h; i++) {
+    for (int j = 0; j < w; j++) {
+      int count = 0;
+      for (int di = -1; di <= 1; di++) {
+        for (int dj = -1; dj <= 1; dj++) {
+          if (di != 0 || dj != 0) {
+            count += cur[((i + di + h) % h) * w + (j + dj + w) % w];
+          }
+        }
+      }
+      const unsigned mask = (cur[i * w + j] ? survive : born);
+      next[i * w + j] = (mask >> count) & 1;
+    }
+  }
+}
+
+/* Pack `nw * CA_WORD_BITS` cells into `nw` words */
+void pack(const uint8_t* cells, ca_word_t* words, int nw) {
+  for (int i = 0; i < nw; i++) {
+    ca_word_t w = 0;
+    for (int b = 0; b < CA_WORD_BITS; b++) {
+      w = (w << 1) | cells[i * CA_WORD_BITS + b];
+    }
+    words[i] = w;
+  }
+}
+
+/* Fill the ghost words of a 1D domain of `nw` words */
+void wrap1d(ca_word_t* cur, int nw) {
+  cur[0] = cur[nw];
+  cur[nw + 1] = cur[1];
+}
+
+/* Write the P4 header of an image of size `width` x `height` */
+void write_header(FILE* out, int width, int height) {
+  fprintf(out, "P4\n# produced by omp-ca\n%d %d\n", width, height);
+}
+
+/**
+ * Evolve the elementary CA `rule` of `width` cells for `nsteps` steps,
+ * starting from a single live cell, and write the history to `out`.
+ */
+void run_1d(unsigned rule, int width, int nsteps, FILE* out) {
+  const int nw = width / CA_WORD_BITS;
+  ca_word_t* cur = (ca_word_t*)calloc(nw + 2, sizeof(*cur));
+  assert(cur != NULL);
+  ca_word_t* next = (ca_word_t*)calloc(nw + 2, sizeof(*next));
+  assert(next != NULL);
+  unsigned char* row = (unsigned char*)malloc(width / 8);
+  assert(row != NULL);
+  const ca1d_kernel_t kernel = ca1d_kernel(rule);
+  double elapsed = 0.0;
+
+  cur[1 + (width / 2) / CA_WORD_BITS] =
+      (ca_word_t)1 << (CA_WORD_BITS - 1 - (width / 2) % CA_WORD_BITS);
+  write_header(out, width, nsteps);
+  for (int s = 0; s < nsteps; s++) {
+    ca_store_row(cur + 1, nw, row);
+    fwrite(row, 1, width / 8, out);
+    const double tstart = omp_get_wtime();
+    wrap1d(cur, nw);
+    kernel(rule, cur, next, 1, nw);
+    elapsed += omp_get_wtime() - tstart;
+    ca_word_t* tmp = cur;
+    cur = next;
+    next = tmp;
+  }
+  printf("Rule %u: %d cells, %d steps, %f s", rule, width, nsteps, elapsed);
+  if (nsteps > 0 && elapsed > 0.0) {
+    printf(" (%g cells/s)", (double)width * nsteps / elapsed);
+  }
+  printf("\n");
+  free(cur);
+  free(next);
+  free(row);
+}
+
+/**
+ * Evolve the 2D CA (`born`, `survive`) of `width` x `height` cells for
+ * `nsteps` steps, starting from a random configuration, and write the
+ * final state to `out`.
+ */
+void run_2d(
+    unsigned born,
+    unsigned survive,
+    int width,
+    int height,
+    int nsteps,
+    FILE* out
+) {
+  const int nw = width / CA_WORD_BITS;
+  const int stride = nw + 2;
+  const size_t size = (size_t)stride * (height + 2);
+  ca_word_t* cur = (ca_word_t*)calloc(size, sizeof(*cur));
+  assert(cur != NULL);
+  ca_word_t* next = (ca_word_t*)calloc(size, sizeof(*next));
+  assert(next != NULL);
+  unsigned char* row = (unsigned char*)malloc(width / 8);
+  assert(row != NULL);
+  const ca2d_kernel_t kernel = ca2d_kernel(born, survive);
+  char name[24];
+
+  for (int i = 0; i < height; i++) {
+    for (int j = 0; j < width; j++) {
+      if (ca_random_cell(j, i, 0.5)) {
+        cur[(size_t)(i + 1) * stride + 1 + j / CA_WORD_BITS] |=
+            (ca_word_t)1 << (CA_WORD_BITS - 1 - j % CA_WORD_BITS);
+      }
+    }
+  }
+  const double tstart = omp_get_wtime();
+  for (int s = 0; s < nsteps; s++) {
+    ca2d_wrap(cur, nw, height);
+    kernel(born, survive, cur, next, stride, 1, height, 1, nw);
+    ca_word_t* tmp = cur;
+    cur = next;
+    next = tmp;
+  }
+  const double elapsed = omp_get_wtime() - tstart;
+  write_header(out, width, height);
+  for (int i = 1; i <= height; i++) {
+    ca_store_row(cur + (size_t)i * stride + 1, nw, row);
+    fwrite(row, 1, width / 8, out);
+  }
+  ca2d_format_rule(born, survive, name);
+  printf(
+      "Rule %s: %d x %d cells, %d steps, %f s",
+      name,
+      width,
+      height,
+      nsteps,
+      elapsed
+  );
+  if (nsteps > 0 && elapsed > 0.0) {
+    printf(" (%g cells/s)", (double)width * height * nsteps / elapsed);
+  }
+  printf("\n");
+  free(cur);
+  free(next);
+  free(row);
+}
+
+/* Each implementation is timed over repeated runs of `nsteps` steps,
+   all starting from the same state, until BENCH_MIN_TIME seconds have
+   elapsed; the fastest run is reported. */
+#define BENCH_MIN_TIME 0.05
+
+/* Throughput of the three implementations (cells/s); `special` is zero
+   when the rule has no specialized kernel */
+typedef struct {
+  double ref, generic, special;
+} tput_t;
+
+/**
+ * Run `nsteps` steps of the elementary rule `rule` on a random domain
+ * of `width` cells with the three implementations; return the number
+ * of cells whose final state differs from the reference.
+ */
+int bench_1d(unsigned rule, int width, int nsteps, tput_t* t) {
+  const int nw = width / CA_WORD_BITS;
+  const ca1d_kernel_t kernels[2] = {ca1d_step_generic, ca1d_kernel(rule)};
+  uint8_t* init = (uint8_t*)malloc(width);
+  uint8_t* cells[2] = {(uint8_t*)malloc(width), (uint8_t*)malloc(width)};
+  ca_word_t* w[3][2]; /* [generic, specialized, reference][cur, next] */
+  double best[3] = {0.0, 0.0, 0.0}; /* [reference, generic, specialized] */
+  assert(init != NULL && cells[0] != NULL && cells[1] != NULL);
+  for (int k = 0; k < 3; k++) {
+    for (int b = 0; b < 2; b++) {
+      w[k][b] = (ca_word_t*)calloc(nw + 2, sizeof(ca_word_t));
+      assert(w[k][b] != NULL);
+    }
+  }
+  for (int i = 0; i < width; i++) {
+    init[i] = ca_random_cell(i, rule, 0.5);
+  }
+  /* w[2][1] holds the packed initial state until the check below */
+  pack(init, w[2][1] + 1, nw);
+
+  for (int k = 0; k < 3; k++) {
+    if (k == 2 && kernels[1] == kernels[0]) {
+      break;
+    }
+    double total = 0.0;
+    /* run -1 is a single step that warms up the caches and threads */
+    for (int run = -1; run < 1 || total < BENCH_MIN_TIME; run++) {
+      const int n = (run < 0 ? 1 : nsteps);
+      if (k == 0) {
+        memcpy(cells[0], init, width);
+      } else {
+        memcpy(w[k - 1][0], w[2][1], (nw + 2) * sizeof(ca_word_t));
+      }
+      const double tstart = omp_get_wtime();
+      for (int s = 0; s < n; s++) {
+        if (k == 0) {
+          ref1d_step(rule, cells[0], cells[1], width);
+          uint8_t* tmp = cells[0];
+          cells[0] = cells[1];
+          cells[1] = tmp;
+        } else {
+          ca_word_t** cur = w[k - 1];
+          wrap1d(cur[0], nw);
+          kernels[k - 1](rule, cur[0], cur[1], 1, nw);
+          ca_word_t* tmp = cur[0];
+          cur[0] = cur[1];
+          cur[1] = tmp;
+        }
+      }
+      const double elapsed = omp_get_wtime() - tstart;
+      if (run >= 0) {
+        total += elapsed;
+        if (run == 0 || elapsed < best[k]) {
+          best[k] = elapsed;
+        }
+      }
+    }
+  }
+  t->ref = (double)width * nsteps / best[0];
+  t->generic = (double)width * nsteps / best[1];
+  t->special = (best[2] > 0.0 ? (double)width * nsteps / best[2] : 0.0);
+
+  int errors = 0;
+  pack(cells[0], w[2][0] + 1, nw);
+  for (int k = 0; k < (t->special > 0.0 ? 2 : 1); k++) {
+    for (int i = 1; i <= nw; i++) {
+      errors += __builtin_popcountll(w[k][0][i] ^ w[2][0][i]);
+    }
+  }
+  for (int k = 0; k < 3; k++) {
+    free(w[k][0]);
+    free(w[k][1]);
+  }
+  free(init);
+  free(cells[0]);
+  free(cells[1]);
+  return errors;
+}
+
+/**
+ * Same as `bench_1d()` for the 2D rule (`born`, `survive`) on a grid
+ * of `width` x `height` cells.
+ */
+int bench_2d(
+    unsigned born,
+    unsigned survive,
+    int width,
+    int height,
+    int nsteps,
+    tput_t* t
+) {
+  const int nw = width / CA_WORD_BITS;
+  const int stride = nw + 2;
+  const size_t size = (size_t)stride * (height + 2);
+  const size_t ncells = (size_t)width * height;
+  const ca2d_kernel_t kernels[2] = {
+      ca2d_step_generic,
+      ca2d_kernel(born, survive)
+  };
+  uint8_t* init = (uint8_t*)malloc(ncells);
+  uint8_t* cells[2] = {(uint8_t*)malloc(ncells), (uint8_t*)malloc(ncells)};
+  ca_word_t* w[3][2];
+  double best[3] = {0.0, 0.0, 0.0};
+  assert(init != NULL && cells[0] != NULL && cells[1] != NULL);
+  for (int k = 0; k < 3; k++) {
+    for (int b = 0; b < 2; b++) {
+      w[k][b] = (ca_word_t*)calloc(size, sizeof(ca_word_t));
+      assert(w[k][b] != NULL);
+    }
+  }
+  for (int i = 0; i < height; i++) {
+    for (int j = 0; j < width; j++) {
+      init[(size_t)i * width + j] = ca_random_cell(j, i, 0.5);
+    }
+    pack(
+        init + (size_t)i * width,
+        w[2][1] + (size_t)(i + 1) * stride + 1,
+        nw
+    );
+  }
+
+  for (int k = 0; k < 3; k++) {
+    if (k == 2 && kernels[1] == kernels[0]) {
+      break;
+    }
+    double total = 0.0;
+    for (int run = -1; run < 1 || total < BENCH_MIN_TIME; run++) {
+      const int n = (run < 0 ? 1 : nsteps);
+      if (k == 0) {
+        memcpy(cells[0], init, ncells);
+      } else {
+        memcpy(w[k - 1][0], w[2][1], size * sizeof(ca_word_t));
+      }
+      const double tstart = omp_get_wtime();
+      for (int s = 0; s < n; s++) {
+        if (k == 0) {
+          ref2d_step(born, survive, cells[0], cells[1], width, height);
+          uint8_t* tmp = cells[0];
+          cells[0] = cells[1];
+          cells[1] = tmp;
+        } else {
+          ca_word_t** cur = w[k - 1];
+          ca2d_wrap(cur[0], nw, height);
+          kernels[k - 1](
+              born,
+              survive,
+              cur[0],
+              cur[1],
+              stride,
+              1,
+              height,
+              1,
+              nw
+          );
+          ca_word_t* tmp = cur[0];
+          cur[0] = cur[1];
+          cur[1] = tmp;
+        }
+      }
+      const double elapsed = omp_get_wtime() - tstart;
+      if (run >= 0) {
+        total += elapsed;
+        if (run == 0 || elapsed < best[k]) {
+          best[k] = elapsed;
+        }
+      }
+    }
+  }
+  t->ref = (double)ncells * nsteps / best[0];
+  t->generic = (double)ncells * nsteps / best[1];
+  t->special = (best[2] > 0.0 ? (double)ncells * nsteps / best[2] : 0.0);
+
+  int errors = 0;
+  for (int i = 0; i < height; i++) {
+    ca_word_t* ref = w[2][0] + (size_t)(i + 1) * stride + 1;
+    pack(cells[0] + (size_t)i * width, ref, nw);
+    for (int k = 0; k < (t->special > 0.0 ? 2 : 1); k++) {
+      for (int j = 0; j < nw; j++) {
+        errors += __builtin_popcountll(
+            w[k][0][(size_t)(i + 1) * stride + 1 + j] ^ ref[j]
+        );
+      }
+    }
+  }
+  for (int k = 0; k < 3; k++) {
+    free(w[k][0]);
+    free(w[k][1]);
+  }
+  free(init);
+  free(cells[0]);
+  free(cells[1]);
+  return errors;
+}
+
+/* Print one row of the benchmark table */
+void print_tput(const char* name, const tput_t* t) {
+  if (t->special > 0.0) {
+    printf(
+        "%-14s %14.3g %14.3g %14.3g\n",
+        name,
+        t->ref,
+        t->generic,
+        t->special
+    );
+  } else {
+    printf("%-14s %14.3g %14.3g %14s\n", name, t->ref, t->generic, "-");
+  }
+}
+
+/**
+ * Benchmark all elementary rules and the 2D rules on `width` x
+ * `height` cells (arranged in a single row for the elementary rules).
+ */
+int benchmark(int width, int height) {
+  const int NSTEPS = 16;
+  const unsigned rules2d[][2] = {
+      {CA_LIFE_BORN, CA_LIFE_SURVIVE},
+      {CA_ANNEAL_BORN, CA_ANNEAL_SURVIVE},
+      {HIGHLIFE_BORN, HIGHLIFE_SURVIVE}
+  };
+  char name[24];
+  tput_t t, sum = {0, 0, 0};
+  int errors = 0;
+
+  printf("Elementary rules, %d cells, %d steps\n", width * height, NSTEPS);
+  printf("%-14s %14s %14s %14s\n", "rule", "bytes", "generic", "specialized");
+  for (unsigned rule = 0; rule < 256; rule++) {
+    errors += bench_1d(rule, width * height, NSTEPS, &t);
+    sum.ref += t.ref;
+    sum.generic += t.generic;
+    sum.special += t.special;
+    if (rule == 30 || rule == 90 || rule == 110 || rule == 184) {
+      snprintf(name, sizeof(name), "%u", rule);
+      print_tput(name, &t);
+    }
+  }
+  sum.ref /= 256;
+  sum.generic /= 256;
+  sum.special /= 256;
+  print_tput("mean (256)", &sum);
+
+  printf("\n2D rules, %d x %d cells, %d steps\n", width, height, NSTEPS);
+  printf("%-14s %14s %14s %14s\n", "rule", "bytes", "generic", "specialized");
+  for (int r = 0; r < 3; r++) {
+    errors += bench_2d(rules2d[r][0], rules2d[r][1], width, height, NSTEPS, &t);
+    ca2d_format_rule(rules2d[r][0], rules2d[r][1], name);
+    print_tput(name, &t);
+  }
+  printf(
+      "\nThroughput in cells/s, best of %g s of runs; %d threads; %s\n",
+      BENCH_MIN_TIME,
+      omp_get_max_threads(),
+      errors ? "MISMATCH" : "all results match"
+  );
+  return (errors ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+int main(int argc, char* argv[]) {
+  const char* outname = "ca.pbm";
+  int nsteps = 1024, width = 1024, height = 1024, bench = 0, opt;
+  unsigned rule = 0, born, survive;
+  int is_2d = 0;
+
+  while ((opt = getopt(argc, argv, "bs:o:")) != -1) {
+    switch (opt) {
+      case 'b':
+        bench = 1;
+        break;
+      case 's':
+        nsteps = atoi(optarg);
+        break;
+      case 'o':
+        outname = optarg;
+        break;
+      default:
+        fprintf(
+            stderr,
+            "Usage: %s [-s nsteps] [-o outfile] rule [width [height]]\n"
+            "       %s -b [width [height]]\n",
+            argv[0],
+            argv[0]
+        );
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (!bench) {
+    if (optind >= argc) {
+      fprintf(stderr, "FATAL: missing rule\n");
+      return EXIT_FAILURE;
+    }
+    char* end;
+    const long r = strtol(argv[optind], &end, 10);
+    if (*end == '\0' && r >= 0 && r <= 255) {
+      rule = r;
+    } else if (ca2d_parse_rule(argv[optind], &born, &survive) == 0) {
+      is_2d = 1;
+    } else {
+      fprintf(stderr, "FATAL: invalid rule \"%s\"\n", argv[optind]);
+      return EXIT_FAILURE;
+    }
+    optind++;
+  }
+
+  if (optind < argc) {
+    width = height = atoi(argv[optind]);
+  }
+  if (optind + 1 < argc) {
+    height = atoi(argv[optind + 1]);
+  }
+
+  if (width <= 0 || width % CA_WORD_BITS || height <= 0 || nsteps < 0) {
+    fprintf(
+        stderr,
+        "FATAL: the width must be a positive multiple of %d\n",
+        CA_WORD_BITS
+    );
+    return EXIT_FAILURE;
+  }
+
+  if (bench) {
+    return benchmark(width, height);
+  }
+
+  FILE* out = fopen(outname, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "FATAL: Cannot create %s\n", outname);
+    return EXIT_FAILURE;
+  }
+  if (is_2d) {
+    run_2d(born, survive, width, height, nsteps, out);
+  } else {
+    run_1d(rule, width, nsteps, out);
+  }
+  fclose(out);
+  return EXIT_SUCCESS;
+}
@@ -110,7 +110,7 @@ parallel without race conditions.
 
 To compile:
 
-        gcc -std=c99 -Wall -Wpedantic -fopenmp omp-cat-map.c -o omp-cat-map
+        gcc -std=c99 -Wall -Wpedantic -fopenmp -I../../include omp-cat-map.c -o omp-cat-map
 
 To execute:
 
@@ -226,6 +226,45 @@ no difference between the two versions. Loop interchange provides a
 significant performance boost on the very old Intel Atom N570
 processor, but provides worse performance on the Xeon processors.
 
+## Matrix power
+
+Both versions above cost $O(N^2 k)$. However, the cat map is the
+linear transformation
+
+$$
+C(x, y) = M \begin{pmatrix} x \\ y \end{pmatrix} \bmod N, \qquad
+M = \begin{pmatrix} 2 & 1 \\ 1 & 1 \end{pmatrix}
+$$
+
+so that $C^k(x, y) = M^k (x, y)^T \bmod N$. The matrix $M^k \bmod N$
+can be computed with $O(\log k)$ $2 \times 2$ matrix products by
+repeated squaring; then, a single pass over the image moves each pixel
+directly to its final position. The cost becomes $O(N^2 + \log k)$,
+which for the values of $k$ used here is independent of $k$. This is
+what `cat_map_power()` does.
+
+`cat_map_power()` still _scatters_ the pixels: consecutive reads are
+written to distant locations of the output image, so for large images
+almost every write misses the cache and the TLB. `cat_map_gather()`
+turns the loop around: it scans the output image in tiles of `TILE_W`
+$\times$ `TILE_H` pixels (that can be changed with `-DTILE_W=...
+-DTILE_H=...`), and reads each pixel $(x', y')$ from $C^{-k}(x', y')$,
+where $M^{-k} \bmod N$ is easily obtained from $M^k$ since $\det M =
+1$. Writes are now sequential and can use non-temporal stores, while
+reads become scattered.
+
+When the same transformation must be applied to many images of the
+same size, the destination of every pixel can be computed once and
+stored in a table (a _plan_, as in FFT libraries); each image then
+requires a single parallel scatter. The program can process all PGM
+files in a directory this way:
+
+        ./omp-cat-map -b k input_dir output_dir [plan_file]
+
+If `plan_file` is given, the plan is loaded from that file when it
+has been computed for the same $N$ and $k$; otherwise it is computed
+and saved there for later runs.
+
 ## To probe further
 
 What is the minimum recurrence time of image
@@ -279,11 +318,22 @@ image is 36)
 
 ***/
 
+#if _XOPEN_SOURCE < 600
+#define _XOPEN_SOURCE 600
+#endif
 #include <assert.h>
+#include <dirent.h>
 #include <omp.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "pnmio.h"
 
 typedef struct {
   int width;   /* Width of the image (in pixels) */
@@ -318,78 +368,55 @@ void init_pgm(PGM_image* img, int width, int height, unsigned char col) {
 }
 
 /**
- * Read a PGM file from file `f`. Warning: this function is not
- * robust: it may fail on legal PGM images, and may crash on invalid
- * files since no proper error checking is done.
+ * Read a PGM file from file `f`, using the memory-mapped I/O routines
+ * of pnmio.h. The pixels are copied into a properly aligned bitmap,
+ * since the functions below replace `img->bmap` with newly allocated
+ * buffers.
  */
 void read_pgm(FILE* f, PGM_image* img) {
-  char buf[1024];
-  const size_t BUFSIZE = sizeof(buf);
-  char* s;
-  int nread;
+  pnm_image_t in;
 
   assert(f != NULL);
   assert(img != NULL);
 
-  /* Get the file type (must be "P5") */
-  s = fgets(buf, BUFSIZE, f);
-  if (0 != strcmp(s, "P5\n")) {
-    fprintf(stderr, "Wrong file type %s\n", buf);
-    exit(EXIT_FAILURE);
-  }
-  /* Get any comment and ignore it; does not work if there are
-     leading spaces in the comment line */
-  do {
-    s = fgets(buf, BUFSIZE, f);
-  } while (s[0] == '#');
-  /* Get width, height */
-  sscanf(s, "%d %d", &(img->width), &(img->height));
-  /* get maxgrey; must be less than or equal to 255 */
-  s = fgets(buf, BUFSIZE, f);
-  sscanf(s, "%d", &(img->maxgrey));
-  if (img->maxgrey > 255) {
-    fprintf(stderr, "FATAL: maxgray=%d > 255\n", img->maxgrey);
+  if (pnm_open_fd(fileno(f), "input", &in) != 0) exit(EXIT_FAILURE);
+  if (in.type != 5) {
+    fprintf(stderr, "FATAL: the input is not a PGM image\n");
     exit(EXIT_FAILURE);
   }
-#if _XOPEN_SOURCE < 600
-  img->bmap = (unsigned char*)malloc(
-      (img->width) * (img->height) * sizeof(unsigned char)
-  );
-#else
+  img->width = in.width;
+  img->height = in.height;
+  img->maxgrey = in.maxval;
   /* The pointer img->bmap must be properly aligned to allow aligned
      SIMD load/stores to work. */
   int ret = posix_memalign(
       (void**)&(img->bmap), __BIGGEST_ALIGNMENT__, (img->width) * (img->height)
   );
   assert(0 == ret);
-#endif
-  assert(img->bmap != NULL);
-  /* Get the binary data from the file */
-  nread = fread(img->bmap, 1, (img->width) * (img->height), f);
-  if ((img->width) * (img->height) != nread) {
-    fprintf(
-        stderr,
-        "FATAL: error reading input: expecting %d bytes, got %d\n",
-        (img->width) * (img->height),
-        nread
-    );
-    exit(EXIT_FAILURE);
-  }
+  memcpy(img->bmap, in.pixels, in.size);
+  pnm_close(&in);
 }
 
 /**
- * Write the image `img` to file `f`; if not NULL, use the string
- * `comment` as metadata.
+ * Write the image `img` to file `f` with a single writev() call; if
+ * not NULL, use the string `comment` as metadata.
  */
 void write_pgm(FILE* f, const PGM_image* img, const char* comment) {
   assert(f != NULL);
   assert(img != NULL);
 
-  fprintf(f, "P5\n");
-  fprintf(f, "# %s\n", comment != NULL ? comment : "");
-  fprintf(f, "%d %d\n", img->width, img->height);
-  fprintf(f, "%d\n", img->maxgrey);
-  fwrite(img->bmap, 1, (img->width) * (img->height), f);
+  fflush(f);
+  if (pnm_write_fd(
+          fileno(f),
+          5,
+          img->width,
+          img->height,
+          img->maxgrey,
+          comment,
+          img->bmap
+      ) != 0) {
+    exit(EXIT_FAILURE);
+  }
 }
 
 /**
@@ -469,83 +496,541 @@ void cat_map_interchange(PGM_image* img, int k) {
   free(cur);
 }
 
-int main(int argc, char* argv[]) {
-  PGM_image img;
-  int niter;
-  double elapsed;
-  const int NTESTS = 5; /* number of replications */
+/* A 2x2 matrix [[a, b], [c, d]] with entries in [0, N) */
+typedef struct {
+  int64_t a, b, c, d;
+} mat2_t;
+
+/* Return (p * q) mod n; entries are < n <= 2^31, so the products of
+   two entries and their sums fit in 64 bits. */
+mat2_t mat2_mul(mat2_t p, mat2_t q, int64_t n) {
+  mat2_t r;
+  r.a = (p.a * q.a + p.b * q.c) % n;
+  r.b = (p.a * q.b + p.b * q.d) % n;
+  r.c = (p.c * q.a + p.d * q.c) % n;
+  r.d = (p.c * q.b + p.d * q.d) % n;
+  return r;
+}
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s niter < input > output\n", argv[0]);
-    return EXIT_FAILURE;
+/**
+ * Return M^k mod n, where M = [[2, 1], [1, 1]] is the matrix of the
+ * cat map, using O(log k) multiplications (repeated squaring). If k <=
+ * 0 the result is the identity, since `cat_map()` applies no iteration
+ * in that case.
+ */
+mat2_t cat_matrix_pow(int k, int n) {
+  mat2_t result = {1 % n, 0, 0, 1 % n}; /* identity */
+  mat2_t base = {2 % n, 1 % n, 1 % n, 1 % n};
+
+  while (k > 0) {
+    if (k & 1) result = mat2_mul(result, base, n);
+    base = mat2_mul(base, base, n);
+    k >>= 1;
   }
-  niter = atoi(argv[1]);
-  read_pgm(stdin, &img);
+  return result;
+}
 
-  if (img.width != img.height) {
-    fprintf(
-        stderr,
-        "FATAL: width (%d) and height (%d) of the input image must be equal\n",
-        img.width,
-        img.height
-    );
+/**
+ * Same as `cat_map()`, but computes M^k mod N once and then moves
+ * every pixel (x, y) directly to M^k (x, y) mod N with a single pass
+ * over the image. Along a row the destination advances by the first
+ * column of M^k, so the inner loop needs no multiplications or
+ * divisions.
+ */
+void cat_map_power(PGM_image* img, int k) {
+  const int N = img->width;
+  unsigned char* cur = img->bmap;
+  unsigned char* next = (unsigned char*)malloc(N * N * sizeof(unsigned char));
+
+  assert(next != NULL);
+  assert(img->width == img->height);
+
+  const mat2_t m = cat_matrix_pow(k, N);
+  const int a = m.a, c = m.c;
+
+#pragma omp parallel for default(none) shared(N, next, cur, m, a, c)
+  for (int y = 0; y < N; y++) {
+    /* destination of pixel (0, y) */
+    int xk = (int)(m.b * y % N);
+    int yk = (int)(m.d * y % N);
+    for (int x = 0; x < N; x++) {
+      next[yk * N + xk] = cur[y * N + x];
+      xk += a;
+      if (xk >= N) xk -= N;
+      yk += c;
+      if (yk >= N) yk -= N;
+    }
+  }
+  img->bmap = next;
+  free(cur);
+}
+
+/* Size of the destination tiles of `cat_map_gather()`. A tile row
+   should span whole cache lines; a tile (TILE_W * TILE_H bytes) should
+   fit comfortably in L2. */
+#ifndef TILE_W
+#define TILE_W 512
+#endif
+#ifndef TILE_H
+#define TILE_H 32
+#endif
+
+/**
+ * Fill `len` consecutive destination pixels `dst[0..len-1]` reading
+ * from the N x N image `src`: the source of dst[0] is (sx, sy), and
+ * moves by (dx, dy) (mod N) for each destination pixel. Writes are
+ * sequential, so aligned blocks of 16 pixels are written with
+ * non-temporal (streaming) stores when SSE2 is available: the output
+ * is not read again, and there is no point in polluting the caches.
+ */
+void gather_row(
+    unsigned char* dst,
+    const unsigned char* src,
+    int N,
+    int len,
+    int sx,
+    int sy,
+    int dx,
+    int dy
+) {
+  int x = 0;
+#if defined(__SSE2__)
+  for (; x < len && ((uintptr_t)(dst + x) & 15) != 0; x++) {
+    dst[x] = src[(size_t)sy * N + sx];
+    sx += dx;
+    if (sx >= N) sx -= N;
+    sy += dy;
+    if (sy >= N) sy -= N;
+  }
+  for (; x + 16 <= len; x += 16) {
+    union {
+      __m128i v;
+      unsigned char b[16];
+    } blk;
+    for (int j = 0; j < 16; j++) {
+      blk.b[j] = src[(size_t)sy * N + sx];
+      sx += dx;
+      if (sx >= N) sx -= N;
+      sy += dy;
+      if (sy >= N) sy -= N;
+    }
+    _mm_stream_si128((__m128i*)(dst + x), blk.v);
+  }
+#endif
+  for (; x < len; x++) {
+    dst[x] = src[(size_t)sy * N + sx];
+    sx += dx;
+    if (sx >= N) sx -= N;
+    sy += dy;
+    if (sy >= N) sy -= N;
+  }
+}
+
+/**
+ * Same as `cat_map_power()`, but formulated as a gather: the output
+ * image is scanned tile by tile, and each pixel (x', y') reads its
+ * value from C^{-k}(x', y'). Since det(M^k) = 1, the inverse of
+ * M^k = [[a, b], [c, d]] is [[d, -b], [-c, a]]. The reads are
+ * scattered, but the writes are sequential within each tile row.
+ */
+void cat_map_gather(PGM_image* img, int k) {
+  const int N = img->width;
+  unsigned char* cur = img->bmap;
+  unsigned char* next = (unsigned char*)malloc(N * N * sizeof(unsigned char));
+
+  assert(next != NULL);
+  assert(img->width == img->height);
+
+  const mat2_t m = cat_matrix_pow(k, N);
+  const mat2_t inv = {m.d, (N - m.b) % N, (N - m.c) % N, m.a};
+  const int ntx = (N + TILE_W - 1) / TILE_W;
+  const int nty = (N + TILE_H - 1) / TILE_H;
+
+#pragma omp parallel default(none) shared(N, next, cur, inv, ntx, nty)
+  {
+#pragma omp for collapse(2) schedule(static)
+    for (int ty = 0; ty < nty; ty++) {
+      for (int tx = 0; tx < ntx; tx++) {
+        const int x0 = tx * TILE_W;
+        const int len = (x0 + TILE_W <= N ? TILE_W : N - x0);
+        const int y0 = ty * TILE_H;
+        const int y1 = (y0 + TILE_H <= N ? y0 + TILE_H : N);
+        for (int y = y0; y < y1; y++) {
+          gather_row(
+              next + (size_t)y * N + x0,
+              cur,
+              N,
+              len,
+              (int)((inv.a * x0 + inv.b * y) % N),
+              (int)((inv.c * x0 + inv.d * y) % N),
+              (int)inv.a,
+              (int)inv.c
+          );
+        }
+      }
+    }
+#if defined(__SSE2__)
+    /* make the streaming stores visible before the image is used */
+    _mm_sfence();
+#endif
+  }
+  img->bmap = next;
+  free(cur);
+}
+
+/**
+ * A precomputed cat map "plan", similar to the plans of FFT libraries:
+ * it stores the destination of every pixel of an n x n image after k
+ * iterations, so that the same transformation can be applied to many
+ * images as a pure parallel scatter. Indexes are 32 bits, so n can be
+ * at most 65536. The table is fully determined by M^k mod n, which is
+ * all that is saved to disk.
+ */
+typedef struct {
+  int n;         /* image size */
+  int k;         /* number of iterations */
+  mat2_t m;      /* M^k mod n */
+  uint32_t* dst; /* dst[y*n + x] is the index of pixel C^k(x, y) */
+} cat_plan_t;
+
+const char CAT_PLAN_MAGIC[8] = "CATPLAN2";
+
+/**
+ * Fill the table of `plan` from `m`, that must be a matrix with
+ * entries in [0, n) and determinant 1 (mod n), so that every pixel is
+ * moved to a valid and distinct position.
+ */
+void cat_plan_fill(cat_plan_t* plan, int n, int k, mat2_t m) {
+  assert(plan != NULL);
+  assert(n > 0 && n <= 65536);
+
+  plan->n = n;
+  plan->k = k;
+  plan->m = m;
+  plan->dst = (uint32_t*)malloc((size_t)n * n * sizeof(*plan->dst));
+  assert(plan->dst != NULL);
+
+  uint32_t* dst = plan->dst;
+#pragma omp parallel for default(none) shared(n, m, dst)
+  for (int y = 0; y < n; y++) {
+    uint32_t xk = m.b * y % n, yk = m.d * y % n;
+    for (int x = 0; x < n; x++) {
+      dst[(size_t)y * n + x] = yk * n + xk;
+      xk += m.a;
+      if (xk >= (uint32_t)n) xk -= n;
+      yk += m.c;
+      if (yk >= (uint32_t)n) yk -= n;
+    }
+  }
+}
+
+/* Compute the plan for images of size `n` x `n` and `k` iterations */
+void cat_plan_init(cat_plan_t* plan, int n, int k) {
+  cat_plan_fill(plan, n, k, cat_matrix_pow(k, n));
+}
+
+void cat_plan_free(cat_plan_t* plan) {
+  assert(plan != NULL);
+  free(plan->dst);
+  plan->dst = NULL;
+  plan->n = plan->k = -1;
+}
+
+/**
+ * Save `plan` to file `fname`; return 0 on success, -1 on failure.
+ * The file is written in the native byte order.
+ */
+int cat_plan_save(const cat_plan_t* plan, const char* fname) {
+  const int32_t header[2] = {plan->n, plan->k};
+  const int64_t m[4] = {plan->m.a, plan->m.b, plan->m.c, plan->m.d};
+  FILE* f = fopen(fname, "wb");
+  int ok;
+
+  if (f == NULL) return -1;
+  ok = (fwrite(CAT_PLAN_MAGIC, sizeof(CAT_PLAN_MAGIC), 1, f) == 1 &&
+        fwrite(header, sizeof(header), 1, f) == 1 &&
+        fwrite(m, sizeof(m), 1, f) == 1);
+  ok = (fclose(f) == 0) && ok;
+  return ok ? 0 : -1;
+}
+
+/**
+ * Load a plan for size `n` and `k` iterations from file `fname`.
+ * Return 0 on success; return -1 if the file can not be read, has
+ * been computed for a different size or number of iterations, or does
+ * not hold a valid matrix.
+ */
+int cat_plan_load(cat_plan_t* plan, const char* fname, int n, int k) {
+  char magic[sizeof(CAT_PLAN_MAGIC)];
+  int32_t header[2];
+  int64_t m[4];
+  FILE* f = fopen(fname, "rb");
+
+  if (f == NULL) return -1;
+  const int ok = (fread(magic, sizeof(magic), 1, f) == 1 &&
+                  memcmp(magic, CAT_PLAN_MAGIC, sizeof(magic)) == 0 &&
+                  fread(header, sizeof(header), 1, f) == 1 &&
+                  header[0] == n && header[1] == k &&
+                  fread(m, sizeof(m), 1, f) == 1);
+  fclose(f);
+  if (!ok) return -1;
+  /* A corrupted matrix could send pixels out of the image, or two
+     pixels to the same position; the entries must be in [0, n) (so
+     that the products below do not overflow), and the determinant
+     must be 1 (mod n) like that of M^k. */
+  for (int i = 0; i < 4; i++) {
+    if (m[i] < 0 || m[i] >= n) return -1;
+  }
+  if (((m[0] * m[3] - m[1] * m[2]) % n + n) % n != 1 % n) return -1;
+
+  const mat2_t mk = {m[0], m[1], m[2], m[3]};
+  cat_plan_fill(plan, n, k, mk);
+  return 0;
+}
+
+/**
+ * Apply `plan` to the n x n bitmap `src` and store the result in
+ * `dst`, which must not overlap `src`.
+ */
+void cat_plan_apply(
+    const cat_plan_t* plan, const unsigned char* src, unsigned char* dst
+) {
+  const size_t npix = (size_t)plan->n * plan->n;
+  const uint32_t* idx = plan->dst;
+
+#pragma omp parallel for default(none) shared(npix, idx, src, dst)
+  for (size_t i = 0; i < npix; i++) {
+    dst[idx[i]] = src[i];
+  }
+}
+
+/* Return nonzero iff `name` ends with ".pgm" */
+int is_pgm_file(const char* name) {
+  const size_t len = strlen(name);
+  return len > 4 && strcmp(name + len - 4, ".pgm") == 0;
+}
+
+/**
+ * Apply `niter` iterations of the cat map to every PGM file in
+ * directory `indir`, writing the results with the same names in
+ * `outdir`. All images must have the same size as the first one;
+ * images of different size are skipped. Input and output files are
+ * memory-mapped, so that the plan moves the pixels from one file to
+ * the other without intermediate copies. The plan is computed once; if
+ * `planfile` is not NULL, it is loaded from that file if it matches,
+ * otherwise it is computed and saved there.
+ */
+int cat_map_batch(
+    int niter, const char* indir, const char* outdir, const char* planfile
+) {
+  char fname[4096];
+  cat_plan_t plan = {-1, -1, {0, 0, 0, 0}, NULL};
+  double plan_time = 0.0, apply_time = 0.0;
+  int nimages = 0;
+  int status = EXIT_SUCCESS;
+  DIR* dir = opendir(indir);
+  struct dirent* ent;
+
+  if (dir == NULL) {
+    fprintf(stderr, "FATAL: can not open directory \"%s\"\n", indir);
     return EXIT_FAILURE;
   }
+  while ((ent = readdir(dir)) != NULL) {
+    pnm_image_t in, out;
+
+    if (!is_pgm_file(ent->d_name)) continue;
+    snprintf(fname, sizeof(fname), "%s/%s", indir, ent->d_name);
+    if (pnm_open(fname, &in) != 0) {
+      fprintf(stderr, "Skipping %s\n", fname);
+      continue;
+    }
 
-  /**
-   ** WITHOUT loop interchange
-   **/
-  elapsed = 0.0;
-  for (int i = 0; i < NTESTS; i++) {
-    fprintf(stderr, "Run %d of %d\n", i + 1, NTESTS);
+    if (plan.dst == NULL) {
+      if (in.type != 5 || in.width != in.height || in.width > 65536) {
+        fprintf(
+            stderr,
+            "FATAL: %s: unsupported image type or size %dx%d\n",
+            fname,
+            in.width,
+            in.height
+        );
+        pnm_close(&in);
+        status = EXIT_FAILURE;
+        break;
+      }
+      const double tstart = omp_get_wtime();
+      if (planfile != NULL &&
+          cat_plan_load(&plan, planfile, in.width, niter) == 0) {
+        fprintf(stderr, "Plan loaded from %s\n", planfile);
+      } else {
+        cat_plan_init(&plan, in.width, niter);
+        if (planfile != NULL && cat_plan_save(&plan, planfile) != 0) {
+          fprintf(stderr, "WARNING: can not save plan to %s\n", planfile);
+        }
+      }
+      plan_time = omp_get_wtime() - tstart;
+    }
+    if (in.type != 5 || in.width != plan.n || in.height != plan.n) {
+      fprintf(
+          stderr,
+          "Skipping %s: not a %dx%d PGM image\n",
+          fname,
+          plan.n,
+          plan.n
+      );
+      pnm_close(&in);
+      continue;
+    }
+
+    /* The plan reads the input mapping and writes the output mapping
+       directly. If the output is the input file itself (e.g., when
+       `outdir` is `indir`), pnm_create() would truncate the file that
+       `in` maps, so the input pixels are copied to memory first. */
+    struct stat st_in, st_out;
+    const int have_st_in = (stat(fname, &st_in) == 0);
+    unsigned char* copy = NULL;
+    snprintf(fname, sizeof(fname), "%s/%s", outdir, ent->d_name);
+    if (have_st_in && stat(fname, &st_out) == 0 &&
+        st_in.st_dev == st_out.st_dev && st_in.st_ino == st_out.st_ino) {
+      copy = (unsigned char*)malloc(in.size);
+      assert(copy != NULL);
+      memcpy(copy, in.pixels, in.size);
+    }
+    if (pnm_create(
+            fname,
+            5,
+            plan.n,
+            plan.n,
+            in.maxval,
+            "produced by omp-cat-map.c",
+            &out
+        ) != 0) {
+      pnm_close(&in);
+      free(copy);
+      status = EXIT_FAILURE;
+      break;
+    }
     const double tstart = omp_get_wtime();
-    cat_map(&img, niter);
-    elapsed += omp_get_wtime() - tstart;
-    if (i == 0) write_pgm(stdout, &img, "produced by omp-cat-map.c");
+    cat_plan_apply(&plan, (copy != NULL ? copy : in.pixels), out.pixels);
+    apply_time += omp_get_wtime() - tstart;
+    pnm_close(&out);
+    pnm_close(&in);
+    free(copy);
+    nimages++;
+  }
+  closedir(dir);
+  if (status != EXIT_SUCCESS) {
+    cat_plan_free(&plan);
+    return status;
   }
-  elapsed /= NTESTS;
 
-  fprintf(stderr, "\n=== Without loop interchange ===\n");
+  fprintf(stderr, "\n=== Batch ===\n");
 #if defined(_OPENMP)
   fprintf(stderr, "  OpenMP threads: %d\n", omp_get_max_threads());
 #else
   fprintf(stderr, "  OpenMP disabled\n");
 #endif
   fprintf(stderr, "    Iterations: %d\n", niter);
-  fprintf(stderr, "  Width,Height: %d,%d\n", img.width, img.height);
-  fprintf(
-      stderr,
-      "      Mops/sec: %f\n",
-      1.0e-6 * img.width * img.height * niter / elapsed
-  );
-  fprintf(stderr, "Execution time  %.3f\n\n", elapsed);
+  fprintf(stderr, "        Images: %d\n", nimages);
+  if (nimages > 0) {
+    fprintf(stderr, "  Width,Height: %d,%d\n", plan.n, plan.n);
+    fprintf(stderr, "     Plan time: %.3f\n", plan_time);
+    fprintf(
+        stderr,
+        "    Apply time: %.3f (%.4f per image)\n",
+        apply_time,
+        apply_time / nimages
+    );
+  }
+  cat_plan_free(&plan);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Apply `kernel` with `niter` iterations to `img` NTESTS times and
+ * print the average execution time. If `out` is not NULL, the result
+ * of the first run is written there.
+ */
+void benchmark(
+    const char* title,
+    void (*kernel)(PGM_image*, int),
+    PGM_image* img,
+    int niter,
+    FILE* out
+) {
+  const int NTESTS = 5; /* number of replications */
+  double elapsed = 0.0;
 
-  /**
-   ** WITH loop interchange
-   **/
-  elapsed = 0.0;
   for (int i = 0; i < NTESTS; i++) {
     fprintf(stderr, "Run %d of %d\n", i + 1, NTESTS);
     const double tstart = omp_get_wtime();
-    cat_map_interchange(&img, niter);
+    kernel(img, niter);
     elapsed += omp_get_wtime() - tstart;
+    if (i == 0 && out != NULL) {
+      write_pgm(out, img, "produced by omp-cat-map.c");
+    }
   }
   elapsed /= NTESTS;
 
-  fprintf(stderr, "\n=== With loop interchange ===\n");
+  fprintf(stderr, "\n=== %s ===\n", title);
 #if defined(_OPENMP)
   fprintf(stderr, "  OpenMP threads: %d\n", omp_get_max_threads());
 #else
   fprintf(stderr, "  OpenMP disabled\n");
 #endif
   fprintf(stderr, "    Iterations: %d\n", niter);
-  fprintf(stderr, "  Width,Height: %d,%d\n", img.width, img.height);
+  fprintf(stderr, "  Width,Height: %d,%d\n", img->width, img->height);
   fprintf(
       stderr,
       "      Mops/sec: %.4f\n",
-      1.0e-6 * img.width * img.height * niter / elapsed
+      1.0e-6 * img->width * img->height * niter / elapsed
   );
   fprintf(stderr, "Execution time  %.3f\n\n", elapsed);
+}
+
+int main(int argc, char* argv[]) {
+  PGM_image img;
+  int niter;
+
+  if (argc >= 2 && 0 == strcmp(argv[1], "-b")) {
+    if (argc != 5 && argc != 6) {
+      fprintf(
+          stderr,
+          "Usage: %s -b niter input_dir output_dir [plan_file]\n",
+          argv[0]
+      );
+      return EXIT_FAILURE;
+    }
+    return cat_map_batch(
+        atoi(argv[2]), argv[3], argv[4], (argc == 6 ? argv[5] : NULL)
+    );
+  }
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s niter < input > output\n", argv[0]);
+    fprintf(
+        stderr,
+        "       %s -b niter input_dir output_dir [plan_file]\n",
+        argv[0]
+    );
+    return EXIT_FAILURE;
+  }
+  niter = atoi(argv[1]);
+  read_pgm(stdin, &img);
+
+  if (img.width != img.height) {
+    fprintf(
+        stderr,
+        "FATAL: width (%d) and height (%d) of the input image must be equal\n",
+        img.width,
+        img.height
+    );
+    return EXIT_FAILURE;
+  }
+
+  benchmark("Without loop interchange", cat_map, &img, niter, stdout);
+  benchmark("With loop interchange", cat_map_interchange, &img, niter, NULL);
+  benchmark("Matrix power", cat_map_power, &img, niter, NULL);
+  benchmark("Tiled gather", cat_map_gather, &img, niter, NULL);
 
   free_pgm(&img);
   return EXIT_SUCCESS;
@@ -51,12 +51,26 @@ omp-cat-map-rectime
 
 Run with:
 
-        ./omp-cat-map-rectime [N]
+        ./omp-cat-map-rectime N [naive|cycles|order]
 
 Example:
 
         ./omp-cat-map-rectime 1024
 
+The optional second argument selects the algorithm:
+
+- `naive` iterates the map on every pixel until it returns to its
+  starting position, which takes $O(N^2 \cdot k)$ time
+  (`cat_map_rectime()`);
+
+- `cycles` walks each cycle of the permutation exactly once, marking
+  the visited pixels in a bitmap, which takes $O(N^2)$ time
+  (`cat_map_rectime_cycles()`);
+
+- `order` (the default) computes the order of the matrix of the cat
+  map modulo $N$ without looking at the pixels at all, which is
+  instantaneous even for huge $N$ (`cat_map_rectime_order()`).
+
 ## Files
 
 - [omp-cat-map-rectime.c](omp-cat-map-rectime.c)
@@ -65,9 +79,12 @@ Example:
 
 #include <assert.h>
 #include <omp.h>
+#include <inttypes.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* Compute the Greatest Common Divisor (GCD) of integers a>0 and b>0 */
 int gcd(int a, int b) {
@@ -144,18 +161,218 @@ int cat_map_rectime(int n) {
   return total_lcm;
 }
 
+/* Greatest Common Divisor of a>0 and b>0 (Euclid's algorithm) */
+uint64_t gcd64(uint64_t a, uint64_t b) {
+  while (b != 0) {
+    const uint64_t r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+/* Least Common Multiple of a>0 and b>0; return 0 on overflow */
+uint64_t lcm64(uint64_t a, uint64_t b) {
+  assert(a > 0);
+  assert(b > 0);
+  a /= gcd64(a, b);
+  if (a > UINT64_MAX / b) return 0;
+  return a * b;
+}
+
+/**
+ * Compute the recurrence time by cycle decomposition. The cat map is
+ * a permutation of the n*n pixels, so it splits into disjoint cycles,
+ * and the recurrence time is the LCM of their lengths. Each cycle is
+ * walked once: the pixels of a cycle are marked in a bitmap as they
+ * are visited, and walks only start from unmarked pixels. Two threads
+ * may occasionally start on the same cycle at the same time; this
+ * only wastes some work, since both measure the same length. Each
+ * thread keeps the LCM of the lengths it has seen, and skips lengths
+ * that divide it; the partial results are then combined.
+ */
+uint64_t cat_map_rectime_cycles(int n) {
+  assert(n > 0);
+
+  const size_t npix = (size_t)n * n;
+  const size_t nwords = (npix + 63) / 64;
+  uint64_t* const visited = (uint64_t*)calloc(nwords, sizeof(*visited));
+  uint64_t result = 1;
+  int overflow = 0;
+
+  assert(visited != NULL);
+
+#pragma omp parallel default(none) \
+    shared(n, npix, visited, result, overflow)
+  {
+    uint64_t my_lcm = 1;
+
+#pragma omp for schedule(dynamic, 4096)
+    for (size_t start = 0; start < npix; start++) {
+      uint64_t word;
+#pragma omp atomic read
+      word = visited[start / 64];
+      if (word & (UINT64_C(1) << (start % 64))) continue;
+
+      /* walk the cycle through `start` */
+      int x = start % n, y = start / n;
+      uint64_t len = 0;
+      do {
+        const size_t i = (size_t)y * n + x;
+#pragma omp atomic update
+        visited[i / 64] |= (UINT64_C(1) << (i % 64));
+        const int xnext = (2 * x + y) % n;
+        const int ynext = (x + y) % n;
+        x = xnext;
+        y = ynext;
+        len++;
+      } while ((size_t)y * n + x != start);
+
+      if (my_lcm != 0 && my_lcm % len != 0) my_lcm = lcm64(my_lcm, len);
+    }
+
+#pragma omp critical
+    {
+      if (my_lcm == 0 || overflow) {
+        overflow = 1;
+      } else {
+        result = lcm64(result, my_lcm);
+        if (result == 0) overflow = 1;
+      }
+    }
+  }
+  free(visited);
+  return overflow ? 0 : result;
+}
+
+/* A 2x2 matrix [[a, b], [c, d]] */
+typedef struct {
+  uint64_t a, b, c, d;
+} mat2_t;
+
+/* Return (p * q) mod m, with m < 2^32 */
+mat2_t mat2_mul(mat2_t p, mat2_t q, uint64_t m) {
+  mat2_t r;
+  r.a = (p.a * q.a % m + p.b * q.c % m) % m;
+  r.b = (p.a * q.b % m + p.b * q.d % m) % m;
+  r.c = (p.c * q.a % m + p.d * q.c % m) % m;
+  r.d = (p.c * q.b % m + p.d * q.d % m) % m;
+  return r;
+}
+
+/* Return nonzero iff M^e = I (mod m), where M = [[2, 1], [1, 1]] */
+int cat_matrix_pow_is_identity(uint64_t e, uint64_t m) {
+  mat2_t r = {1 % m, 0, 0, 1 % m};
+  mat2_t base = {2 % m, 1 % m, 1 % m, 1 % m};
+
+  while (e > 0) {
+    if (e & 1) r = mat2_mul(r, base, m);
+    base = mat2_mul(base, base, m);
+    e >>= 1;
+  }
+  return r.a == 1 % m && r.b == 0 && r.c == 0 && r.d == 1 % m;
+}
+
+/**
+ * Return the order of M mod m (the smallest e>0 such that M^e = I mod
+ * m), given a multiple `t` of that order: every prime factor q of t is
+ * divided out as long as M^(t/q) is still the identity.
+ */
+uint64_t cat_matrix_order(uint64_t t, uint64_t m) {
+  uint64_t rest = t;
+
+  for (uint64_t q = 2; rest > 1; q++) {
+    if (q * q > rest) q = rest; /* `rest` is prime */
+    if (rest % q != 0) continue;
+    while (rest % q == 0) rest /= q;
+    while (t % q == 0 && cat_matrix_pow_is_identity(t / q, m)) t /= q;
+  }
+  return t;
+}
+
+/**
+ * Compute the recurrence time without touching the pixels. All the
+ * pixels are back in place after k iterations iff M^k = I (mod n), so
+ * the recurrence time is the order of M mod n. By the Chinese
+ * remainder theorem, this is the LCM of the orders mod each prime
+ * power p^e dividing n. For a prime p, the eigenvalues of M are the
+ * roots of x^2 - 3x + 1, whose discriminant is 5:
+ *
+ * - if p = +-1 mod 5 they lie in GF(p), so the order divides p-1;
+ * - if p = +-2 mod 5 they are conjugate in GF(p^2), so (having product
+ *   1) the order divides p+1;
+ * - for p = 5 the order divides |SL(2, 5)| = 120.
+ *
+ * If M^j = I + p^i B with i >= 1 (i >= 2 when p = 2), then M^(jp) = I
+ * mod p^(i+1); hence the order mod p^e divides p^(e-1) (2 p^(e-1) when
+ * p = 2) times the order mod p. The exact order is found by dividing
+ * out prime factors from that multiple. This takes O(sqrt(n) log n)
+ * time regardless of the image size.
+ */
+uint64_t cat_map_rectime_order(int n) {
+  assert(n > 0);
+
+  uint64_t result = 1;
+  uint64_t rest = n;
+
+  for (uint64_t p = 2; rest > 1; p++) {
+    if (p * p > rest) p = rest; /* `rest` is prime */
+    if (rest % p != 0) continue;
+
+    uint64_t pe = 1;
+    while (rest % p == 0) {
+      rest /= p;
+      pe *= p;
+    }
+    uint64_t t;
+    if (p == 2) {
+      t = 6 * pe; /* |SL(2, 2)| = 6, times 2 p^(e-1) */
+    } else if (p == 5) {
+      t = 120 * (pe / p);
+    } else if (p % 5 == 1 || p % 5 == 4) {
+      t = (p - 1) * (pe / p);
+    } else {
+      t = (p + 1) * (pe / p);
+    }
+    result = lcm64(result, cat_matrix_order(t, pe));
+    if (result == 0) return 0;
+  }
+  return result;
+}
+
 int main(int argc, char* argv[]) {
-  int n, k;
+  const char* method = "order";
+  uint64_t k;
+  int n;
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s image_size\n", argv[0]);
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s image_size [naive|cycles|order]\n", argv[0]);
     return EXIT_FAILURE;
   }
   n = atoi(argv[1]);
+  if (argc == 3) method = argv[2];
+  if (n < 1) {
+    fprintf(stderr, "FATAL: image size must be positive\n");
+    return EXIT_FAILURE;
+  }
+
   const double tstart = omp_get_wtime();
-  k = cat_map_rectime(n);
+  if (0 == strcmp(method, "naive")) {
+    k = cat_map_rectime(n);
+  } else if (0 == strcmp(method, "cycles")) {
+    k = cat_map_rectime_cycles(n);
+  } else if (0 == strcmp(method, "order")) {
+    k = cat_map_rectime_order(n);
+  } else {
+    fprintf(stderr, "FATAL: unknown method \"%s\"\n", method);
+    return EXIT_FAILURE;
+  }
   const double elapsed = omp_get_wtime() - tstart;
-  printf("%d\n", k);
+  if (k == 0) {
+    fprintf(stderr, "FATAL: the recurrence time overflows 64 bits\n");
+    return EXIT_FAILURE;
+  }
+  printf("%" PRIu64 "\n", k);
 
   printf("Execution time %.3f\n", elapsed);
 
@@ -35,6 +35,27 @@
  *
  * at the beginning of your program, BEFORE any other include.
  *
+ * --------------------------------------------------------------------------
+ *
+ * This header also provides a small region profiler. Enclose the code
+ * to measure between `HPC_PROF_BEGIN("name")` and `HPC_PROF_END("name")`;
+ * regions can be nested and can be used inside OpenMP parallel
+ * regions, since each thread keeps its own timers. A summary table is
+ * printed to stderr when the program terminates, or earlier by
+ * `HPC_PROF_REPORT()` (in which case nothing is printed at exit); if
+ * the environment variable `HPC_PROF_CSV` is set, the per-thread data
+ * is also appended to the CSV file it names.
+ *
+ * The profiler is enabled by compiling with `-DHPC_PROFILE`; otherwise
+ * the macros expand to nothing. The following flags can be added:
+ *
+ * -DHPC_PROF_TSC   take timestamps with the x86 time-stamp counter
+ *                  instead of `hpc_gettime()`
+ * -DHPC_PROF_PERF  also count cycles, instructions and LLC misses with
+ *                  `perf_event_open()` (Linux only; you MUST add
+ *                  `#define _GNU_SOURCE` at the beginning of your
+ *                  program, BEFORE any other include)
+ *
  ****************************************************************************/
 
 #ifndef HPC_H
@@ -76,6 +97,435 @@ double hpc_gettime( void )
 }
 #endif
 
+/******************************************************************************
+ * Region profiler
+ ******************************************************************************/
+#ifdef HPC_PROFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(HPC_PROF_TSC) && !(defined(__x86_64__) || defined(__i386__))
+#warning HPC_PROF_TSC is only supported on x86; falling back to hpc_gettime()
+#undef HPC_PROF_TSC
+#endif
+
+#ifdef HPC_PROF_TSC
+#include <x86intrin.h>
+#endif
+
+#if defined(HPC_PROF_PERF) && !defined(__linux__)
+#warning HPC_PROF_PERF is only supported on Linux; hardware counters disabled
+#undef HPC_PROF_PERF
+#endif
+
+#ifdef HPC_PROF_PERF
+#if !defined(_GNU_SOURCE)
+#error You must add "#define _GNU_SOURCE" at the very beginning of your source program to use HPC_PROF_PERF
+#endif
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#ifndef HPC_PROF_MAX_THREADS
+#define HPC_PROF_MAX_THREADS 256
+#endif
+#ifndef HPC_PROF_MAX_REGIONS
+#define HPC_PROF_MAX_REGIONS 64
+#endif
+#ifndef HPC_PROF_MAX_DEPTH
+#define HPC_PROF_MAX_DEPTH 32
+#endif
+
+/* hardware counters, in the order they are read from the perf group */
+enum { HPC_PROF_CYCLES, HPC_PROF_INSTR, HPC_PROF_LLC_MISSES, HPC_PROF_NCOUNTERS };
+
+typedef struct {
+    const char *name;
+    int depth;                  /* nesting level of the first call      */
+    long calls;
+    uint64_t total;             /* inclusive ticks                      */
+    uint64_t self;              /* ticks not spent in nested regions    */
+    uint64_t min, max;          /* inclusive ticks of a single call     */
+    uint64_t counters[HPC_PROF_NCOUNTERS];
+} hpc_prof_region_t;
+
+typedef struct {
+    int region;                 /* index in hpc_prof_thread_t.regions   */
+    uint64_t start;
+    uint64_t children;          /* ticks spent in nested regions        */
+    uint64_t counters[HPC_PROF_NCOUNTERS];
+} hpc_prof_frame_t;
+
+typedef struct {
+    hpc_prof_region_t regions[HPC_PROF_MAX_REGIONS];
+    int nregions;
+    hpc_prof_frame_t stack[HPC_PROF_MAX_DEPTH];
+    int depth;
+    int perf_fd;                /* perf group leader, -1 if unavailable */
+    int perf_init;
+    char pad[64];               /* keep threads on different cache lines */
+} hpc_prof_thread_t;
+
+static hpc_prof_thread_t *hpc_prof_threads = NULL;
+static double hpc_prof_ticks_per_sec = 1.0e9;
+static int hpc_prof_reported = 0;
+
+static inline int hpc_prof_thread_id( void )
+{
+#ifdef _OPENMP
+    const int id = omp_get_thread_num();
+    if ( id >= HPC_PROF_MAX_THREADS ) {
+        fprintf( stderr, "hpc_prof: thread %d exceeds HPC_PROF_MAX_THREADS\n", id );
+        abort();
+    }
+    return id;
+#else
+    return 0;
+#endif
+}
+
+static inline uint64_t hpc_prof_ticks( void )
+{
+#ifdef HPC_PROF_TSC
+    return __rdtsc();
+#else
+    return (uint64_t)(hpc_gettime() * 1.0e9);
+#endif
+}
+
+#ifdef HPC_PROF_PERF
+static inline int hpc_prof_perf_open( uint64_t config, int group_fd )
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = (group_fd == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    /* pid = 0, cpu = -1: count the calling thread on any CPU */
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/* Open the counters of the calling thread; on failure (e.g., because of
+   /proc/sys/kernel/perf_event_paranoid) the counters are reported as
+   unavailable and the timers keep working. */
+static inline void hpc_prof_perf_init( hpc_prof_thread_t *t )
+{
+    static const uint64_t config[HPC_PROF_NCOUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES
+    };
+    static int warned = 0;
+    int c;
+
+    t->perf_init = 1;
+    t->perf_fd = hpc_prof_perf_open(config[0], -1);
+    for (c = 1; t->perf_fd >= 0 && c < HPC_PROF_NCOUNTERS; c++) {
+        if ( hpc_prof_perf_open(config[c], t->perf_fd) < 0 ) {
+            close(t->perf_fd);
+            t->perf_fd = -1;
+        }
+    }
+    if ( t->perf_fd < 0 ) {
+        if ( !warned ) {
+            fprintf( stderr, "hpc_prof: perf_event_open() failed, hardware counters disabled\n" );
+        }
+        warned = 1;
+        return;
+    }
+    ioctl(t->perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(t->perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+#endif
+
+static inline void hpc_prof_read_counters( hpc_prof_thread_t *t, uint64_t *counters )
+{
+#ifdef HPC_PROF_PERF
+    /* with PERF_FORMAT_GROUP, read() returns { nr, values[nr] } */
+    uint64_t buf[1 + HPC_PROF_NCOUNTERS];
+    if ( !t->perf_init ) {
+        hpc_prof_perf_init(t);
+    }
+    if ( t->perf_fd >= 0 && read(t->perf_fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf) ) {
+        memcpy(counters, buf + 1, sizeof(buf) - sizeof(buf[0]));
+        return;
+    }
+#else
+    (void)t;
+#endif
+    memset(counters, 0, HPC_PROF_NCOUNTERS * sizeof(*counters));
+}
+
+static inline int hpc_prof_has_counters( void )
+{
+#ifdef HPC_PROF_PERF
+    for (int i = 0; i < HPC_PROF_MAX_THREADS; i++) {
+        if ( hpc_prof_threads[i].perf_fd >= 0 ) return 1;
+    }
+#endif
+    return 0;
+}
+
+static inline double hpc_prof_sec( uint64_t ticks )
+{
+    return (double)ticks / hpc_prof_ticks_per_sec;
+}
+
+/* Print the summary table to stderr, merging the regions with the
+   same name across threads; the per-thread data is appended to the
+   file named by the environment variable `HPC_PROF_CSV`, if set. The
+   report is produced once: it runs at exit, unless the program has
+   already called it. */
+static inline void hpc_prof_report( void )
+{
+    hpc_prof_region_t merged[HPC_PROF_MAX_REGIONS];
+    int nthreads[HPC_PROF_MAX_REGIONS];
+    double max_thread[HPC_PROF_MAX_REGIONS];
+    int nmerged = 0, dropped = 0;
+    const int counters = hpc_prof_has_counters();
+    const char *csv_name = getenv("HPC_PROF_CSV");
+    const char *rank = getenv("OMPI_COMM_WORLD_RANK");
+
+    if ( hpc_prof_threads == NULL || hpc_prof_reported ) return;
+    hpc_prof_reported = 1;
+    if ( rank == NULL ) rank = getenv("PMI_RANK");
+    if ( rank == NULL ) rank = "0";
+
+    for (int t = 0; t < HPC_PROF_MAX_THREADS; t++) {
+        const hpc_prof_thread_t *th = &hpc_prof_threads[t];
+        for (int r = 0; r < th->nregions; r++) {
+            const hpc_prof_region_t *reg = &th->regions[r];
+            int m;
+            for (m = 0; m < nmerged && strcmp(merged[m].name, reg->name); m++) {
+                /* empty body */
+            }
+            if ( m == HPC_PROF_MAX_REGIONS ) {
+                /* more distinct names across threads than fit */
+                dropped++;
+                continue;
+            }
+            if ( m == nmerged ) {
+                merged[m] = *reg;
+                nthreads[m] = 1;
+                max_thread[m] = hpc_prof_sec(reg->total);
+                nmerged++;
+                continue;
+            }
+            merged[m].calls += reg->calls;
+            merged[m].total += reg->total;
+            merged[m].self += reg->self;
+            if ( reg->min < merged[m].min ) merged[m].min = reg->min;
+            if ( reg->max > merged[m].max ) merged[m].max = reg->max;
+            for (int c = 0; c < HPC_PROF_NCOUNTERS; c++) {
+                merged[m].counters[c] += reg->counters[c];
+            }
+            nthreads[m]++;
+            if ( hpc_prof_sec(reg->total) > max_thread[m] ) {
+                max_thread[m] = hpc_prof_sec(reg->total);
+            }
+        }
+    }
+
+    fprintf(stderr, "\n%-24s %3s %9s %12s %12s %12s %12s %7s",
+            "region", "thr", "calls", "total (s)", "self (s)", "avg (s)", "max (s)", "imbal");
+    if ( counters ) {
+        fprintf(stderr, " %14s %14s %6s %12s", "cycles", "instructions", "IPC", "LLC misses");
+    }
+    fprintf(stderr, "\n");
+    for (int m = 0; m < nmerged; m++) {
+        const hpc_prof_region_t *reg = &merged[m];
+        /* imbalance is the slowest thread over the average thread */
+        const double avg_thread = hpc_prof_sec(reg->total) / nthreads[m];
+        fprintf(stderr, "%*s%-*s %3d %9ld %12.6f %12.6f %12.6f %12.6f %7.3f",
+                2 * reg->depth, "", 24 - 2 * reg->depth, reg->name,
+                nthreads[m], reg->calls,
+                hpc_prof_sec(reg->total), hpc_prof_sec(reg->self),
+                hpc_prof_sec(reg->total) / reg->calls, hpc_prof_sec(reg->max),
+                avg_thread > 0.0 ? max_thread[m] / avg_thread : 1.0);
+        if ( counters ) {
+            const uint64_t *ctr = reg->counters;
+            fprintf(stderr, " %14llu %14llu %6.2f %12llu",
+                    (unsigned long long)ctr[HPC_PROF_CYCLES],
+                    (unsigned long long)ctr[HPC_PROF_INSTR],
+                    ctr[HPC_PROF_CYCLES] ? (double)ctr[HPC_PROF_INSTR] / ctr[HPC_PROF_CYCLES] : 0.0,
+                    (unsigned long long)ctr[HPC_PROF_LLC_MISSES]);
+        }
+        fprintf(stderr, "\n");
+    }
+    if ( dropped > 0 ) {
+        fprintf(stderr, "hpc_prof: %d regions exceed HPC_PROF_MAX_REGIONS and are not shown\n", dropped);
+    }
+
+    if ( csv_name != NULL && csv_name[0] != '\0' ) {
+        FILE *f = fopen(csv_name, "a");
+        if ( f == NULL ) {
+            fprintf(stderr, "hpc_prof: can not open \"%s\" for writing\n", csv_name);
+            return;
+        }
+        fseek(f, 0, SEEK_END);
+        if ( ftell(f) == 0 ) {
+            fprintf(f, "rank,thread,region,depth,calls,total,self,min,max,cycles,instructions,llc_misses\n");
+        }
+        for (int t = 0; t < HPC_PROF_MAX_THREADS; t++) {
+            const hpc_prof_thread_t *th = &hpc_prof_threads[t];
+            for (int r = 0; r < th->nregions; r++) {
+                const hpc_prof_region_t *reg = &th->regions[r];
+                fprintf(f, "%s,%d,\"%s\",%d,%ld,%.9f,%.9f,%.9f,%.9f,%llu,%llu,%llu\n",
+                        rank, t, reg->name, reg->depth, reg->calls,
+                        hpc_prof_sec(reg->total), hpc_prof_sec(reg->self),
+                        hpc_prof_sec(reg->min), hpc_prof_sec(reg->max),
+                        (unsigned long long)reg->counters[HPC_PROF_CYCLES],
+                        (unsigned long long)reg->counters[HPC_PROF_INSTR],
+                        (unsigned long long)reg->counters[HPC_PROF_LLC_MISSES]);
+            }
+        }
+        fclose(f);
+    }
+}
+
+/* Calibrate the TSC frequency against the wall clock */
+static inline void hpc_prof_calibrate( void )
+{
+#ifdef HPC_PROF_TSC
+    const double t0 = hpc_gettime();
+    const uint64_t c0 = __rdtsc();
+    while ( hpc_gettime() - t0 < 0.01 ) {
+        /* busy wait */
+    }
+    hpc_prof_ticks_per_sec = (double)(__rdtsc() - c0) / (hpc_gettime() - t0);
+#endif
+}
+
+/* Allocate the per-thread state and register the report at exit. This
+   is done by the first call to `hpc_prof_begin()`, possibly from
+   several threads at once: the first one does the work, and the
+   others wait for it in the critical section. Return the state. */
+static inline hpc_prof_thread_t *hpc_prof_init( void )
+{
+    hpc_prof_thread_t *threads;
+
+#ifdef _OPENMP
+#pragma omp critical(hpc_prof_init)
+#endif
+    {
+        if ( hpc_prof_threads == NULL ) {
+            threads = (hpc_prof_thread_t*)calloc(HPC_PROF_MAX_THREADS, sizeof(*threads));
+            if ( threads == NULL ) {
+                fprintf(stderr, "hpc_prof: can not allocate profiler state\n");
+                abort();
+            }
+            for (int i = 0; i < HPC_PROF_MAX_THREADS; i++) {
+                threads[i].perf_fd = -1;
+            }
+            hpc_prof_calibrate();
+            atexit(hpc_prof_report);
+            /* publish the state only when it is complete */
+#ifdef _OPENMP
+#pragma omp flush
+#pragma omp atomic write
+#endif
+            hpc_prof_threads = threads;
+        }
+        threads = hpc_prof_threads;
+    }
+    return threads;
+}
+
+static inline void hpc_prof_begin( const char *name )
+{
+    hpc_prof_thread_t *t;
+    hpc_prof_frame_t *frame;
+    int r;
+
+    /* Double-checked initialization: the pointer is read atomically,
+       and the flush orders the reads of the state after it (acquire),
+       so a non-NULL pointer always refers to the complete state. */
+#ifdef _OPENMP
+#pragma omp atomic read
+#endif
+    t = hpc_prof_threads;
+#ifdef _OPENMP
+#pragma omp flush
+#endif
+    if ( t == NULL ) {
+        t = hpc_prof_init();
+    }
+    t = &t[hpc_prof_thread_id()];
+    if ( t->depth >= HPC_PROF_MAX_DEPTH ) {
+        fprintf(stderr, "hpc_prof: region \"%s\" exceeds HPC_PROF_MAX_DEPTH\n", name);
+        abort();
+    }
+    for (r = 0; r < t->nregions && strcmp(t->regions[r].name, name); r++) {
+        /* empty body */
+    }
+    if ( r == t->nregions ) {
+        if ( r >= HPC_PROF_MAX_REGIONS ) {
+            fprintf(stderr, "hpc_prof: region \"%s\" exceeds HPC_PROF_MAX_REGIONS\n", name);
+            abort();
+        }
+        t->regions[r].name = name;
+        t->regions[r].depth = t->depth;
+        t->regions[r].min = UINT64_MAX;
+        t->nregions++;
+    }
+    frame = &t->stack[t->depth++];
+    frame->region = r;
+    frame->children = 0;
+    hpc_prof_read_counters(t, frame->counters);
+    frame->start = hpc_prof_ticks();
+}
+
+static inline void hpc_prof_end( const char *name )
+{
+    const uint64_t stop = hpc_prof_ticks();
+    hpc_prof_thread_t *t = &hpc_prof_threads[hpc_prof_thread_id()];
+    hpc_prof_frame_t *frame;
+    hpc_prof_region_t *reg;
+    uint64_t counters[HPC_PROF_NCOUNTERS];
+    uint64_t elapsed;
+
+    hpc_prof_read_counters(t, counters);
+    if ( t->depth == 0 || strcmp(t->regions[t->stack[t->depth - 1].region].name, name) ) {
+        fprintf(stderr, "hpc_prof: HPC_PROF_END(\"%s\") does not match the innermost open region\n", name);
+        abort();
+    }
+    frame = &t->stack[--t->depth];
+    reg = &t->regions[frame->region];
+    elapsed = stop - frame->start;
+    reg->calls++;
+    reg->total += elapsed;
+    reg->self += elapsed - frame->children;
+    if ( elapsed < reg->min ) reg->min = elapsed;
+    if ( elapsed > reg->max ) reg->max = elapsed;
+    for (int c = 0; c < HPC_PROF_NCOUNTERS; c++) {
+        reg->counters[c] += counters[c] - frame->counters[c];
+    }
+    if ( t->depth > 0 ) {
+        t->stack[t->depth - 1].children += elapsed;
+    }
+}
+
+#define HPC_PROF_BEGIN(name) hpc_prof_begin(name)
+#define HPC_PROF_END(name) hpc_prof_end(name)
+#define HPC_PROF_REPORT() hpc_prof_report()
+
+#else
+
+#define HPC_PROF_BEGIN(name) ((void)0)
+#define HPC_PROF_END(name) ((void)0)
+#define HPC_PROF_REPORT() ((void)0)
+
+#endif
+
 #ifdef __CUDACC__
 
 #include <stdio.h>
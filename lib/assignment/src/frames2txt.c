@@ -0,0 +1,145 @@
+/****************************************************************************
+ *
+ * frames2txt.c - Convert the snapshots saved by k-means into text files.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * --------------------------------------------------------------------------
+ *
+ * When compiled with `-DMAKE_MOVIE`, k-means writes the intermediate
+ * results into a binary file (see `save_snapshot()` in k-means.c).
+ * This program reads that file and writes, for each iteration, the
+ * files `centroids_XXX.txt` and `clusters_XXX.txt` expected by
+ * `generate_frames.sh`.
+ *
+ * To compile:
+ *
+ * gcc -std=c99 -Wall -Wpedantic frames2txt.c -o frames2txt
+ *
+ * To execute:
+ *
+ * ./frames2txt [frames_file [output_dir]]
+ *
+ * The defaults are "frames.bin" and the current directory.
+ *
+ ****************************************************************************/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Read `count` items of size `size` from `f`; abort on short reads,
+   since the file is either truncated or not a snapshot file. */
+void read_or_die(void* buf, size_t size, size_t count, FILE* f) {
+  if (fread(buf, size, count, f) != count) {
+    fprintf(stderr, "FATAL: truncated or invalid snapshot file\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+FILE* open_step_file(const char* dir, const char* prefix, int iter) {
+  char buf[1024];
+
+  snprintf(buf, sizeof(buf), "%s/%s_%03u.txt", dir, prefix, (unsigned)iter);
+  FILE* f = fopen(buf, "w");
+  if (f == NULL) {
+    fprintf(stderr, "FATAL: can not open file \"%s\" for writing\n", buf);
+    exit(EXIT_FAILURE);
+  }
+  return f;
+}
+
+int main(int argc, char* argv[]) {
+  const char* input = (argc > 1 ? argv[1] : "frames.bin");
+  const char* dir = (argc > 2 ? argv[2] : ".");
+  char magic[4];
+  int header[3];
+  int iter, n_changes;
+
+  if (argc > 3) {
+    fprintf(stderr, "Usage: %s [frames_file [output_dir]]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE* in = fopen(input, "rb");
+  if (in == NULL) {
+    fprintf(stderr, "FATAL: can not open input file \"%s\"\n", input);
+    return EXIT_FAILURE;
+  }
+
+  read_or_die(magic, 1, 4, in);
+  if (memcmp(magic, "KMF1", 4) != 0) {
+    fprintf(stderr, "FATAL: \"%s\" is not a snapshot file\n", input);
+    return EXIT_FAILURE;
+  }
+  read_or_die(header, sizeof(*header), 3, in);
+  const int n_points = header[0];
+  const int n_dims = header[1];
+  const int n_clusters = header[2];
+  assert(n_points > 0 && n_dims > 0 && n_clusters > 0);
+
+  float* data = (float*)malloc(n_points * n_dims * sizeof(*data));
+  float* centroids = (float*)malloc(n_clusters * n_dims * sizeof(*centroids));
+  int* cluster_of = (int*)malloc(n_points * sizeof(*cluster_of));
+  int* changes = (int*)malloc(2 * n_points * sizeof(*changes));
+  assert(data != NULL && centroids != NULL && cluster_of != NULL &&
+         changes != NULL);
+
+  read_or_die(data, sizeof(*data), n_points * n_dims, in);
+  for (int i = 0; i < n_points; i++) cluster_of[i] = -1;
+
+  int n_frames = 0;
+  while (fread(&iter, sizeof(iter), 1, in) == 1) {
+    read_or_die(&n_changes, sizeof(n_changes), 1, in);
+    assert(n_changes >= 0 && n_changes <= n_points);
+    read_or_die(centroids, sizeof(*centroids), n_clusters * n_dims, in);
+    read_or_die(changes, sizeof(*changes), 2 * n_changes, in);
+
+    /* apply the diff to the assignments of the previous frame */
+    for (int c = 0; c < n_changes; c++) {
+      const int i = changes[2 * c];
+      assert(i >= 0 && i < n_points);
+      cluster_of[i] = changes[2 * c + 1];
+    }
+
+    FILE* f = open_step_file(dir, "centroids", iter);
+    for (int j = 0; j < n_clusters; j++) {
+      for (int d = 0; d < n_dims; d++) {
+        fprintf(f, "%f ", centroids[j * n_dims + d]);
+      }
+      fprintf(f, "\n");
+    }
+    fclose(f);
+
+    f = open_step_file(dir, "clusters", iter);
+    for (int i = 0; i < n_points; i++) {
+      for (int d = 0; d < n_dims; d++) {
+        fprintf(f, "%f ", data[i * n_dims + d]);
+      }
+      fprintf(f, "%d\n", cluster_of[i]);
+    }
+    fclose(f);
+    n_frames++;
+  }
+
+  fprintf(stderr, "%d frames written to %s\n", n_frames, dir);
+
+  fclose(in);
+  free(data);
+  free(centroids);
+  free(cluster_of);
+  free(changes);
+  return EXIT_SUCCESS;
+}
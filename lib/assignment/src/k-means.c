@@ -22,7 +22,7 @@
  *
  * Compile with:
  *
- *      gcc -std=c99 -Wall -Wpedantic k-means.c -o k-means
+ *      gcc -std=c99 -Wall -Wpedantic -fopenmp k-means.c -o k-means
  *
  * Run with:
  *
@@ -32,14 +32,35 @@
  *
  *      ./k-means 5 demo.in demo.out
  *
+ * The order of the floating-point sums that update the centroids
+ * depends on the number of OpenMP threads; to get bitwise-identical
+ * centroids with any number of threads, set the environment variable
+ * `KMEANS_REPRODUCIBLE=1`:
+ *
+ *      KMEANS_REPRODUCIBLE=1 OMP_NUM_THREADS=8 ./k-means 5 demo.in demo.out
+ *
+ * To assign new points to the centroids found by a previous run,
+ * without running any iteration, use the prediction mode. The model
+ * is either the output file of a previous run, or the binary file
+ * written to the path in the environment variable `KMEANS_MODEL`;
+ * the new points are read in the same (dense) format as the input,
+ * and the ID of the nearest centroid of each of them is printed, one
+ * per row:
+ *
+ *      ./k-means predict demo.out new.in labels.txt
+ *      KMEANS_MODEL=demo.model ./k-means 5 demo.in demo.out
+ *      cat new.in | ./k-means predict demo.model > labels.txt
+ *
  * To generate a movie, you need gnuplot and ffmpeg (the following
  * commands will generate a lot of temporary files):
  *
  *      # compile enabling generation of intermediate results
- *      gcc -DMAKE_MOVIE -std=c99 -Wall -Wpedantic k-means.c -o k-means
- *      # run the program
+ *      gcc -DMAKE_MOVIE -std=c99 -Wall -Wpedantic -fopenmp -pthread
+ * k-means.c -o k-means
+ *      # run the program; intermediate results go to "frames.bin"
  *      ./k-means 5 demo.in demo.out
- *      # generate frames
+ *      # convert them to text files and generate frames
+ *      ./frames2txt frames.bin
  *      ./generate_frames.sh
  *      # assemble the frames to produce the file "demo.mp4"
  *      ffmpeg -pattern_type glob -stream_loop 5 -y -r 1 -i "img_*.png" -vcodec
@@ -57,6 +78,10 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef MAKE_MOVIE
+#include <pthread.h>
+#endif
 
 #include "hpc.h"
 
@@ -88,6 +113,50 @@ int* cluster_of; /* [array of length n_points] `clusters_of[i]`
                     i-th data point; cluster IDs are integer in
                     0..(n_clusters-1).                   */
 
+int sparse; /* nonzero if the input file is in sparse
+               format; in that case `data` is not used,
+               and the data points are stored in CSR
+               (compressed sparse row) form in `row_ptr`,
+               `col_idx` and `values`.               */
+
+int nnz; /* number of nonzero elements (sparse input).  */
+
+int* row_ptr; /* [array of length (n_points + 1)] the
+                 nonzero elements of the i-th data point
+                 are at positions `row_ptr[i]` to
+                 `row_ptr[i+1] - 1` of `col_idx` and
+                 `values`.                            */
+
+int* col_idx; /* [array of length nnz] dimension of each
+                 nonzero element.                     */
+
+float* values; /* [array of length nnz] value of each
+                  nonzero element.                    */
+
+float* point_sqnorm; /* [array of length n_points] squared norm
+                        of each data point (sparse input). */
+
+float* centroid_sqnorm; /* [array of length n_clusters] squared
+                           norm of each centroid (sparse
+                           input).                        */
+
+int reproducible; /* nonzero if the centroids must be
+                     bitwise identical regardless of the
+                     number of threads; set from the
+                     environment variable
+                     `KMEANS_REPRODUCIBLE`.                */
+
+int block_len; /* number of consecutive points summed
+                  sequentially by each block of the
+                  reproducible reduction.                */
+
+int n_blocks; /* number of blocks of the reproducible
+                 reduction.                             */
+
+float* block_sums; /* [array of length (n_blocks * n_clusters *
+                      n_dims)] partial sums of each block
+                      (reproducible reduction).         */
+
 /* A safe version of `malloc()` that aborts if memory allocation
    fails. */
 void* safe_malloc(size_t size) {
@@ -124,8 +193,9 @@ void vcopy(float* p1, const float* p2) {
 }
 
 /* Compute the Euclidean squared distance of `p1` and `p2`. */
-float sqdist(float* p1, float* p2) {
+float sqdist(const float* p1, const float* p2) {
   float result = 0.0;
+#pragma omp simd reduction(+ : result)
   for (int d = 0; d < n_dims; d++) {
     result += (p1[d] - p2[d]) * (p1[d] - p2[d]);
   }
@@ -145,6 +215,59 @@ float sqdist(float* p1, float* p2) {
    `data[i*n_dims + d]`. */
 int IDX(int i, int d) { return i * n_dims + d; }
 
+/******************************************************************************
+ **
+ ** Functions that operate on sparse data points. The squared distance
+ ** between a point and a centroid is computed as |p|^2 - 2 p.c + |c|^2,
+ ** where the squared norms are precomputed, so that the cost only
+ ** depends on the number of nonzero elements of the point.
+ **
+ ******************************************************************************/
+
+/* Expand the sparse point `i` into the dense vector `p` of size
+   `n_dims`. */
+void sparse_to_dense(float* p, int i) {
+  vzero(p);
+  for (int k = row_ptr[i]; k < row_ptr[i + 1]; k++) p[col_idx[k]] = values[k];
+}
+
+/* Compute the dot product of the sparse point `i` and the dense
+   vector `p`. */
+float sparse_dot(int i, const float* p) {
+  float result = 0.0f;
+  for (int k = row_ptr[i]; k < row_ptr[i + 1]; k++) {
+    result += values[k] * p[col_idx[k]];
+  }
+  return result;
+}
+
+/* Compute the squared distance of the sparse point `i` and the
+   centroid `j`. The result can be slightly negative due to rounding;
+   this does not matter, since it is only compared with other
+   distances. */
+float sparse_sqdist(int i, int j) {
+  return point_sqnorm[i] - 2.0f * sparse_dot(i, &centroids[IDX(j, 0)]) +
+         centroid_sqnorm[j];
+}
+
+/* Add the sparse point `i` to the dense vector `p`. */
+void sparse_vadd(float* p, int i) {
+  for (int k = row_ptr[i]; k < row_ptr[i + 1]; k++) {
+    p[col_idx[k]] += values[k];
+  }
+}
+
+/* Recompute `centroid_sqnorm` after the centroids change. */
+void update_centroid_sqnorms(void) {
+  for (int j = 0; j < n_clusters; j++) {
+    float norm = 0.0f;
+    for (int d = 0; d < n_dims; d++) {
+      norm += centroids[IDX(j, d)] * centroids[IDX(j, d)];
+    }
+    centroid_sqnorm[j] = norm;
+  }
+}
+
 /* Return a random integer in a..b. This function must not be
    parallelized, since `rand()` is not thread-safe. */
 int randab(int a, int b) { return a + rand() % (b - a + 1); }
@@ -162,30 +285,65 @@ void init_centroids(void) {
     if ((rand() % remaining) < select) {
       select--;
       /* Select point `i` as one of the centroids. */
-      vcopy(&centroids[IDX(select, 0)], &data[IDX(i, 0)]);
+      if (sparse) {
+        sparse_to_dense(&centroids[IDX(select, 0)], i);
+      } else {
+        vcopy(&centroids[IDX(select, 0)], &data[IDX(i, 0)]);
+      }
     }
     remaining--;
   }
 }
 
-/* Assign each data point to the nearest centroid. Updates
-   the `counts` array. */
-void classify(void) {
-  for (int j = 0; j < n_clusters; j++) {
-    counts[j] = 0;
-  }
-
+/* Same as `classify()`, for sparse input. The `counts` array must
+   be zeroed by the caller. */
+void classify_sparse(void) {
+#pragma omp parallel for reduction(+ : counts[:n_clusters])
   for (int i = 0; i < n_points; i++) {
-    /* Index and squared distance of the nearest centroid. */
     int nearest = 0;
-    float mindist = sqdist(&data[IDX(i, 0)], &centroids[IDX(nearest, 0)]);
+    float mindist = sparse_sqdist(i, nearest);
     for (int j = 1; j < n_clusters; j++) {
-      const float dist = sqdist(&data[IDX(i, 0)], &centroids[IDX(j, 0)]);
+      const float dist = sparse_sqdist(i, j);
       if (dist < mindist) {
         mindist = dist;
         nearest = j;
       }
     }
+    cluster_of[i] = nearest;
+    counts[nearest]++;
+  }
+}
+
+/* Return the index of the centroid nearest to the point `p`. This
+   is the assignment kernel shared by training and prediction. */
+int nearest_centroid(const float* p) {
+  int nearest = 0;
+  float mindist = sqdist(p, &centroids[IDX(nearest, 0)]);
+  for (int j = 1; j < n_clusters; j++) {
+    const float dist = sqdist(p, &centroids[IDX(j, 0)]);
+    if (dist < mindist) {
+      mindist = dist;
+      nearest = j;
+    }
+  }
+  return nearest;
+}
+
+/* Assign each data point to the nearest centroid. Updates
+   the `counts` array. */
+void classify(void) {
+  for (int j = 0; j < n_clusters; j++) {
+    counts[j] = 0;
+  }
+
+  if (sparse) {
+    classify_sparse();
+    return;
+  }
+
+#pragma omp parallel for reduction(+ : counts[:n_clusters])
+  for (int i = 0; i < n_points; i++) {
+    const int nearest = nearest_centroid(&data[IDX(i, 0)]);
     /* assign the point to the nearest centroid, and update the
        cluster size. */
     cluster_of[i] = nearest;
@@ -193,17 +351,99 @@ void classify(void) {
   }
 }
 
+/* Add data point `i` to the sum of its cluster in `sums`, which has
+   the same layout as `centroids`. */
+void accumulate_point(float* sums, int i) {
+  float* p = &sums[IDX(cluster_of[i], 0)];
+  if (sparse) {
+    sparse_vadd(p, i);
+  } else {
+    vadd(p, &data[IDX(i, 0)]);
+  }
+}
+
+/* Blocks of the reproducible reduction: at least
+   `REPRO_MIN_BLOCK_LEN` points each, and at most `REPRO_MAX_BLOCKS`
+   blocks; there are also fewer blocks when the centroids are large,
+   so that `block_sums` takes at most about `REPRO_MAX_BYTES` bytes
+   (but always at least one block). The layout only depends on
+   `n_points`, `n_clusters` and `n_dims`. */
+#define REPRO_MIN_BLOCK_LEN 4096
+#define REPRO_MAX_BLOCKS 256
+#define REPRO_MAX_BYTES (64 << 20)
+
+void init_reproducible(void) {
+  const size_t size = (size_t)n_clusters * n_dims * sizeof(*block_sums);
+  int max_blocks = REPRO_MAX_BLOCKS;
+  if ((size_t)max_blocks * size > REPRO_MAX_BYTES) {
+    max_blocks = (size < REPRO_MAX_BYTES ? REPRO_MAX_BYTES / size : 1);
+  }
+  block_len = (n_points + max_blocks - 1) / max_blocks;
+  if (block_len < REPRO_MIN_BLOCK_LEN) block_len = REPRO_MIN_BLOCK_LEN;
+  n_blocks = (n_points + block_len - 1) / block_len;
+  block_sums = (float*)safe_malloc((size_t)n_blocks * n_clusters * n_dims *
+                                   sizeof(*block_sums));
+}
+
+/* Sum the points of each cluster into `new_centroids` in an order
+   that does not depend on the number of threads nor on the
+   schedule: every block sums its points sequentially, then the
+   partial sums are combined with a pairwise tree whose shape only
+   depends on `n_blocks`. */
+void accumulate_reproducible(void) {
+  const int size = n_clusters * n_dims;
+
+#pragma omp parallel for schedule(dynamic)
+  for (int b = 0; b < n_blocks; b++) {
+    float* sums = &block_sums[(size_t)b * size];
+    const int end = (b + 1) * block_len < n_points ? (b + 1) * block_len
+                                                   : n_points;
+    for (int k = 0; k < size; k++) sums[k] = 0.0f;
+    for (int i = b * block_len; i < end; i++) accumulate_point(sums, i);
+  }
+
+  for (int stride = 1; stride < n_blocks; stride *= 2) {
+#pragma omp parallel for collapse(2)
+    for (int b = 0; b < n_blocks - stride; b += 2 * stride) {
+      for (int k = 0; k < size; k++) {
+        block_sums[(size_t)b * size + k] +=
+            block_sums[(size_t)(b + stride) * size + k];
+      }
+    }
+  }
+
+  memcpy(new_centroids, block_sums, size * sizeof(*new_centroids));
+}
+
 /* Update the centroids. Set the centroid of each cluster to the
    barycenter of the points. Returns the maximum shift, i.e., the
    maximum difference between the (squared) old and new position of
    all centroids. */
 float update_centroids(void) {
-  for (int j = 0; j < n_clusters; j++) {
-    vzero(&new_centroids[IDX(j, 0)]);
-  }
+  if (reproducible) {
+    accumulate_reproducible();
+  } else {
+    const size_t size = (size_t)n_clusters * n_dims;
+    for (int j = 0; j < n_clusters; j++) {
+      vzero(&new_centroids[IDX(j, 0)]);
+    }
 
-  for (int i = 0; i < n_points; i++) {
-    vadd(&new_centroids[IDX(cluster_of[i], 0)], &data[IDX(i, 0)]);
+    /* Each thread sums its points into a private copy of the
+       centroids, that is allocated on the heap: an array reduction
+       clause could place the copies on the (much smaller) stack of
+       the threads. */
+#pragma omp parallel
+    {
+      float* sums = (float*)safe_malloc(size * sizeof(*sums));
+      for (size_t k = 0; k < size; k++) sums[k] = 0.0f;
+#pragma omp for nowait
+      for (int i = 0; i < n_points; i++) {
+        accumulate_point(sums, i);
+      }
+#pragma omp critical
+      for (size_t k = 0; k < size; k++) new_centroids[k] += sums[k];
+      free(sums);
+    }
   }
 
   float maxsqshift = 0.0f;
@@ -221,6 +461,8 @@ float update_centroids(void) {
     vcopy(&centroids[IDX(j, 0)], &new_centroids[IDX(j, 0)]);
   }
 
+  if (sparse) update_centroid_sqnorms();
+
   return maxsqshift;
 }
 
@@ -230,10 +472,87 @@ float update_centroids(void) {
  **
  ******************************************************************************/
 
+/* Read sparse input data from `f`. Each row contains a data point as
+   a list of `dim:value` pairs separated by blanks, where `dim` is a
+   0-based dimension index; the omitted dimensions are zero, so
+   a data point with no nonzero elements must be written e.g. as
+   `0:0`. Blank lines are ignored. `n_dims` is set to the largest
+   index found plus one. */
+void read_sparse_input(FILE* f) {
+  /* Read the whole file at once, since rows can be arbitrarily
+     long. */
+  fseek(f, 0, SEEK_END);
+  const long size = ftell(f);
+  assert(size >= 0);
+  rewind(f);
+  char* buf = (char*)safe_malloc(size + 1);
+  const size_t nread = fread(buf, 1, size, f);
+  assert(nread == (size_t)size);
+  buf[size] = '\0';
+
+  /* Count rows and nonzero elements. */
+  n_points = nnz = 0;
+  int blank = 1;
+  for (long c = 0; c < size; c++) {
+    if (buf[c] == ':') nnz++;
+    if (buf[c] == '\n') {
+      n_points += !blank;
+      blank = 1;
+    } else if (buf[c] != ' ' && buf[c] != '\t' && buf[c] != '\r') {
+      blank = 0;
+    }
+  }
+  n_points += !blank;
+
+  row_ptr = (int*)safe_malloc((n_points + 1) * sizeof(*row_ptr));
+  col_idx = (int*)safe_malloc(nnz * sizeof(*col_idx));
+  values = (float*)safe_malloc(nnz * sizeof(*values));
+
+  /* Parse the actual data. */
+  n_dims = 0;
+  int i = 0, k = 0;
+  char* p = buf;
+  row_ptr[0] = 0;
+  while (*p != '\0') {
+    while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+    if (*p == '\n' || *p == '\0') {
+      if (k > row_ptr[i]) row_ptr[++i] = k;
+      if (*p == '\n') p++;
+      continue;
+    }
+    char* end;
+    const long d = strtol(p, &end, 10);
+    assert(end != p && *end == ':' && d >= 0); /* If this assertion
+                                                  fails, the input
+                                                  is malformed. */
+    p = end + 1;
+    values[k] = strtof(p, &end);
+    assert(end != p);
+    p = end;
+    col_idx[k++] = (int)d;
+    if (d >= n_dims) n_dims = (int)d + 1;
+  }
+  if (k > row_ptr[i]) row_ptr[++i] = k;
+  assert(i == n_points && k == nnz);
+  free(buf);
+
+  point_sqnorm = (float*)safe_malloc(n_points * sizeof(*point_sqnorm));
+  for (i = 0; i < n_points; i++) {
+    float norm = 0.0f;
+    for (k = row_ptr[i]; k < row_ptr[i + 1]; k++) {
+      norm += values[k] * values[k];
+    }
+    point_sqnorm[i] = norm;
+  }
+}
+
 /* Read the input data from `f`. Each row must contain `n_dims`
    numbers. This function figures out how many numbers are in a row,
    and how many rows there are. Then, it initializes the variables
-   `n_dims` and `n_points` accordingly. */
+   `n_dims` and `n_points` accordingly.
+
+   If the first row contains a colon, the input is read in sparse
+   format instead; see `read_sparse_input()`. */
 void read_input(FILE* f) {
   const size_t BUFLEN = 1024;
   char buffer[BUFLEN];
@@ -245,6 +564,11 @@ void read_input(FILE* f) {
      fields will be computed incorrectly. */
   char* i_dont_care = fgets(buffer, BUFLEN, f);
   (void)i_dont_care; /* Avoid a compiler warning. */
+  if (strchr(buffer, ':') != NULL) {
+    sparse = 1;
+    read_sparse_input(f);
+    return;
+  }
   n_dims = -1;
   char *start, *end = buffer;
   do {
@@ -283,56 +607,168 @@ void read_input(FILE* f) {
 
 #ifdef MAKE_MOVIE
 
-/* Save the intermediate coordinates of the centroids into a
-   file. This function is useful for generating a movie showing how
-   the centroids get updated. DO NOT use this function when measuring
-   execution times.
-
-   This function is enabled by defining `MAKE_MOVIE` at compilation
-   time. */
-void save_centroids(int iter) {
-  char buf[1024];
-
-  snprintf(buf, sizeof(buf), "centroids_%03u.txt", (unsigned)iter);
-  FILE* f = fopen(buf, "w");
-  assert(f != NULL);
-  if (f == NULL) {
-    fprintf(stderr, "FATAL: can not open file \"%s\" for writing\n", buf);
+/* Intermediate results are saved by a background thread into a
+   compact binary file, so that the main loop only pays for copying
+   the centroids and the cluster assignments that changed. The file
+   contains a header followed by one frame per iteration:
+
+   header: "KMF1" n_points n_dims n_clusters data[n_points * n_dims]
+   frame:  iter n_changes centroids[n_clusters * n_dims]
+           (point, cluster)[n_changes]
+
+   All integers are 32-bit and all values are stored in native byte
+   order. `cluster_of` is stored as a diff against the previous frame;
+   the first frame lists every point. Use `frames2txt` to convert the
+   file into the text files expected by `generate_frames.sh`.
+
+   This is enabled by defining `MAKE_MOVIE` at compilation time. */
+
+#define SNAPSHOT_FILE "frames.bin"
+#define SNAPSHOT_QUEUE_LEN 8
+
+typedef struct {
+  int iter;
+  int n_changes;
+  int capacity;    /* length of `changes`, in (point, cluster) pairs */
+  float* centroids; /* [array of length (n_clusters * n_dims)] */
+  int* changes;     /* [array of length (2 * capacity)] */
+} frame_t;
+
+/* Bounded queue of frames. The main thread fills the slot after the
+   last one and the writer thread empties the first one; each slot
+   is only accessed by one thread at a time, so the lock only
+   protects `q_head`, `q_count` and `q_done`. */
+frame_t q_frames[SNAPSHOT_QUEUE_LEN];
+int q_head = 0, q_count = 0, q_done = 0;
+pthread_mutex_t q_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t q_not_empty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t q_not_full = PTHREAD_COND_INITIALIZER;
+
+pthread_t snapshot_writer;
+FILE* snapshot_file;
+int* prev_cluster_of; /* [array of length n_points] */
+
+void snapshot_write(const void* buf, size_t size, size_t count) {
+  if (fwrite(buf, size, count, snapshot_file) != count) {
+    fprintf(stderr, "FATAL: can not write file \"%s\"\n", SNAPSHOT_FILE);
     exit(EXIT_FAILURE);
   }
-  for (int j = 0; j < n_clusters; j++) {
-    for (int d = 0; d < n_dims; d++) {
-      fprintf(f, "%f ", centroids[IDX(j, d)]);
+}
+
+void* snapshot_writer_main(void* arg) {
+  (void)arg;
+  while (1) {
+    pthread_mutex_lock(&q_lock);
+    while (q_count == 0 && !q_done) pthread_cond_wait(&q_not_empty, &q_lock);
+    if (q_count == 0) {
+      pthread_mutex_unlock(&q_lock);
+      break;
     }
-    fprintf(f, "\n");
+    frame_t* fr = &q_frames[q_head];
+    pthread_mutex_unlock(&q_lock);
+
+    snapshot_write(&fr->iter, sizeof(fr->iter), 1);
+    snapshot_write(&fr->n_changes, sizeof(fr->n_changes), 1);
+    snapshot_write(fr->centroids, sizeof(*fr->centroids), n_clusters * n_dims);
+    snapshot_write(fr->changes, sizeof(*fr->changes), 2 * fr->n_changes);
+
+    pthread_mutex_lock(&q_lock);
+    q_head = (q_head + 1) % SNAPSHOT_QUEUE_LEN;
+    q_count--;
+    pthread_cond_signal(&q_not_full);
+    pthread_mutex_unlock(&q_lock);
   }
-  fclose(f);
+  return NULL;
 }
 
-/* Save the intermediate coordinates of the points and their clusters
-   into a file. This function is useful for generating a movie showing
-   how the centroids get updated, otherwise it can be omitted. DO NOT
-   use this function when measuring execution times.
-
-   This function is enabled by defining `MAKE_MOVIE` at compilation
-   time.
-*/
-void save_clusters(int iter) {
-  char buf[1024];
+/* Create the snapshot file, write the header and start the writer
+   thread. Must be called after `read_input()`. */
+void snapshot_open(void) {
+  const int header[3] = {n_points, n_dims, n_clusters};
 
-  snprintf(buf, sizeof(buf), "clusters_%03u.txt", (unsigned)iter);
-  FILE* f = fopen(buf, "w");
-  if (f == NULL) {
-    fprintf(stderr, "FATAL: can not open file \"%s\" for writing\n", buf);
+  if ((snapshot_file = fopen(SNAPSHOT_FILE, "wb")) == NULL) {
+    fprintf(stderr, "FATAL: can not open file \"%s\" for writing\n",
+            SNAPSHOT_FILE);
     exit(EXIT_FAILURE);
   }
+  snapshot_write("KMF1", 1, 4);
+  snapshot_write(header, sizeof(*header), 3);
+  if (sparse) {
+    /* frames store dense points, as expected by `frames2txt` */
+    float* p = (float*)safe_malloc(n_dims * sizeof(*p));
+    for (int i = 0; i < n_points; i++) {
+      sparse_to_dense(p, i);
+      snapshot_write(p, sizeof(*p), n_dims);
+    }
+    free(p);
+  } else {
+    snapshot_write(data, sizeof(*data), n_points * n_dims);
+  }
+
+  prev_cluster_of = (int*)safe_malloc(n_points * sizeof(*prev_cluster_of));
+  for (int i = 0; i < n_points; i++) prev_cluster_of[i] = -1;
+  for (int s = 0; s < SNAPSHOT_QUEUE_LEN; s++) {
+    q_frames[s].centroids =
+        (float*)safe_malloc(n_clusters * n_dims * sizeof(float));
+    q_frames[s].changes = NULL;
+    q_frames[s].capacity = 0;
+  }
+  const int err = pthread_create(&snapshot_writer, NULL, snapshot_writer_main,
+                                 NULL);
+  assert(err == 0);
+  (void)err;
+}
+
+/* Enqueue the current centroids and cluster assignments; blocks only
+   if the writer thread is `SNAPSHOT_QUEUE_LEN` frames behind. */
+void save_snapshot(int iter) {
+  pthread_mutex_lock(&q_lock);
+  while (q_count == SNAPSHOT_QUEUE_LEN) pthread_cond_wait(&q_not_full, &q_lock);
+  frame_t* fr = &q_frames[(q_head + q_count) % SNAPSHOT_QUEUE_LEN];
+  pthread_mutex_unlock(&q_lock);
+
+  fr->iter = iter;
+  memcpy(fr->centroids, centroids, n_clusters * n_dims * sizeof(*centroids));
+  fr->n_changes = 0;
   for (int i = 0; i < n_points; i++) {
-    for (int d = 0; d < n_dims; d++) {
-      fprintf(f, "%f ", data[IDX(i, d)]);
+    if (cluster_of[i] != prev_cluster_of[i]) {
+      if (fr->n_changes == fr->capacity) {
+        /* slots are reused, so this only happens in the first
+           iterations, when most points change cluster */
+        fr->capacity = fr->capacity ? 2 * fr->capacity : 1024;
+        if (fr->capacity > n_points) fr->capacity = n_points;
+        fr->changes = (int*)realloc(fr->changes,
+                                    2 * fr->capacity * sizeof(*fr->changes));
+        assert(fr->changes != NULL);
+      }
+      fr->changes[2 * fr->n_changes] = i;
+      fr->changes[2 * fr->n_changes + 1] = cluster_of[i];
+      fr->n_changes++;
+      prev_cluster_of[i] = cluster_of[i];
     }
-    fprintf(f, "%d\n", cluster_of[i]);
   }
-  fclose(f);
+
+  pthread_mutex_lock(&q_lock);
+  q_count++;
+  pthread_cond_signal(&q_not_empty);
+  pthread_mutex_unlock(&q_lock);
+}
+
+/* Wait for the writer thread to flush all pending frames, then close
+   the snapshot file. */
+void snapshot_close(void) {
+  pthread_mutex_lock(&q_lock);
+  q_done = 1;
+  pthread_cond_signal(&q_not_empty);
+  pthread_mutex_unlock(&q_lock);
+  pthread_join(snapshot_writer, NULL);
+
+  fclose(snapshot_file);
+  for (int s = 0; s < SNAPSHOT_QUEUE_LEN; s++) {
+    free(q_frames[s].centroids);
+    free(q_frames[s].changes);
+  }
+  free(prev_cluster_of);
 }
 
 #endif
@@ -350,13 +786,288 @@ void save_results(FILE* f) {
   }
   fprintf(f, "#\n");
   for (int i = 0; i < n_points; i++) {
-    for (int d = 0; d < n_dims; d++) {
-      fprintf(f, "%f ", data[IDX(i, d)]);
+    if (sparse) {
+      for (int k = row_ptr[i]; k < row_ptr[i + 1]; k++) {
+        fprintf(f, "%d:%f ", col_idx[k], values[k]);
+      }
+    } else {
+      for (int d = 0; d < n_dims; d++) {
+        fprintf(f, "%f ", data[IDX(i, d)]);
+      }
     }
     fprintf(f, "%d\n", cluster_of[i]);
   }
 }
 
+/******************************************************************************
+ **
+ ** Prediction mode: assign new data points to the centroids of a
+ ** previously computed model, without running any iteration.
+ **
+ ******************************************************************************/
+
+/* Write the centroids into the binary model file `path`. The file
+   contains "KMM1" n_clusters n_dims centroids[n_clusters * n_dims],
+   with 32-bit integers and floats in native byte order. */
+void save_model(const char* path) {
+  const int header[2] = {n_clusters, n_dims};
+  FILE* f = fopen(path, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "FATAL: can not create model file \"%s\"\n", path);
+    exit(EXIT_FAILURE);
+  }
+  if (fwrite("KMM1", 1, 4, f) != 4 ||
+      fwrite(header, sizeof(*header), 2, f) != 2 ||
+      fwrite(centroids, sizeof(*centroids), n_clusters * n_dims, f) !=
+          (size_t)(n_clusters * n_dims)) {
+    fprintf(stderr, "FATAL: can not write model file \"%s\"\n", path);
+    exit(EXIT_FAILURE);
+  }
+  fclose(f);
+}
+
+/* Read a whole line of `f` into `*buf`, whose size `*buflen` is
+   doubled as needed, so that lines of any length (e.g., the centroids
+   of sparse data with many dimensions) are read in one piece. Return
+   `*buf`, or NULL at the end of file. */
+char* read_line(FILE* f, char** buf, size_t* buflen) {
+  size_t len = 0;
+  while (fgets(*buf + len, *buflen - len, f) != NULL) {
+    len += strlen(*buf + len);
+    if (len > 0 && (*buf)[len - 1] == '\n') break;
+    if (len + 1 == *buflen) {
+      *buflen *= 2;
+      *buf = (char*)realloc(*buf, *buflen);
+      assert(*buf != NULL);
+    }
+  }
+  return (len > 0 ? *buf : NULL);
+}
+
+/* Load the centroids from `path`, which is either a binary model
+   written by `save_model()` or an output file of this program, in
+   which case the `# Centroids:` header is parsed. Sets `n_clusters`,
+   `n_dims` and `centroids`. */
+void load_model(const char* path) {
+  size_t buflen = 1 << 16;
+  char* buffer = (char*)safe_malloc(buflen);
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "FATAL: can not open model file \"%s\"\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  if (fread(buffer, 1, 4, f) == 4 && memcmp(buffer, "KMM1", 4) == 0) {
+    int header[2];
+    if (fread(header, sizeof(*header), 2, f) != 2 || header[0] <= 0 ||
+        header[1] <= 0) {
+      fprintf(stderr, "FATAL: invalid model file \"%s\"\n", path);
+      exit(EXIT_FAILURE);
+    }
+    n_clusters = header[0];
+    n_dims = header[1];
+    centroids =
+        (float*)safe_malloc(n_clusters * n_dims * sizeof(*centroids));
+    if (fread(centroids, sizeof(*centroids), n_clusters * n_dims, f) !=
+        (size_t)(n_clusters * n_dims)) {
+      fprintf(stderr, "FATAL: truncated model file \"%s\"\n", path);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    /* Text output: the "# Dimensions:" and "# Clusters:" lines come
+       first, followed by one "# j : x y z ..." line per centroid. */
+    rewind(f);
+    n_dims = n_clusters = 0;
+    int j = 0;
+    while (read_line(f, &buffer, &buflen) != NULL && buffer[0] == '#') {
+      int id, pos;
+      if (sscanf(buffer, "# Dimensions: %d", &n_dims) == 1 ||
+          sscanf(buffer, "# Clusters: %d", &n_clusters) == 1) {
+        if (n_dims > 0 && n_clusters > 0) {
+          centroids =
+              (float*)safe_malloc(n_clusters * n_dims * sizeof(*centroids));
+        }
+      } else if (sscanf(buffer, "# %d :%n", &id, &pos) == 1) {
+        if (centroids == NULL || id != j || j >= n_clusters) {
+          fprintf(
+              stderr,
+              "FATAL: unexpected centroid %d in \"%s\"\n",
+              id,
+              path
+          );
+          exit(EXIT_FAILURE);
+        }
+        char* p = buffer + pos;
+        for (int d = 0; d < n_dims; d++) {
+          char* end;
+          centroids[IDX(j, d)] = strtof(p, &end);
+          if (end == p) {
+            fprintf(
+                stderr,
+                "FATAL: centroid %d in \"%s\" has %d coordinates "
+                "instead of %d\n",
+                j,
+                path,
+                d,
+                n_dims
+            );
+            exit(EXIT_FAILURE);
+          }
+          p = end;
+        }
+        j++;
+      }
+    }
+    if (centroids == NULL || j != n_clusters) {
+      fprintf(stderr, "FATAL: no centroids found in \"%s\"\n", path);
+      exit(EXIT_FAILURE);
+    }
+  }
+  fclose(f);
+  free(buffer);
+}
+
+/* Size of the blocks of input read at once by `predict()`. */
+#define PREDICT_BLOCK_LEN (16 << 20)
+
+/* Read dense data points from `in`, one per row as in the input of
+   the training, and write the ID of the nearest centroid of each of
+   them to `out`, one per row. The input is processed in blocks: the
+   row boundaries of each block are located sequentially, then the
+   rows are parsed and classified in parallel. */
+void predict(FILE* in, FILE* out) {
+  char* buf = (char*)safe_malloc(PREDICT_BLOCK_LEN + 1);
+  /* each row takes at least two characters, e.g. "1\n" */
+  const int max_rows = PREDICT_BLOCK_LEN / 2 + 1;
+  int* row_start = (int*)safe_malloc(max_rows * sizeof(*row_start));
+  int* labels = (int*)safe_malloc(max_rows * sizeof(*labels));
+  char* outbuf = (char*)safe_malloc((size_t)max_rows * 12);
+  size_t len = 0;
+  long total_rows = 0, total_bytes = 0;
+  int eof = 0;
+
+  const double tstart = hpc_gettime();
+  while (!eof) {
+    len += fread(buf + len, 1, PREDICT_BLOCK_LEN - len, in);
+    eof = feof(in);
+    if (eof && len > 0 && buf[len - 1] != '\n') buf[len++] = '\n';
+
+    /* Find the rows that are complete in this block, skipping empty
+       ones; the last, incomplete row is moved to the next block. */
+    int n_rows = 0;
+    size_t used = 0;
+    for (char* nl; (nl = memchr(buf + used, '\n', len - used)) != NULL;) {
+      const size_t next = nl - buf + 1;
+      if (next - used > 1 && !(next - used == 2 && buf[used] == '\r')) {
+        row_start[n_rows++] = (int)used;
+      }
+      used = next;
+    }
+    if (used == 0 && len == PREDICT_BLOCK_LEN) {
+      fprintf(stderr, "FATAL: input row longer than %d bytes\n",
+              PREDICT_BLOCK_LEN);
+      exit(EXIT_FAILURE);
+    }
+
+    int bad_row = -1;
+#pragma omp parallel
+    {
+      float* p = (float*)safe_malloc(n_dims * sizeof(*p));
+#pragma omp for schedule(static)
+      for (int r = 0; r < n_rows; r++) {
+        char* pos = buf + row_start[r];
+        int ok = 1;
+        for (int d = 0; d < n_dims && ok; d++) {
+          char* end;
+          p[d] = strtof(pos, &end);
+          ok = (end != pos);
+          pos = end;
+        }
+        if (ok) {
+          labels[r] = nearest_centroid(p);
+        } else {
+#pragma omp critical
+          if (bad_row < 0 || r < bad_row) bad_row = r;
+        }
+      }
+      free(p);
+    }
+    if (bad_row >= 0) {
+      fprintf(stderr, "FATAL: row %ld has less than %d values\n",
+              total_rows + bad_row + 1, n_dims);
+      exit(EXIT_FAILURE);
+    }
+
+    /* Format the labels by hand, since `fprintf()` on every row
+       would dominate the running time. */
+    char* o = outbuf;
+    for (int r = 0; r < n_rows; r++) {
+      char digits[12];
+      int nd = 0;
+      unsigned v = (unsigned)labels[r];
+      do {
+        digits[nd++] = (char)('0' + v % 10);
+        v /= 10;
+      } while (v > 0);
+      while (nd > 0) *o++ = digits[--nd];
+      *o++ = '\n';
+    }
+    if (fwrite(outbuf, 1, o - outbuf, out) != (size_t)(o - outbuf)) {
+      fprintf(stderr, "FATAL: can not write the output\n");
+      exit(EXIT_FAILURE);
+    }
+
+    total_rows += n_rows;
+    total_bytes += used;
+    memmove(buf, buf + used, len - used);
+    len -= used;
+  }
+  const double elapsed = hpc_gettime() - tstart;
+
+  fprintf(stderr, "Classified %ld points in %.3f s (%.1f MB/s)\n", total_rows,
+          elapsed, total_bytes / elapsed / 1e6);
+
+  free(buf);
+  free(row_start);
+  free(labels);
+  free(outbuf);
+}
+
+/* Entry point of `./k-means predict model_file [input_file
+   [output_file]]`; a missing file name or "-" means standard input
+   or output. */
+int predict_main(int argc, char* argv[]) {
+  FILE *inputf = stdin, *outputf = stdout;
+
+  if (argc < 3 || argc > 5) {
+    fprintf(stderr, "Usage: %s predict model_file [input_file [output_file]]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  load_model(argv[2]);
+
+  if (argc > 3 && strcmp(argv[3], "-") != 0 &&
+      (inputf = fopen(argv[3], "r")) == NULL) {
+    fprintf(stderr, "FATAL: can not open input file \"%s\"\n", argv[3]);
+    return EXIT_FAILURE;
+  }
+  if (argc > 4 && strcmp(argv[4], "-") != 0 &&
+      (outputf = fopen(argv[4], "w")) == NULL) {
+    fprintf(stderr, "FATAL: can not create output file \"%s\"\n", argv[4]);
+    return EXIT_FAILURE;
+  }
+
+  fprintf(stderr, "Model............ %s (K = %d, D = %d)\n", argv[2],
+          n_clusters, n_dims);
+  predict(inputf, outputf);
+
+  if (inputf != stdin) fclose(inputf);
+  if (outputf != stdout) fclose(outputf);
+  free(centroids);
+  return EXIT_SUCCESS;
+}
+
 /******************************************************************************
  **
  ** Main program.
@@ -367,13 +1078,22 @@ int main(int argc, char* argv[]) {
   const int MAXITER = 100;
   const float TOL = 1e-5;
 
+  if (argc >= 2 && strcmp(argv[1], "predict") == 0) {
+    return predict_main(argc, argv);
+  }
+
   if (argc != 4) {
     fprintf(stderr, "Usage: %s K input_file output_file\n", argv[0]);
+    fprintf(stderr, "       %s predict model_file [input_file [output_file]]\n",
+            argv[0]);
     return EXIT_FAILURE;
   }
 
   srand(123); /* Deterministic initialization of the PRNG. */
 
+  const char* repro_env = getenv("KMEANS_REPRODUCIBLE");
+  reproducible = (repro_env != NULL && atoi(repro_env) != 0);
+
   n_clusters = atoi(argv[1]);
 
   if ((inputf = fopen(argv[2], "r")) == NULL) {
@@ -399,7 +1119,14 @@ int main(int argc, char* argv[]) {
   printf("Output file...... %s\n", argv[3]);
   printf("Data points (N).. %d\n", n_points);
   printf("Dimensions (D)... %d\n", n_dims);
-  printf("Clusters (K)..... %d\n\n", n_clusters);
+  printf("Clusters (K)..... %d\n", n_clusters);
+  if (sparse) {
+    printf("Nonzeros......... %d (sparse input)\n", nnz);
+  }
+  if (reproducible) {
+    printf("Reduction........ reproducible\n");
+  }
+  printf("\n");
 
   centroids = (float*)safe_malloc(n_clusters * n_dims * sizeof(*centroids));
   new_centroids =
@@ -408,6 +1135,16 @@ int main(int argc, char* argv[]) {
   counts = (int*)safe_malloc(n_clusters * sizeof(*counts));
 
   init_centroids();
+  if (reproducible) init_reproducible();
+  if (sparse) {
+    centroid_sqnorm =
+        (float*)safe_malloc(n_clusters * sizeof(*centroid_sqnorm));
+    update_centroid_sqnorms();
+  }
+
+#ifdef MAKE_MOVIE
+  snapshot_open();
+#endif
 
   printf("Main loop starts\n\n");
 
@@ -417,13 +1154,12 @@ int main(int argc, char* argv[]) {
   do {
     classify();
     /* The following lines are useful only if you want to generate
-       a movie of the evolution of the algorithm; if you are
-       taking times for performance evaluation purposes, remove
-       these lines, otherwise the time will be dominated by I/O
-       operations. */
+       a movie of the evolution of the algorithm, or to monitor a
+       long run. The frame is written by a background thread, so the
+       main loop only pays for copying the centroids and the changed
+       cluster assignments. */
 #ifdef MAKE_MOVIE
-    save_centroids(iter);
-    save_clusters(iter);
+    save_snapshot(iter);
 #endif
     maxsqshift = update_centroids();
     printf("Iteration %3d, maxsqshift = %f\n", iter, maxsqshift);
@@ -434,14 +1170,27 @@ int main(int argc, char* argv[]) {
   printf("\nMain loop completed\n");
   printf("Elapsed time %.3f\n\n", elapsed);
 
+#ifdef MAKE_MOVIE
+  snapshot_close();
+#endif
+
   save_results(outputf);
 
+  const char* model = getenv("KMEANS_MODEL");
+  if (model != NULL) save_model(model);
+
   fclose(outputf);
 
   free(data);
   free(centroids);
   free(cluster_of);
   free(counts);
+  free(row_ptr);
+  free(col_idx);
+  free(values);
+  free(point_sqnorm);
+  free(centroid_sqnorm);
+  free(block_sums);
 
   return EXIT_SUCCESS;
 }